@@ -0,0 +1,95 @@
+; sends and receives over a channel in a single VM; logs 0 (try_receive on
+; an empty channel), 42 (what came through), 0 (receive once closed), -1
+; (try_receive once closed)
+.data
+:name   5   'test', 0
+:msg    2   -
+
+.code
+    PI  2               ; c = chan_open(@name, 4, 2)
+    PI  4
+    PI  :name
+    PI  61
+    IN
+    PR.16
+
+    PI  :msg            ; log_word(chan_try_receive(c, @msg))
+    RP.16
+    PI  64
+    IN
+    PI  3
+    IN
+
+    PI  0               ; for(i = 0; i != 4; ++i) chan_send(c, {i, i * 10})
+    PR.0
+:send
+    RP.0
+    PI  4
+    SU
+    PI  :sent
+    JZ
+    PI  :msg
+    RP.0
+    ST
+    PI  :msg
+    PI  1
+    AD
+    RP.0
+    PI  10
+    MU
+    ST
+    PI  :msg
+    RP.16
+    PI  62
+    IN
+    RI.0
+    PI  :send
+    JP
+:sent
+    PI  0               ; sum = 0
+    PR.1
+    PI  4               ; for(i = 4; i; --i) {
+    PR.0
+:receive
+    RP.0
+    PI  :received
+    JZ
+    PI  :msg            ;   chan_receive(c, @msg)
+    RP.16
+    PI  63
+    IN
+    PR.2                ;   (got it)
+    PI  :msg            ;   sum += msg[0] + msg[1]
+    LD
+    PI  :msg
+    PI  1
+    AD
+    LD
+    AD
+    RP.1
+    AD
+    PR.1
+    RD.0
+    PI  :receive
+    JP                  ; }
+:received
+    RP.1                ; log_word(sum)
+    PI  3
+    IN
+
+    RP.16               ; chan_close(c)
+    PI  65
+    IN
+    PI  :msg            ; log_word(chan_receive(c, @msg))
+    RP.16
+    PI  63
+    IN
+    PI  3
+    IN
+    PI  :msg            ; log_word(chan_try_receive(c, @msg))
+    RP.16
+    PI  64
+    IN
+    PI  3
+    IN
+    HL
@@ -0,0 +1,102 @@
+; a few seconds of guest work that keeps state in every place a checkpoint
+; covers: registers, the stack, data, the heap and a short name; logs the
+; name and a checksum (always the same) at the end
+;
+; jakvmhs.bin -c ckpttest.ck ckpttest.hss, stopped with ^C and started
+; again any number of times, logs what a run straight through does
+.data
+:name   4   'sim', 0
+:heap   256 -
+
+.code
+    PI  :name           ; sn = assign_short_name("sim")
+    PI  1
+    IN
+    PR.5
+    PI  256             ; heap_init(heap, 256)
+    PI  :heap
+    PI  14
+    IN
+    PI  16              ; acc = alloc(16)
+    PI  15
+    IN
+    PR.4
+    PI  1               ; x = 1
+    PR.1
+    PI  2000            ; pass = 2000
+    PR.3
+    PI  0               ; a running sum lives on the stack
+:pass
+    RP.3
+    PI  :done
+    JZ                  ; while(pass) {
+    PI  4096            ;   i = 4096
+    PR.0
+:walk
+    RP.0
+    PI  :walked
+    JZ                  ;   while(i) {
+    RP.1                ;     x = x * 25173 + 13849
+    PI  25173
+    MU
+    PI  13849
+    AD
+    PR.1
+    RP.1                ;     sum += x
+    AD
+    DU                  ;     x ^= sum
+    RP.1
+    XR
+    PR.1
+    RD.0                ;     --i
+    PI  :walk
+    JP                  ;   }
+:walked
+    PR.6                ;   acc[pass & 15] ^= sum
+    RP.4
+    RP.3
+    PI  15
+    AN
+    AD
+    PR.7
+    RP.7
+    RP.7
+    LD
+    RP.6
+    XR
+    ST
+    RP.6
+    RD.3                ;   --pass
+    PI  :pass
+    JP                  ; }
+:done
+    PR.2                ; log_word(sum)
+    RP.2
+    PI  3
+    IN
+    PI  0               ; fold = acc[0] ^ ... ^ acc[15]
+    PR.2
+    PI  16
+    PR.0
+:fold
+    RP.0
+    PI  :folded
+    JZ
+    RD.0
+    RP.4
+    RP.0
+    AD
+    LD
+    RP.2
+    XR
+    PR.2
+    PI  :fold
+    JP
+:folded
+    RP.2                ; log_word(fold)
+    PI  3
+    IN
+    RP.5                ; log_string(sn)
+    PI  4
+    IN
+    HL
@@ -0,0 +1,657 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jakvmhs.h"
+
+// Associative containers for guest programs, referenced by handle.
+//
+// maps are open addressing hash tables (linear probing, backward shift
+// deletion, so no tombstones); sets are sorted: word keyed sets are a
+// 64k bit bitmap, string keyed sets a sorted array of strings
+//
+// containers are keyed either by words or by guest strings (pointers to
+// null terminated, one character per word strings); string keys are
+// copied, so the guest may reuse its buffers
+
+#define KIND_WORD 0
+#define KIND_STRING 1
+
+#define MAX_KEY 256
+
+typedef struct {
+    uint32_t hash;      // 0 means empty
+    unsigned_t wkey;
+    char* skey;
+    signed_t value;
+} entry_t;
+
+typedef struct {
+    size_t count, capacity; // capacity is a power of 2
+    entry_t* entries;
+} map_t;
+
+typedef struct {
+    size_t count, capacity;
+    uint64_t* bits;     // word keys
+    char** strings;     // string keys
+} set_t;
+
+typedef struct {
+    int isMap;
+    int kind;
+    union {
+        map_t map;
+        set_t set;
+    } u;
+} container_t;
+
+// the containers of one VM, kept in its state slot
+typedef struct {
+    container_t** items;
+    size_t count;
+} table_t;
+
+//-------------------------------------------------------------
+// helpers
+//-------------------------------------------------------------
+
+// view of n guest words starting @address; errors if out of memory
+static unsigned_t* words(vm_utilities_t vm, unsigned_t address, size_t n)
+{
+    if((size_t)address + n > 0x10000) vm.error(vm.ctx, "range out of memory");
+    return vm.deref(vm.ctx, address);
+}
+
+// decode a guest string into buf without allocating
+static size_t guest_string(vm_utilities_t vm, unsigned_t address, char* buf)
+{
+    unsigned_t* p = vm.deref(vm.ctx, address);
+    size_t len = 0;
+    for(; (size_t)address + len < 0x10000; ++len) {
+        char c = (p[len] & 0xFF00) >> 8;
+        if(!c) break;
+        if(len == MAX_KEY - 1) vm.error(vm.ctx, "string key too long");
+        buf[len] = c;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+// store a C string @address in guest encoding; returns its length
+static size_t put_guest_string(vm_utilities_t vm, unsigned_t address, char const* s)
+{
+    size_t len = strlen(s);
+    unsigned_t* p = words(vm, address, len + 1);
+    size_t i = 0;
+    for(; i < len; ++i) p[i] = (unsigned_t)(unsigned char)s[i] << 8;
+    p[len] = 0;
+    return len;
+}
+
+static uint32_t hash_word(unsigned_t w)
+{
+    uint32_t h = (uint32_t)w * 2654435761u;
+    return (h ^ (h >> 16)) | 1;
+}
+
+static uint32_t hash_string(char const* s)
+{
+    uint32_t h = 2166136261u;
+    for(; *s; ++s) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h | 1;
+}
+
+static table_t* get_table(vm_utilities_t vm)
+{
+    if(!*vm.state) *vm.state = calloc(1, sizeof(table_t));
+    return (table_t*)*vm.state;
+}
+
+static container_t* get_container(vm_utilities_t vm, unsigned_t h, int isMap)
+{
+    table_t* t = get_table(vm);
+    if(h == 0 || h > t->count || !t->items[h - 1]) vm.error(vm.ctx, "invalid container handle");
+    container_t* c = t->items[h - 1];
+    if(c->isMap != isMap) vm.error(vm.ctx, "container is of the wrong type");
+    return c;
+}
+
+static unsigned_t new_container(vm_utilities_t vm, int isMap, int kind)
+{
+    if(kind != KIND_WORD && kind != KIND_STRING) vm.error(vm.ctx, "invalid container kind");
+
+    table_t* t = get_table(vm);
+    size_t i = 0;
+    for(; i < t->count && t->items[i]; ++i)
+        ;
+    if(i == t->count) {
+        if(t->count == 0xFFFF) vm.error(vm.ctx, "out of container handles");
+        t->items = (container_t**)realloc(t->items, ++t->count * sizeof(container_t*));
+    }
+
+    container_t* c = (container_t*)calloc(1, sizeof(container_t));
+    c->isMap = isMap;
+    c->kind = kind;
+    if(!isMap && kind == KIND_WORD) c->u.set.bits = (uint64_t*)calloc(0x10000 / 64, sizeof(uint64_t));
+    t->items[i] = c;
+    return i + 1;
+}
+
+static void free_container(container_t* c)
+{
+    size_t i;
+    if(c->isMap) {
+        for(i = 0; i < c->u.map.capacity; ++i) free(c->u.map.entries[i].skey);
+        free(c->u.map.entries);
+    } else {
+        for(i = 0; i < c->u.set.count && c->u.set.strings; ++i) free(c->u.set.strings[i]);
+        free(c->u.set.strings);
+        free(c->u.set.bits);
+    }
+    free(c);
+}
+
+static void delete_container(vm_utilities_t vm, unsigned_t h, int isMap)
+{
+    free_container(get_container(vm, h, isMap));
+    get_table(vm)->items[h - 1] = NULL;
+}
+
+//-------------------------------------------------------------
+// maps
+//-------------------------------------------------------------
+
+// slot of key, or of the empty entry where it would go
+static size_t map_find(map_t* m, uint32_t hash, unsigned_t wkey, char const* skey)
+{
+    size_t mask = m->capacity - 1;
+    size_t i = hash & mask;
+    for(;; i = (i + 1) & mask) {
+        entry_t* e = &m->entries[i];
+        if(!e->hash) return i;
+        if(e->hash != hash) continue;
+        if(skey ? strcmp(e->skey, skey) == 0 : e->wkey == wkey) return i;
+    }
+}
+
+static void map_grow(map_t* m)
+{
+    map_t old = *m;
+    m->capacity = (old.capacity) ? old.capacity * 2 : 16;
+    m->entries = (entry_t*)calloc(m->capacity, sizeof(entry_t));
+
+    size_t i = 0;
+    for(; i < old.capacity; ++i) {
+        entry_t* e = &old.entries[i];
+        if(!e->hash) continue;
+        m->entries[map_find(m, e->hash, e->wkey, e->skey)] = *e;
+    }
+    free(old.entries);
+}
+
+static void map_put(map_t* m, uint32_t hash, unsigned_t wkey, char const* skey, signed_t value)
+{
+    // keep the load factor under 3/4
+    if((m->count + 1) * 4 > m->capacity * 3) map_grow(m);
+
+    entry_t* e = &m->entries[map_find(m, hash, wkey, skey)];
+    if(!e->hash) {
+        e->hash = hash;
+        e->wkey = wkey;
+        e->skey = (skey) ? strdup(skey) : NULL;
+        m->count++;
+    }
+    e->value = value;
+}
+
+static entry_t* map_get(map_t* m, uint32_t hash, unsigned_t wkey, char const* skey)
+{
+    if(!m->count) return NULL;
+    entry_t* e = &m->entries[map_find(m, hash, wkey, skey)];
+    return (e->hash) ? e : NULL;
+}
+
+static int map_remove(map_t* m, uint32_t hash, unsigned_t wkey, char const* skey)
+{
+    if(!m->count) return 0;
+    size_t mask = m->capacity - 1;
+    size_t i = map_find(m, hash, wkey, skey);
+    if(!m->entries[i].hash) return 0;
+
+    free(m->entries[i].skey);
+    m->count--;
+
+    // shift following entries of the cluster back into the hole
+    size_t j = i;
+    while(1) {
+        j = (j + 1) & mask;
+        entry_t* e = &m->entries[j];
+        if(!e->hash) break;
+        size_t home = e->hash & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            m->entries[i] = *e;
+            i = j;
+        }
+    }
+    memset(&m->entries[i], 0, sizeof(entry_t));
+    return 1;
+}
+
+// resolve a key operand; skey points into buf for string containers
+static uint32_t key_of(vm_utilities_t vm, container_t* c, unsigned_t operand, char* buf, char const** skey)
+{
+    if(c->kind == KIND_WORD) {
+        *skey = NULL;
+        return hash_word(operand);
+    }
+    guest_string(vm, operand, buf);
+    *skey = buf;
+    return hash_string(buf);
+}
+
+// (h) map_new(wKind)
+static void map_new_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t kind = vm.pop(vm.ctx);
+    vm.push(vm.ctx, new_container(vm, 1, kind));
+}
+
+// map_delete(h)
+static void map_delete_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t h = vm.pop(vm.ctx);
+    delete_container(vm, h, 1);
+}
+
+// map_put(h, key, wValue)
+static void map_put_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 1);
+    unsigned_t key = vm.pop(vm.ctx);
+    signed_t value = vm.pop(vm.ctx);
+
+    char buf[MAX_KEY];
+    char const* skey;
+    uint32_t hash = key_of(vm, c, key, buf, &skey);
+    map_put(&c->u.map, hash, key, skey, value);
+}
+
+// (wValue, wFound) map_get(h, key); wFound is on top
+static void map_get_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 1);
+    unsigned_t key = vm.pop(vm.ctx);
+
+    char buf[MAX_KEY];
+    char const* skey;
+    uint32_t hash = key_of(vm, c, key, buf, &skey);
+    entry_t* e = map_get(&c->u.map, hash, key, skey);
+    vm.push(vm.ctx, (e) ? e->value : 0);
+    vm.push(vm.ctx, e != NULL);
+}
+
+// (wFound) map_remove(h, key)
+static void map_remove_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 1);
+    unsigned_t key = vm.pop(vm.ctx);
+
+    char buf[MAX_KEY];
+    char const* skey;
+    uint32_t hash = key_of(vm, c, key, buf, &skey);
+    vm.push(vm.ctx, map_remove(&c->u.map, hash, key, skey));
+}
+
+// map_put_batch(h, pKeys, pValues, wCount)
+static void map_put_batch_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 1);
+    unsigned_t pKeys = vm.pop(vm.ctx);
+    unsigned_t pValues = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t* keys = words(vm, pKeys, count);
+    unsigned_t* values = words(vm, pValues, count);
+
+    char buf[MAX_KEY];
+    char const* skey;
+    size_t i = 0;
+    for(; i < count; ++i) {
+        uint32_t hash = key_of(vm, c, keys[i], buf, &skey);
+        map_put(&c->u.map, hash, keys[i], skey, values[i]);
+    }
+}
+
+// (wHits) map_get_batch(h, pKeys, wCount, pOut, wDefault)
+// missing keys get wDefault
+static void map_get_batch_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 1);
+    unsigned_t pKeys = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t pOut = vm.pop(vm.ctx);
+    signed_t dflt = vm.pop(vm.ctx);
+    unsigned_t* keys = words(vm, pKeys, count);
+    unsigned_t* out = words(vm, pOut, count);
+
+    char buf[MAX_KEY];
+    char const* skey;
+    size_t i = 0, hits = 0;
+    for(; i < count; ++i) {
+        uint32_t hash = key_of(vm, c, keys[i], buf, &skey);
+        entry_t* e = map_get(&c->u.map, hash, keys[i], skey);
+        out[i] = (e) ? e->value : dflt;
+        hits += (e != NULL);
+    }
+    vm.push(vm.ctx, hits);
+}
+
+// (wCount) map_size(h)
+static void map_size_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 1);
+    vm.push(vm.ctx, c->u.map.count);
+}
+
+//-------------------------------------------------------------
+// sets
+//-------------------------------------------------------------
+
+static int cmp_strings(void const* a, void const* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// index of the first string not less than s
+static size_t set_lower_bound(set_t* st, char const* s)
+{
+    size_t lo = 0, hi = st->count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(strcmp(st->strings[mid], s) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int set_add(container_t* c, unsigned_t wkey, char const* skey)
+{
+    set_t* st = &c->u.set;
+    if(c->kind == KIND_WORD) {
+        uint64_t bit = (uint64_t)1 << (wkey & 63);
+        if(st->bits[wkey >> 6] & bit) return 0;
+        st->bits[wkey >> 6] |= bit;
+        st->count++;
+        return 1;
+    }
+
+    size_t i = set_lower_bound(st, skey);
+    if(i < st->count && strcmp(st->strings[i], skey) == 0) return 0;
+    if(st->count == st->capacity) {
+        st->capacity = (st->capacity) ? st->capacity * 2 : 16;
+        st->strings = (char**)realloc(st->strings, st->capacity * sizeof(char*));
+    }
+    memmove(&st->strings[i + 1], &st->strings[i], (st->count - i) * sizeof(char*));
+    st->strings[i] = strdup(skey);
+    st->count++;
+    return 1;
+}
+
+static int set_has(container_t* c, unsigned_t wkey, char const* skey)
+{
+    set_t* st = &c->u.set;
+    if(c->kind == KIND_WORD) return (st->bits[wkey >> 6] >> (wkey & 63)) & 1;
+    size_t i = set_lower_bound(st, skey);
+    return i < st->count && strcmp(st->strings[i], skey) == 0;
+}
+
+static int set_remove(container_t* c, unsigned_t wkey, char const* skey)
+{
+    set_t* st = &c->u.set;
+    if(!set_has(c, wkey, skey)) return 0;
+    if(c->kind == KIND_WORD) {
+        st->bits[wkey >> 6] &= ~((uint64_t)1 << (wkey & 63));
+    } else {
+        size_t i = set_lower_bound(st, skey);
+        free(st->strings[i]);
+        memmove(&st->strings[i], &st->strings[i + 1], (st->count - i - 1) * sizeof(char*));
+    }
+    st->count--;
+    return 1;
+}
+
+// resolve a set key operand into buf for string sets
+static char const* set_key_of(vm_utilities_t vm, container_t* c, unsigned_t operand, char* buf)
+{
+    if(c->kind == KIND_WORD) return NULL;
+    guest_string(vm, operand, buf);
+    return buf;
+}
+
+// (h) set_new(wKind)
+static void set_new_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t kind = vm.pop(vm.ctx);
+    vm.push(vm.ctx, new_container(vm, 0, kind));
+}
+
+// set_delete(h)
+static void set_delete_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t h = vm.pop(vm.ctx);
+    delete_container(vm, h, 0);
+}
+
+// (wAdded) set_add(h, key)
+static void set_add_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t key = vm.pop(vm.ctx);
+    char buf[MAX_KEY];
+    vm.push(vm.ctx, set_add(c, key, set_key_of(vm, c, key, buf)));
+}
+
+// (wFound) set_has(h, key)
+static void set_has_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t key = vm.pop(vm.ctx);
+    char buf[MAX_KEY];
+    vm.push(vm.ctx, set_has(c, key, set_key_of(vm, c, key, buf)));
+}
+
+// (wFound) set_remove(h, key)
+static void set_remove_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t key = vm.pop(vm.ctx);
+    char buf[MAX_KEY];
+    vm.push(vm.ctx, set_remove(c, key, set_key_of(vm, c, key, buf)));
+}
+
+// (wAdded) set_add_batch(h, pKeys, wCount)
+static void set_add_batch_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t pKeys = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t* keys = words(vm, pKeys, count);
+    set_t* st = &c->u.set;
+    size_t i, added = 0;
+
+    if(c->kind == KIND_WORD) {
+        for(i = 0; i < count; ++i) added += set_add(c, keys[i], NULL);
+        vm.push(vm.ctx, added);
+        return;
+    }
+
+    // sort the batch and merge it in, instead of count memmoves
+    char buf[MAX_KEY];
+    char** batch = (char**)malloc((count + 1) * sizeof(char*));
+    size_t n = 0;
+    for(i = 0; i < count; ++i) {
+        guest_string(vm, keys[i], buf);
+        batch[n++] = strdup(buf);
+    }
+    qsort(batch, n, sizeof(char*), &cmp_strings);
+
+    char** merged = (char**)malloc((st->count + n + 1) * sizeof(char*));
+    size_t a = 0, b = 0, m = 0;
+    while(a < st->count || b < n) {
+        char* next;
+        if(b == n || (a < st->count && strcmp(st->strings[a], batch[b]) <= 0)) {
+            next = st->strings[a++];
+        } else {
+            next = batch[b++];
+            if(m > 0 && strcmp(merged[m - 1], next) == 0) {
+                free(next);
+                continue;
+            }
+            added++;
+        }
+        merged[m++] = next;
+    }
+    free(batch);
+    free(st->strings);
+    st->strings = merged;
+    st->count = st->capacity = m;
+    vm.push(vm.ctx, added);
+}
+
+// (wHits) set_has_batch(h, pKeys, wCount, pOut); pOut[i] = 0/1
+static void set_has_batch_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t pKeys = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t pOut = vm.pop(vm.ctx);
+    unsigned_t* keys = words(vm, pKeys, count);
+    unsigned_t* out = words(vm, pOut, count);
+
+    char buf[MAX_KEY];
+    size_t i = 0, hits = 0;
+    for(; i < count; ++i) {
+        out[i] = set_has(c, keys[i], set_key_of(vm, c, keys[i], buf));
+        hits += out[i];
+    }
+    vm.push(vm.ctx, hits);
+}
+
+// (wCount) set_size(h)
+static void set_size_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    vm.push(vm.ctx, c->u.set.count);
+}
+
+// (wRank) set_rank(h, key): number of elements less than key
+static void set_rank_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t key = vm.pop(vm.ctx);
+    set_t* st = &c->u.set;
+
+    if(c->kind == KIND_WORD) {
+        size_t i = 0, rank = 0;
+        for(; i < (size_t)(key >> 6); ++i) rank += __builtin_popcountll(st->bits[i]);
+        rank += __builtin_popcountll(st->bits[key >> 6] & (((uint64_t)1 << (key & 63)) - 1));
+        vm.push(vm.ctx, rank);
+        return;
+    }
+
+    char buf[MAX_KEY];
+    guest_string(vm, key, buf);
+    vm.push(vm.ctx, set_lower_bound(st, buf));
+}
+
+// (w) set_nth(h, wIndex, pOut)
+// word sets push the wIndex-th smallest key; string sets copy it @pOut
+// and push its length
+static void set_nth_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t index = vm.pop(vm.ctx);
+    unsigned_t pOut = vm.pop(vm.ctx);
+    set_t* st = &c->u.set;
+    if(index >= st->count) vm.error(vm.ctx, "set index out of range");
+
+    if(c->kind == KIND_STRING) {
+        vm.push(vm.ctx, put_guest_string(vm, pOut, st->strings[index]));
+        return;
+    }
+
+    size_t i = 0, left = index;
+    for(;; ++i) {
+        size_t n = __builtin_popcountll(st->bits[i]);
+        if(left < n) break;
+        left -= n;
+    }
+    uint64_t w = st->bits[i];
+    for(; left; --left) w &= w - 1;
+    vm.push(vm.ctx, i * 64 + __builtin_ctzll(w));
+}
+
+// (wCount) set_dump(h, pOut, wMax): write up to wMax word keys in order
+static void set_dump_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    container_t* c = get_container(vm, vm.pop(vm.ctx), 0);
+    unsigned_t pOut = vm.pop(vm.ctx);
+    unsigned_t max = vm.pop(vm.ctx);
+    if(c->kind != KIND_WORD) vm.error(vm.ctx, "set_dump needs a word set");
+    unsigned_t* out = words(vm, pOut, max);
+
+    size_t i = 0, n = 0;
+    for(; i < 0x10000 / 64 && n < max; ++i) {
+        uint64_t w = c->u.set.bits[i];
+        for(; w && n < max; w &= w - 1) out[n++] = i * 64 + __builtin_ctzll(w);
+    }
+    vm.push(vm.ctx, n);
+}
+
+utility_lib_t initialize()
+{
+    static utility_fn utils[] = {
+        &map_new_fn,
+        &map_delete_fn,
+        &map_put_fn,
+        &map_get_fn,
+        &map_remove_fn,
+        &map_put_batch_fn,
+        &map_get_batch_fn,
+        &map_size_fn,
+        &set_new_fn,
+        &set_delete_fn,
+        &set_add_fn,
+        &set_has_fn,
+        &set_remove_fn,
+        &set_add_batch_fn,
+        &set_has_batch_fn,
+        &set_size_fn,
+        &set_rank_fn,
+        &set_nth_fn,
+        &set_dump_fn,
+    };
+
+    static utility_lib_t ret = {
+        sizeof(utils) / sizeof(utils[0]),
+        utils
+    };
+
+    return ret;
+}
+
+// whatever the guest did not delete goes with its VM
+void release(void* state)
+{
+    table_t* t = (table_t*)state;
+    if(!t) return;
+    size_t i = 0;
+    for(; i < t->count; ++i) {
+        if(t->items[i]) free_container(t->items[i]);
+    }
+    free(t->items);
+    free(t);
+}
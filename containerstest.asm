@@ -0,0 +1,96 @@
+.data
+:lib    11  'containers', 0
+:keys   5   7, 3, 900, 3, 42
+:vals   5   70, 30, 9000, 31, 420
+:query  3   42, 5, 3
+:out    3   -
+:apple  6   'apple', 0
+:pear   5   'pear', 0
+:words  2   -
+:name   10  -
+
+.code
+    PI  0               ; m = map_new(word keys)
+    PI  0
+    PI  :lib
+    PI  20
+    IN
+    PR.16
+
+    PI  5               ; map_put_batch(m, @keys, @vals, 5)
+    PI  :vals
+    PI  :keys
+    RP.16
+    PI  5
+    PI  :lib
+    PI  20
+    IN
+
+    PI  -1              ; hits = map_get_batch(m, @query, 3, @out, -1)
+    PI  :out
+    PI  3
+    PI  :query
+    RP.16
+    PI  6
+    PI  :lib
+    PI  20
+    IN
+    PI  3               ; log_word(hits)
+    IN
+    PI  :out            ; log_word(out[0..2])
+    LD
+    PI  3
+    IN
+    PI  :out
+    PI  1
+    AD
+    LD
+    PI  3
+    IN
+    PI  :out
+    PI  2
+    AD
+    LD
+    PI  3
+    IN
+
+    PI  1               ; s = set_new(string keys)
+    PI  8
+    PI  :lib
+    PI  20
+    IN
+    PR.17
+
+    PI  :words          ; words = { @pear, @apple }
+    PI  :pear
+    ST
+    PI  :words
+    PI  1
+    AD
+    PI  :apple
+    ST
+
+    PI  2               ; set_add_batch(s, @words, 2)
+    PI  :words
+    RP.17
+    PI  13
+    PI  :lib
+    PI  20
+    IN
+    PI  3               ; log_word(added)
+    IN
+
+    PI  :name           ; set_nth(s, 0, @name)
+    PI  0
+    RP.17
+    PI  17
+    PI  :lib
+    PI  20
+    IN
+    PI  3               ; log_word(length)
+    IN
+    PI  :name           ; log_string_p(@name)
+    PI  5
+    IN
+
+    HL
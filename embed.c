@@ -0,0 +1,107 @@
+// embed.bin: an example of running guest code in process with libjakvmhs.
+// Loads an image into memory (embedtest.hss), gives it a utility of the
+// host's own (128: doubles a word), then
+//  - steps through a run of it, one instruction at a time,
+//  - times runs of it from the top, and
+//  - times calls into a sub of it, once it yielded, which is what a
+//    service calling guest code per request would do
+#define _GNU_SOURCE
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jakvmhs.h"
+
+#define RUNS 10000
+#define CALLS 1000000
+
+// twice(w): 2 * w
+static void twice(jakvm_t* vm, void* user)
+{
+    signed_t x = jakvm_pop(vm);
+    ++*(long*)user;
+    jakvm_push(vm, x * 2);
+}
+
+static char* read_file(char const* path, size_t* length)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    *length = ftell(f);
+    rewind(f);
+    char* p = (char*)malloc(*length);
+    if(fread(p, 1, *length, f) != *length) {
+        free(p);
+        p = NULL;
+    }
+    fclose(f);
+    return p;
+}
+
+static double us_since(struct timespec const* t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - t->tv_sec) * 1e9 + (now.tv_nsec - t->tv_nsec)) / 1e3;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 2) {
+        printf("Usage: %s embedtest.hss\n", argv[0]);
+        return 255;
+    }
+    size_t length;
+    char* image = read_file(argv[1], &length);
+    if(!image) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 255;
+    }
+    FILE* null = fopen("/dev/null", "w");
+    jakvm_t* vm = jakvm_new_from_memory(argv[1], image, length);
+    long calls = 0;
+    jakvm_register_utility(vm, 128, &twice, &calls);
+    jakvm_set_io(vm, stdin, null, stderr);
+    // :input, :output and :entry are the first words
+    unsigned_t* mem = jakvm_memory(vm);
+
+    int status = jakvm_load(vm);
+    long steps = 1;
+    if(!status) {
+        mem[0] = 21;
+        while((status = jakvm_step(vm)) == JAKVM_PAUSED) ++steps;
+    }
+    printf("stepped: status %d, output %d after %ld instructions\n", status, mem[1], steps);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long i = 0, wrong = 0;
+    for(; i < RUNS && !status; ++i) {
+        if((status = jakvm_load(vm))) break;
+        mem[0] = i & 0x3FFF;
+        while((status = jakvm_slice(vm, 0)) == JAKVM_PAUSED)
+            ;
+        if(mem[1] != (i & 0x3FFF) * 2) ++wrong;
+    }
+    printf("%ld runs (%ld wrong): %.2f us each\n", i, wrong, us_since(&start) / i);
+
+    // up to the yield, then call twice_plus_one over and over
+    if(!status && !(status = jakvm_load(vm))) status = jakvm_slice(vm, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    wrong = 0;
+    for(i = 0; i < CALLS && status == JAKVM_PAUSED; ++i) {
+        signed_t arg = i & 0x3FFF, result;
+        status = jakvm_call(vm, mem[2], 1, &arg, &result);
+        if(result != arg * 2 + 1) ++wrong;
+    }
+    printf("%ld calls (%ld wrong): %.3f us each\n", i, wrong, us_since(&start) / i);
+    if(status == JAKVM_PAUSED) status = jakvm_slice(vm, 0);
+    printf("utility called %ld times, status %d\n", calls, status);
+
+    jakvm_free(vm);
+    fclose(null);
+    free(image);
+    return status;
+}
@@ -0,0 +1,30 @@
+; run by embed.bin: hands :input to the host's utility 128 and keeps what
+; comes back in :output; then leaves the address of twice_plus_one in
+; :entry and yields, for the host to call it
+.data
+:input  1   0
+:output 1   0
+:entry  1   0
+
+.code
+    PI  :output         ; output = utility_128(input)
+    PI  :input
+    LD
+    PI  128
+    IN
+    ST
+    PI  :entry          ; entry = twice_plus_one
+    PI  :twice_plus_one
+    ST
+    PI  35              ; yield()
+    IN
+    HL
+
+;==========================================
+; twice_plus_one(w): utility_128(w) + 1
+:twice_plus_one
+    PI  128
+    IN
+    PI  1
+    AD
+    RT
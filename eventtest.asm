@@ -0,0 +1,35 @@
+; ticks five times, 100ms apart, without spinning
+.code
+    PI  100             ; t = timer_arm(100, 100)
+    PI  100
+    PI  30
+    IN
+    PR.16
+
+    PI  5               ; n = 5
+    PR.0
+:loop
+    RP.0
+    PI  :done
+    JZ                  ; while(n) {
+    PI  -1              ;   log_word(wait_event(forever))
+    PI  33
+    IN
+    PI  3
+    IN
+    RD.0                ;   --n
+    PI  :loop
+    JP                  ; }
+:done
+    RP.16               ; timer_cancel(t)
+    PI  31
+    IN
+    PI  50              ; sleep(50)
+    PI  34
+    IN
+    PI  0               ; log_word(wait_event(0)), nothing left: 0
+    PI  33
+    IN
+    PI  3
+    IN
+    HL
@@ -0,0 +1,421 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "jakvmhs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+// Fixed point arithmetic over whole arrays of guest words.
+//
+// wFrac is the number of fractional bits: 8 for Q8.8, 15 for Q1.15, any
+// of 0..15 works; results are rounded to nearest and saturated to 16 bits
+// arrays may alias (pOut may be pA)
+//
+// angles are binary angles: a full turn is 65536, so 0x4000 is 90 degrees;
+// sin and cos come from a 4096 entry table with linear interpolation
+//
+// every operation has an AVX2 kernel for blocks of 16 words, picked at
+// initialize time, and plain C for what is left over
+
+#define TABLE_BITS 12
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+static int32_t g_sin[TABLE_SIZE + 1];  // Q1.15, one extra for interpolating
+static int g_avx2 = 0;
+
+//-------------------------------------------------------------
+// helpers
+//-------------------------------------------------------------
+
+static signed_t* words(vm_utilities_t vm, unsigned_t address, size_t n)
+{
+    if((size_t)address + n > 0x10000) vm.error(vm.ctx, "range out of memory");
+    return (signed_t*)vm.deref(vm.ctx, address);
+}
+
+static unsigned frac_of(vm_utilities_t vm, unsigned_t frac)
+{
+    if(frac > 15) vm.error(vm.ctx, "invalid number of fractional bits");
+    return frac;
+}
+
+static signed_t saturate(int64_t x)
+{
+    return (x > 32767) ? 32767 : (x < -32768) ? -32768 : x;
+}
+
+static int32_t round_of(unsigned frac)
+{
+    return (frac) ? 1 << (frac - 1) : 0;
+}
+
+static signed_t mul1(signed_t a, signed_t b, unsigned frac)
+{
+    return saturate(((int32_t)a * b + round_of(frac)) >> frac);
+}
+
+static signed_t sqrt1(signed_t a, unsigned frac)
+{
+    if(a <= 0) return 0;
+    uint32_t x = (uint32_t)a << frac;
+    uint32_t r = (uint32_t)sqrt((double)x);
+    while(r * r > x) --r;
+    while((r + 1) * (r + 1) <= x) ++r;
+    return r;
+}
+
+// sin of a binary angle in Q1.15
+static int32_t sin15(unsigned_t angle)
+{
+    unsigned i = angle >> (16 - TABLE_BITS);
+    int32_t f = angle & ((1 << (16 - TABLE_BITS)) - 1);
+    return g_sin[i] + (((g_sin[i + 1] - g_sin[i]) * f + 8) >> (16 - TABLE_BITS));
+}
+
+static signed_t sin1(unsigned_t angle, unsigned frac)
+{
+    int32_t s = sin15(angle);
+    unsigned shift = 15 - frac;
+    return (shift) ? (s + (1 << (shift - 1))) >> shift : s;
+}
+
+//-------------------------------------------------------------
+// AVX2 kernels; each returns how many elements it did
+//-------------------------------------------------------------
+
+#ifdef HAVE_AVX2
+// b == NULL multiplies by gain
+__attribute__((target("avx2")))
+static size_t mul_avx2(signed_t const* a, signed_t const* b, signed_t gain, signed_t* out, size_t n, unsigned frac)
+{
+    __m256i g = _mm256_set1_epi16(gain);
+    __m256i rnd = _mm256_set1_epi32(round_of(frac));
+    __m128i sh = _mm_cvtsi32_si128(frac);
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((__m256i const*)&a[i]);
+        __m256i y = (b) ? _mm256_loadu_si256((__m256i const*)&b[i]) : g;
+        __m256i lo = _mm256_mullo_epi16(x, y);
+        __m256i hi = _mm256_mulhi_epi16(x, y);
+        // 32 bit products; unpack and packs undo each other's order
+        __m256i p0 = _mm256_unpacklo_epi16(lo, hi);
+        __m256i p1 = _mm256_unpackhi_epi16(lo, hi);
+        p0 = _mm256_sra_epi32(_mm256_add_epi32(p0, rnd), sh);
+        p1 = _mm256_sra_epi32(_mm256_add_epi32(p1, rnd), sh);
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_packs_epi32(p0, p1));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t addsub_avx2(signed_t const* a, signed_t const* b, signed_t* out, size_t n, int sub)
+{
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((__m256i const*)&a[i]);
+        __m256i y = _mm256_loadu_si256((__m256i const*)&b[i]);
+        __m256i r = (sub) ? _mm256_subs_epi16(x, y) : _mm256_adds_epi16(x, y);
+        _mm256_storeu_si256((__m256i*)&out[i], r);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t dot_avx2(signed_t const* a, signed_t const* b, size_t n, int64_t* sum)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((__m256i const*)&a[i]);
+        __m256i y = _mm256_loadu_si256((__m256i const*)&b[i]);
+        // one product fits 32 bits but a pair may not (-32768 * -32768 * 2
+        // is 2^31), so widen each product to 64 bits before adding
+        __m256i lo = _mm256_mullo_epi16(x, y);
+        __m256i hi = _mm256_mulhi_epi16(x, y);
+        __m256i p0 = _mm256_unpacklo_epi16(lo, hi);
+        __m256i p1 = _mm256_unpackhi_epi16(lo, hi);
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(p0)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(p0, 1)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(p1)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(p1, 1)));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    *sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return i;
+}
+
+// floor(sqrt(x << frac)) for 8 lanes of 32 bit x
+__attribute__((target("avx2")))
+static __m256i sqrt8(__m256i x, __m128i sh)
+{
+    x = _mm256_sll_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), sh);
+    __m256i r = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(x)));
+    // float is close but not exact: one correction step either way
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i over = _mm256_cmpgt_epi32(_mm256_mullo_epi32(r, r), x);
+    r = _mm256_add_epi32(r, over);
+    __m256i r1 = _mm256_add_epi32(r, one);
+    __m256i under = _mm256_cmpgt_epi32(_mm256_mullo_epi32(r1, r1), x);
+    return _mm256_add_epi32(r, _mm256_andnot_si256(under, one));
+}
+
+__attribute__((target("avx2")))
+static size_t sqrt_avx2(signed_t const* a, signed_t* out, size_t n, unsigned frac)
+{
+    __m128i sh = _mm_cvtsi32_si128(frac);
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((__m256i const*)&a[i]);
+        __m256i r0 = sqrt8(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(x)), sh);
+        __m256i r1 = sqrt8(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1)), sh);
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi32(r0, r1), 0xD8);
+        _mm256_storeu_si256((__m256i*)&out[i], r);
+    }
+    return i;
+}
+
+// sin15 of 8 lanes of 32 bit angles
+__attribute__((target("avx2")))
+static __m256i sin8(__m256i angle)
+{
+    __m256i idx = _mm256_srli_epi32(angle, 16 - TABLE_BITS);
+    __m256i f = _mm256_and_si256(angle, _mm256_set1_epi32((1 << (16 - TABLE_BITS)) - 1));
+    __m256i s0 = _mm256_i32gather_epi32((int const*)g_sin, idx, 4);
+    __m256i s1 = _mm256_i32gather_epi32((int const*)g_sin + 1, idx, 4);
+    __m256i d = _mm256_mullo_epi32(_mm256_sub_epi32(s1, s0), f);
+    d = _mm256_srai_epi32(_mm256_add_epi32(d, _mm256_set1_epi32(8)), 16 - TABLE_BITS);
+    return _mm256_add_epi32(s0, d);
+}
+
+__attribute__((target("avx2")))
+static size_t sin_avx2(unsigned_t const* a, signed_t* out, size_t n, unsigned_t phase, unsigned frac)
+{
+    __m256i ph = _mm256_set1_epi16(phase);
+    unsigned shift = 15 - frac;
+    __m256i rnd = _mm256_set1_epi32((shift) ? 1 << (shift - 1) : 0);
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_add_epi16(_mm256_loadu_si256((__m256i const*)&a[i]), ph);
+        __m256i s0 = sin8(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(x)));
+        __m256i s1 = sin8(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(x, 1)));
+        s0 = _mm256_sra_epi32(_mm256_add_epi32(s0, rnd), sh);
+        s1 = _mm256_sra_epi32(_mm256_add_epi32(s1, rnd), sh);
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi32(s0, s1), 0xD8);
+        _mm256_storeu_si256((__m256i*)&out[i], r);
+    }
+    return i;
+}
+#endif
+
+//-------------------------------------------------------------
+// utilities
+//-------------------------------------------------------------
+
+// fx_mul(pA, pB, pOut, wCount, wFrac): out = a * b
+static void fx_mul_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pA = vm.pop(vm.ctx), pB = vm.pop(vm.ctx), pOut = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned frac = frac_of(vm, vm.pop(vm.ctx));
+    signed_t* a = words(vm, pA, count);
+    signed_t* b = words(vm, pB, count);
+    signed_t* out = words(vm, pOut, count);
+
+    size_t i = 0;
+#ifdef HAVE_AVX2
+    if(g_avx2) i = mul_avx2(a, b, 0, out, count, frac);
+#endif
+    for(; i < count; ++i) out[i] = mul1(a[i], b[i], frac);
+}
+
+// fx_scale(pA, wGain, pOut, wCount, wFrac): out = a * gain
+static void fx_scale_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pA = vm.pop(vm.ctx);
+    signed_t gain = vm.pop(vm.ctx);
+    unsigned_t pOut = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned frac = frac_of(vm, vm.pop(vm.ctx));
+    signed_t* a = words(vm, pA, count);
+    signed_t* out = words(vm, pOut, count);
+
+    size_t i = 0;
+#ifdef HAVE_AVX2
+    if(g_avx2) i = mul_avx2(a, NULL, gain, out, count, frac);
+#endif
+    for(; i < count; ++i) out[i] = mul1(a[i], gain, frac);
+}
+
+static void addsub(vm_utilities_t vm, int sub)
+{
+    unsigned_t pA = vm.pop(vm.ctx), pB = vm.pop(vm.ctx), pOut = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    signed_t* a = words(vm, pA, count);
+    signed_t* b = words(vm, pB, count);
+    signed_t* out = words(vm, pOut, count);
+
+    size_t i = 0;
+#ifdef HAVE_AVX2
+    if(g_avx2) i = addsub_avx2(a, b, out, count, sub);
+#endif
+    for(; i < count; ++i) out[i] = saturate((int32_t)a[i] + ((sub) ? -(int32_t)b[i] : b[i]));
+}
+
+// fx_add(pA, pB, pOut, wCount): out = a + b, saturating
+static void fx_add_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    addsub(vm, 0);
+}
+
+// fx_sub(pA, pB, pOut, wCount): out = a - b, saturating
+static void fx_sub_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    addsub(vm, 1);
+}
+
+// (w) fx_dot(pA, pB, wCount, wFrac): sum of a * b
+static void fx_dot_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pA = vm.pop(vm.ctx), pB = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned frac = frac_of(vm, vm.pop(vm.ctx));
+    signed_t* a = words(vm, pA, count);
+    signed_t* b = words(vm, pB, count);
+
+    int64_t sum = 0;
+    size_t i = 0;
+#ifdef HAVE_AVX2
+    if(g_avx2) i = dot_avx2(a, b, count, &sum);
+#endif
+    for(; i < count; ++i) sum += (int32_t)a[i] * b[i];
+    vm.push(vm.ctx, saturate((sum + round_of(frac)) >> frac));
+}
+
+// fx_sqrt(pA, pOut, wCount, wFrac): out = sqrt(a), 0 for negative a
+static void fx_sqrt_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pA = vm.pop(vm.ctx), pOut = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned frac = frac_of(vm, vm.pop(vm.ctx));
+    signed_t* a = words(vm, pA, count);
+    signed_t* out = words(vm, pOut, count);
+
+    size_t i = 0;
+#ifdef HAVE_AVX2
+    if(g_avx2) i = sqrt_avx2(a, out, count, frac);
+#endif
+    for(; i < count; ++i) out[i] = sqrt1(a[i], frac);
+}
+
+static void sin_or_cos(vm_utilities_t vm, unsigned_t phase)
+{
+    unsigned_t pA = vm.pop(vm.ctx), pOut = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned frac = frac_of(vm, vm.pop(vm.ctx));
+    unsigned_t* a = (unsigned_t*)words(vm, pA, count);
+    signed_t* out = words(vm, pOut, count);
+
+    size_t i = 0;
+#ifdef HAVE_AVX2
+    if(g_avx2) i = sin_avx2(a, out, count, phase, frac);
+#endif
+    for(; i < count; ++i) out[i] = sin1(a[i] + phase, frac);
+}
+
+// fx_sin(pAngles, pOut, wCount, wFrac)
+static void fx_sin_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    sin_or_cos(vm, 0);
+}
+
+// fx_cos(pAngles, pOut, wCount, wFrac)
+static void fx_cos_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    sin_or_cos(vm, 0x4000);
+}
+
+// fx_fft(pData, wLog2N, wInverse): in place radix 2 FFT of N = 2^wLog2N
+// interleaved (re, im) Q1.15 pairs, N <= 4096; every stage halves, so
+// the result is the transform divided by N (in both directions)
+static void fx_fft_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pData = vm.pop(vm.ctx);
+    unsigned_t log2n = vm.pop(vm.ctx);
+    int inverse = vm.pop(vm.ctx) != 0;
+    if(log2n > TABLE_BITS) vm.error(vm.ctx, "FFT too long");
+    size_t n = (size_t)1 << log2n;
+    signed_t* x = words(vm, pData, 2 * n);
+
+    size_t i, j, k;
+    for(i = 1, j = 0; i < n; ++i) {
+        size_t bit = n >> 1;
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if(i < j) {
+            signed_t t;
+            t = x[2 * i]; x[2 * i] = x[2 * j]; x[2 * j] = t;
+            t = x[2 * i + 1]; x[2 * i + 1] = x[2 * j + 1]; x[2 * j + 1] = t;
+        }
+    }
+
+    size_t len;
+    for(len = 2; len <= n; len <<= 1) {
+        size_t step = TABLE_SIZE / len;  // table entries per twiddle
+        for(k = 0; k < len / 2; ++k) {
+            size_t t = k * step;
+            int32_t wr = g_sin[(t + TABLE_SIZE / 4) % TABLE_SIZE];
+            int32_t wi = (inverse) ? g_sin[t] : -g_sin[t];
+            for(i = k; i < n; i += len) {
+                signed_t* a = &x[2 * i];
+                signed_t* b = &x[2 * (i + len / 2)];
+                int32_t tr = ((int64_t)b[0] * wr - (int64_t)b[1] * wi + 0x4000) >> 15;
+                int32_t ti = ((int64_t)b[0] * wi + (int64_t)b[1] * wr + 0x4000) >> 15;
+                int32_t ar = a[0], ai = a[1];
+                a[0] = (ar + tr + 1) >> 1;
+                a[1] = (ai + ti + 1) >> 1;
+                b[0] = (ar - tr + 1) >> 1;
+                b[1] = (ai - ti + 1) >> 1;
+            }
+        }
+    }
+}
+
+// runs once, when the library is loaded, however many VMs use it
+__attribute__((constructor)) static void setup()
+{
+    size_t i = 0;
+    for(; i <= TABLE_SIZE; ++i) g_sin[i] = lround(sin(2 * M_PI * i / TABLE_SIZE) * 32767);
+
+#ifdef HAVE_AVX2
+    __builtin_cpu_init();
+    g_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+utility_lib_t initialize()
+{
+    static utility_fn utils[] = {
+        &fx_mul_fn,
+        &fx_scale_fn,
+        &fx_add_fn,
+        &fx_sub_fn,
+        &fx_dot_fn,
+        &fx_sqrt_fn,
+        &fx_sin_fn,
+        &fx_cos_fn,
+        &fx_fft_fn,
+    };
+
+    static utility_lib_t ret = {
+        sizeof(utils) / sizeof(utils[0]),
+        utils
+    };
+
+    return ret;
+}
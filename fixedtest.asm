@@ -0,0 +1,52 @@
+.data
+:lib    6   'fixed', 0
+:two    1   0x0200          ; 2.0 in Q8.8
+:angles 2   0, 0x4000       ; 0 and 90 degrees
+:out    2   -
+:min    16  -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768
+
+.code
+    PI  8               ; fx_sqrt(@two, @out, 1, Q8.8)
+    PI  1
+    PI  :out
+    PI  :two
+    PI  5
+    PI  :lib
+    PI  20
+    IN
+    PI  :out            ; log_word(sqrt(2.0)), 0x16A
+    LD
+    PI  3
+    IN
+
+    PI  15              ; fx_sin(@angles, @out, 2, Q1.15)
+    PI  2
+    PI  :out
+    PI  :angles
+    PI  6
+    PI  :lib
+    PI  20
+    IN
+    PI  :out            ; log_word(sin 0), log_word(sin 90)
+    LD
+    PI  3
+    IN
+    PI  :out
+    PI  1
+    AD
+    LD
+    PI  3
+    IN
+
+    PI  15              ; log_word(fx_dot(@min, @min, 16, Q1.15)), saturates to 0x7FFF
+    PI  16
+    PI  :min
+    PI  :min
+    PI  4
+    PI  :lib
+    PI  20
+    IN
+    PI  3
+    IN
+
+    HL
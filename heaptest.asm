@@ -0,0 +1,73 @@
+.data
+:stats  6   -           ; the heap must not start at 0
+:heap   1024 -
+
+.code
+    PI  1024            ; heap_init(@heap, 1024)
+    PI  :heap
+    PI  14
+    IN
+
+    PI  10              ; a = alloc(10)
+    PI  15
+    IN
+    PR.16
+    PI  3               ; b = alloc(3)
+    PI  15
+    IN
+    PR.17
+    PI  10              ; c = alloc(10)
+    PI  15
+    IN
+    PR.18
+
+    RP.16               ; free(a)
+    PI  16
+    IN
+    PI  9               ; d = alloc(9), reuses a
+    PI  15
+    IN
+    PR.19
+    RP.16
+    RP.19
+    SU
+    PI  3               ; log_word(a - d)
+    IN
+
+    RP.17               ; free(b)
+    PI  16
+    IN
+
+    PI  :stats          ; heap_stats(@stats)
+    PI  17
+    IN
+
+    PI  0               ; i = 0
+    PR.0
+:loop
+    RP.0
+    PI  6
+    SU
+    PI  :done
+    JZ                  ; while(i != 6) {
+    PI  :stats          ;   log_word(stats[i])
+    RP.0
+    AD
+    LD
+    PI  3
+    IN
+    RI.0                ;   ++i
+    PI  :loop
+    JP                  ; }
+:done
+    PI  32768           ; log_word(alloc(0x8000)): 0, it does not fit
+    PI  15
+    IN
+    PI  3
+    IN
+    PI  1024            ; log_word(alloc(1024)): 0, nor does the region
+    PI  15
+    IN
+    PI  3
+    IN
+    HL
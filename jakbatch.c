@@ -0,0 +1,255 @@
+// Batch runner: runs a list of jobs (an image and what it reads on stdin)
+// on a pool of threads, each with a VM of its own that it reuses from job
+// to job. Every image is loaded once, into a snapshot the jobs running it
+// map copy on write.
+//
+// Jobs are dealt out to the threads in contiguous runs; a thread that
+// runs out steals the back half of what another one has left, so a few
+// long jobs do not leave the other threads idle.
+//
+// A job's stdout and stderr are captured; once everything ran, they are
+// printed in job order after a line with the job's exit status (or
+// written to DIR/<job>.out and DIR/<job>.err with -o DIR), along with the
+// memory the job's VM had to itself. The throughput goes to stderr.
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "jakvmhs.h"
+
+typedef struct {
+    char* image;
+    char* input;                // NULL for an empty stdin
+    int snapshot;               // the image, loaded
+    int status;
+    size_t rss;                 // bytes the VM had to itself
+    char* out;                  // captured stdout and stderr
+    size_t outLen;
+    char* err;
+    size_t errLen;
+} job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t top, bottom;         // jobs [top, bottom) are left
+} deque_t;
+
+typedef struct {
+    pthread_t thread;
+    size_t self;
+} worker_t;
+
+static job_t* g_jobs;
+static size_t g_numJobs;
+static deque_t* g_deques;
+static size_t g_numWorkers;
+
+static long ms_since(struct timespec const* t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void batch_usage(char const* name)
+{
+    printf("Usage: %s [-j N] [-o DIR] jobs.txt\n", name);
+    printf("    jobs.txt has a job per line: image.hss [input]; - reads\n");
+    printf("    the list from stdin\n");
+    exit(255);
+}
+
+// reads the job list; blank lines and lines starting with # do not count
+static void read_jobs(char const* path)
+{
+    FILE* f = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if(!f) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(255);
+    }
+    char* line = NULL;
+    size_t cap = 0, maxJobs = 0;
+    while(getline(&line, &cap, f) != -1) {
+        char* image = strtok(line, " \t\r\n");
+        if(!image || image[0] == '#') continue;
+        char* input = strtok(NULL, " \t\r\n");
+        if(g_numJobs == maxJobs) {
+            maxJobs = (maxJobs) ? maxJobs * 2 : 64;
+            g_jobs = (job_t*)realloc(g_jobs, maxJobs * sizeof(job_t));
+        }
+        job_t* j = &g_jobs[g_numJobs++];
+        memset(j, 0, sizeof(job_t));
+        j->image = strdup(image);
+        if(input) j->input = strdup(input);
+    }
+    free(line);
+    if(f != stdin) fclose(f);
+}
+
+// loads every image once; the jobs running it share the snapshot
+static void read_images()
+{
+    size_t i = 0;
+    for(; i < g_numJobs; ++i) {
+        size_t k = 0;
+        for(; k < i && strcmp(g_jobs[k].image, g_jobs[i].image) != 0; ++k)
+            ;
+        // without one, the job fails the usual way when it runs
+        g_jobs[i].snapshot = (k < i) ? g_jobs[k].snapshot : jakvm_snapshot_image(g_jobs[i].image);
+    }
+}
+
+static void run_job(jakvm_t* vm, job_t* j)
+{
+    FILE* in = fopen((j->input) ? j->input : "/dev/null", "r");
+    FILE* out = open_memstream(&j->out, &j->outLen);
+    FILE* err = open_memstream(&j->err, &j->errLen);
+    jakvm_set_image(vm, j->image, j->snapshot);
+    jakvm_set_io(vm, in, out, err);
+    if(!in) {
+        fprintf(err, "cannot open %s\n", j->input);
+        j->status = 255;
+    } else {
+        j->status = jakvm_run(vm);
+        j->rss = jakvm_rss(vm);
+        fclose(in);
+    }
+    fclose(out);
+    fclose(err);
+}
+
+static bool take(size_t self, size_t* job)
+{
+    deque_t* d = &g_deques[self];
+    pthread_mutex_lock(&d->lock);
+    bool got = d->top < d->bottom;
+    if(got) *job = d->top++;
+    pthread_mutex_unlock(&d->lock);
+    return got;
+}
+
+// moves the back half of somebody else's jobs over; false when nobody
+// has any left
+static bool steal(size_t self)
+{
+    size_t i = 1;
+    for(; i < g_numWorkers; ++i) {
+        deque_t* v = &g_deques[(self + i) % g_numWorkers];
+        pthread_mutex_lock(&v->lock);
+        size_t left = v->bottom - v->top;
+        size_t from = v->bottom - (left + 1) / 2, to = v->bottom;
+        v->bottom = from;
+        pthread_mutex_unlock(&v->lock);
+        if(left) {
+            deque_t* d = &g_deques[self];
+            pthread_mutex_lock(&d->lock);
+            d->top = from;
+            d->bottom = to;
+            pthread_mutex_unlock(&d->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* work(void* p)
+{
+    worker_t* w = (worker_t*)p;
+    jakvm_t* vm = jakvm_new("");
+    if(!vm) {
+        fprintf(stderr, "out of memory\n");
+        exit(42);
+    }
+    size_t job;
+    while(take(w->self, &job) || (steal(w->self) && take(w->self, &job))) {
+        run_job(vm, &g_jobs[job]);
+    }
+    jakvm_free(vm);
+    return NULL;
+}
+
+static void write_file(char const* dir, size_t i, char const* ext, char const* p, size_t n)
+{
+    char name[4096];
+    snprintf(name, sizeof(name), "%s/%lu.%s", dir, (unsigned long)i, ext);
+    FILE* f = fopen(name, "w");
+    if(!f || fwrite(p, 1, n, f) != n) {
+        fprintf(stderr, "cannot write %s\n", name);
+        exit(255);
+    }
+    fclose(f);
+}
+
+int main(int argc, char* argv[])
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    char const* dir = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "hj:o:")) != -1) {
+        switch(opt) {
+        case 'j':
+            n = atol(optarg);
+            break;
+        case 'o':
+            dir = optarg;
+            break;
+        default:
+            batch_usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || n < 1) batch_usage(argv[0]);
+
+    read_jobs(argv[optind]);
+    if(!g_numJobs) return 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    read_images();
+
+    g_numWorkers = ((size_t)n < g_numJobs) ? (size_t)n : g_numJobs;
+    g_deques = (deque_t*)calloc(g_numWorkers, sizeof(deque_t));
+    worker_t* workers = (worker_t*)calloc(g_numWorkers, sizeof(worker_t));
+    size_t i = 0;
+    for(; i < g_numWorkers; ++i) {
+        pthread_mutex_init(&g_deques[i].lock, NULL);
+        g_deques[i].top = g_numJobs * i / g_numWorkers;
+        g_deques[i].bottom = g_numJobs * (i + 1) / g_numWorkers;
+    }
+    for(i = 0; i < g_numWorkers; ++i) {
+        workers[i].self = i;
+        if(pthread_create(&workers[i].thread, NULL, &work, &workers[i])) {
+            fprintf(stderr, "failed to start worker %lu\n", (unsigned long)i);
+            exit(42);
+        }
+    }
+    for(i = 0; i < g_numWorkers; ++i) pthread_join(workers[i].thread, NULL);
+    long ms = ms_since(&start);
+
+    int status = 0;
+    size_t failed = 0;
+    for(i = 0; i < g_numJobs; ++i) {
+        job_t* j = &g_jobs[i];
+        printf("== job %lu: %s%s%s: status %d, %zu KB\n", (unsigned long)i, j->image,
+                (j->input) ? " < " : "", (j->input) ? j->input : "", j->status, j->rss / 1024);
+        if(dir) {
+            write_file(dir, i, "out", j->out, j->outLen);
+            write_file(dir, i, "err", j->err, j->errLen);
+        } else {
+            fwrite(j->out, 1, j->outLen, stdout);
+            fwrite(j->err, 1, j->errLen, stdout);
+        }
+        if(j->status) ++failed;
+        if(j->status > status) status = j->status;
+    }
+    fflush(stdout);
+    fprintf(stderr, "%lu jobs (%lu failed) in %ld ms on %lu threads: %.1f jobs/s\n",
+            (unsigned long)g_numJobs, (unsigned long)failed, ms, (unsigned long)g_numWorkers,
+            (ms) ? g_numJobs * 1000.0 / ms : 0.0);
+    return status;
+}
@@ -1,56 +1,337 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <signal.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <errno.h>
 
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdbool.h>
+#include <setjmp.h>
 
 #include "jakvmhs.h"
+#include "oddities/sn.h"
 
-struct {
+//============================================================
+// VM state
+//============================================================
 #define RA 30
 #define SP 31
 #define IP 32
 #define RLAST 33
-    signed_t regs[RLAST];
-    code_t code[0x10000];
-    signed_t data[0x10000];
+typedef struct {
+    // every part is page aligned (for any page size up to 64k): code so
+    // it can be mapped read only and shared, data so files can be mapped
+    // over parts of it
+    code_t code[0x10000] __attribute__((aligned(0x10000)));
+    signed_t regs[RLAST] __attribute__((aligned(0x10000)));
+    signed_t data[0x10000] __attribute__((aligned(0x10000)));
 
     signed_t stack_data[0x10000];
-} machine;
-
-#define cassert(X) (!(X) ? fprintf(stderr, "Assertion failed at %s:%d in %s:\n\t%s\n", __FILE__, __LINE__, __func__, #X), exit(42), 0 : 1)
+} machine_t;
+
+// The save file is a paged store. Page 0 holds the header, the slot
+// directory and the root area (what utilities 10-13 see); named slots are
+// runs of whole pages after it, allocated at the end of the file. Every
+// limit is read from the header, so bigger stores only need a new format
+// version, not a new VM.
+//
+// While it is open, the live copy of the store is a POSIX shared memory
+// object mapped by every process running the image: a control block with
+// the locks, then the store pages. Writes land there and in a redo log next
+// to the store (.wal), one checksummed frame per committed transaction,
+// and only reach the .sav when a checkpoint copies the pages the log
+// touched, after the log is on disk. A crash at any point loses at most
+// the transactions whose frames were not synced yet; the log is replayed
+// by the first process to open the store again.
+//
+// The header, the root and every slot have a lock of their own. A
+// transaction takes the locks of what it touches and keeps them until it
+// ends, so transactions on different slots never wait for each other. The
+// locks are robust: when a process dies holding one, the next owner puts
+// back the committed contents of what it covers.
+#define STORE_MAGIC "JKST"
+#define STORE_VERSION 1
+#define STORE_PAGE_WORDS 2048
+#define STORE_PAGE_BYTES (STORE_PAGE_WORDS * sizeof(signed_t))
+#define STORE_LEGACY_BYTES 512u
+#define STORE_NAME_MAX 24
+#define STORE_CTL_MAGIC 0x4C544B4Au // "JKTL"
+#define STORE_LOCKS (2 + 64)        // header, root, slots
+#define STORE_PROCS 128
+#define STORE_LOCK_TIMEOUT 10       // seconds, then it is a deadlock
+#define LOCK_HEADER 0
+#define LOCK_ROOT 1
+#define LOCK_SLOT(H) (1 + (H))
+#define WAL_MAGIC 0x4C574B4Au // "JKWL"
+#define WAL_CHECKPOINT_BYTES (1u << 20)
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t page_words;
+    uint32_t pages;             // in the file, header page included
+    uint16_t root_offset;       // in words, into the header page
+    uint16_t root_words;
+    uint16_t max_slots;
+    uint16_t slots;             // in use
+    uint32_t reserved[3];
+} store_header_t;
+
+typedef struct {
+    char name[STORE_NAME_MAX];
+    uint32_t first;             // page
+    uint32_t pages;
+} store_slot_t;
+
+// a log frame is this header followed by records: a wal_record_t and
+// its words
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t bytes;             // of records
+    uint32_t sum;               // FNV-1a of the records
+} wal_frame_t;
+
+typedef struct {
+    uint32_t offset;            // in words, into the store
+    uint32_t words;
+} wal_record_t;
 
-static char const* g_image = NULL; // executable image filename
-static signed_t* g_save_data = NULL; // pointer to mmap'd region
+typedef enum {
+    DURABLE_NONE = 0,           // the page cache is good enough
+    DURABLE_COMMIT,             // fdatasync every commit
+    DURABLE_INTERVAL            // fdatasync at most interval ms after a commit
+} durability_t;
+
+// shared by all the processes with the store open
+typedef struct {
+    uint32_t magic;             // STORE_CTL_MAGIC once built
+    pthread_mutex_t wal;        // appends to the log, checkpoints
+    pthread_mutex_t sync;       // fdatasyncs of the log
+    pthread_mutex_t locks[STORE_LOCKS];
+    uint64_t lsn;               // bytes ever appended to the log
+    uint64_t synced;            // of those, known to be on disk
+    uint64_t walBytes;          // valid bytes in the log file
+    struct timespec syncedAt;
+    uint32_t seq;
+    int checkpointing;
+    struct {
+        pid_t pid;
+        int inTxn;
+    } procs[STORE_PROCS];
+} store_ctl_t;
+
+typedef struct {
+    unsigned char* p;
+    size_t len, cap;
+} buffer_t;
+
+// a VM's side of the store
+typedef struct {
+    int fd;                     // the log
+    int shm;
+    char shmName[64];
+    store_ctl_t* ctl;
+    size_t ctlBytes;
+    int proc;                   // our entry in ctl->procs
+    durability_t level;
+    unsigned interval;
+    bool open;                  // inside a transaction
+    bool implicit;              // ...started by a single write
+    buffer_t redo, undo;        // records of the transaction so far
+    bool held[STORE_LOCKS];
+    unsigned knownSlots;        // committed slots seen so far
+    // syncs what DURABLE_INTERVAL commits left behind once it is due
+    bool syncer;                // the thread is running
+    pthread_t syncThread;
+    pthread_mutex_t syncLock;
+    pthread_cond_t syncCond;
+    uint64_t syncDue;           // lsn it has to make durable, 0 if none
+    bool syncStop;
+} store_conn_t;
+
+#define HEAP_NCLASSES 60
+#define HEAP_FREE_BIT 0x8000
+
+typedef struct {
+    size_t base, end, top;      // region and bump pointer
+    unsigned_t lists[HEAP_NCLASSES];
+    size_t used, peak, listed, blocks;
+} heap_t;
+
+#define MAX_TIMERS 64
+#define EVENT_STDIN 0xFFFF
+
+typedef struct {
+    int epfd;
+    int timers[MAX_TIMERS];     // timerfd by handle - 1, 0 if unused
+    bool stdin;
+    bool stdinReady;            // a regular file, epoll will not take it
+} events_t;
+
+#define MAX_WINDOWS 32
+
+typedef struct {
+    int fd;
+    bool writable;
+    size_t address, words;      // in machine.data
+    off_t offset;               // in the file
+    signed_t* saved;            // what the window covers
+} window_t;
 
-//============================================================
-// internal
-//============================================================
 typedef enum {
     LS_UNDEFINED = 0,
     LS_FIRST,
     LS_SECOND
 } logger_state_t;
-static logger_state_t g_logger_state = LS_UNDEFINED;
 
 #define LOG_ERR 0x80000000  // log to stderr instead of stdout
 #define LOG_SAVEFILE 0x1    // enable logging SAVEFILE related msgs
-static int g_flags = ~0; // logger flags
 
-static inline void logger(int flags, char const* fmt, ...)
+typedef struct {
+    char* name;
+    void* dll;
+    utility_lib_t lib;
+    void* state;                // the library's own, for this VM
+    void (*release)(void*);     // exported by the library, if at all
+} ext_lib_t;
+
+#define MAX_EXT_LIBS 128
+
+// registered by the program embedding the VM
+typedef struct {
+    jakvm_utility_fn fn;
+    void* user;
+} host_utility_t;
+
+#define MAX_TASKS 0x4000
+#define NO_TASK ((size_t)-1)
+// the return address a task starts with: returning there ends it
+#define TASK_RETURN 0xFFFF
+
+typedef enum {
+    TASK_FREE = 0,
+    TASK_READY,                 // in the run queue
+    TASK_RUNNING,
+    TASK_JOINING,               // waiting for another one to end
+    TASK_ENDED                  // waiting to be joined
+} task_state_t;
+
+typedef struct {
+    signed_t regs[RLAST];       // while it is not running
+    signed_t* stack;            // 0x10000 words of its own
+    task_state_t state;
+    size_t next;                // in the run queue, or the free list
+    size_t joiner;              // the task joining this one
+    signed_t result;
+} task_t;
+
+typedef struct {
+    task_t* all;                // [0] is the main program; NULL until a spawn
+    size_t count, max;
+    size_t current;
+    size_t head, tail;          // run queue, linked through next
+    size_t free;                // slots of tasks that ended and got joined
+    int nested;                 // library calls back into the VM going on
+} tasks_t;
+
+typedef struct checkpoint checkpoint_t;
+
+// Everything a running image owns. Handlers only ever touch the VM they
+// are given, so any number of VMs can run side by side, one per thread.
+struct jakvm {
+    machine_t machine;          // first, it needs the strictest alignment
+    // what every run touches goes together, so an idle VM takes few pages
+    machine_t* mem;             // code and data: machine, or the parent's
+    signed_t* stack;            // machine.stack_data, or the running task's
+    jakvm_t* parent;            // for a parallel_for worker
+    char* image;                // executable image filename
+    void const* imageData;      // the image itself, if it is not a file
+    size_t imageLength;
+    int snapshot;               // machine to start from, -1 for the image
+    int mapped;                 // snapshot the machine is mapped from, or -1
+    FILE* in;                   // the image's stdin, stdout and stderr
+    FILE* out;
+    FILE* err;
+    logger_state_t logger_state;
+    int flags;                  // logger flags
+    SN_table* names;
+    jmp_buf halt;               // HALT and errors end up here
+    int status;                 // ...with this exit status
+    long budget;                // ticks left in the slice (see tick)
+    bool sliced;                // the slice has a budget: waits give the thread back
+    char* save;                 // save data name, NULL for the image's
+    signed_t* save_data;        // pointer to mmap'd region
+    size_t save_len;            // bytes mapped at save_data
+    int save_fd;                // kept open so the store can grow
+    store_conn_t wal;
+    heap_t heap;
+    events_t events;
+    window_t windows[MAX_WINDOWS];
+    tasks_t tasks;
+    uint64_t channels;          // the channels it opened, a bit each
+    ext_lib_t libs[MAX_EXT_LIBS];
+    size_t numLibs;
+    host_utility_t utilities[JAKVM_MAX_HOST_UTILITIES];
+    checkpoint_t* checkpoint;   // the file checkpoints go to, if any
+    unsigned long resets;       // RS this run, and what they took
+    long resetNs;
+    size_t resetPages;
+};
+
+#define cassert(X) (!(X) ? fprintf(vm->err, "Assertion failed at %s:%d in %s:\n\t%s\n", __FILE__, __LINE__, __func__, #X), vm_exit(vm, 42), 0 : 1)
+
+//============================================================
+// internal
+//============================================================
+
+// ends the run; what is left open is cleaned up by jakvm_run
+static void vm_exit(jakvm_t* vm, int status)
+{
+    vm->status = status;
+    longjmp(vm->halt, 1);
+}
+
+// not while a library has called back into the VM: that has to return
+// first; nor inside a transaction, whose store lock belongs to the thread
+// (and other VMs on it may want it)
+static bool vm_can_pause(jakvm_t* vm)
+{
+    return !vm->tasks.nested && !vm->wal.open;
+}
+
+// gives the thread back to the host once the instruction at IP is done;
+// the next slice starts with the one after it
+static void vm_pause(jakvm_t* vm)
 {
-    FILE* f = stdout;
+    if(!vm_can_pause(vm)) return;
+    vm->machine.regs[IP]++;
+    vm_exit(vm, JAKVM_PAUSED);
+}
+
+static inline void logger(jakvm_t* vm, int flags, char const* fmt, ...)
+{
+    FILE* f = vm->out;
     int skip = 0;
-    if(flags & LOG_ERR) f = stderr;
+    if(flags & LOG_ERR) f = vm->err;
     if((flags & (0 | 0))) {
-        if(!(flags & g_flags))
+        if(!(flags & vm->flags))
         {
             skip = 1;
         }
@@ -62,17 +343,11 @@ static inline void logger(int flags, char const* fmt, ...)
     va_end(args);
 }
 
-static void usage(char const* imgname)
-{
-    printf("Usage: %s image.hss\n", imgname);
-    exit(255);
-}
-
-static void error(char const* msg)
+static void error(jakvm_t* vm, char const* msg)
 {
-    logger(LOG_ERR, "Error @%d %s\n", machine.regs[IP], (msg)?msg:"");
-    fflush(stderr);
-    exit(42);
+    logger(vm, LOG_ERR, "Error @%d %s\n", vm->machine.regs[IP], (msg)?msg:"");
+    fflush(vm->err);
+    vm_exit(vm, 42);
 }
 
 //-------------------------------------------------------------
@@ -80,119 +355,814 @@ static void error(char const* msg)
 //-------------------------------------------------------------
 
 // execute reset action
-static void reset_machine_state()
+static void reset_machine_state(jakvm_t* vm)
 {
-    // clear stacks
-    memset(&machine.stack_data[0], 0, 0xFFFF * sizeof(signed_t));
-    machine.regs[SP] = 0;
+    // clear stacks; a snapshot brings back clear ones with the image
+    if(vm->snapshot == -1) memset(&vm->machine.stack_data[0], 0, 0xFFFF * sizeof(signed_t));
+    vm->machine.regs[SP] = 0;
     // start at 0x0
-    machine.regs[IP] = 0;
+    vm->machine.regs[IP] = 0;
+}
+
+
+static store_header_t* store_header(jakvm_t* vm)
+{
+    return (store_header_t*)vm->save_data;
+}
+
+static store_slot_t* store_slots(jakvm_t* vm)
+{
+    return (store_slot_t*)(store_header(vm) + 1);
+}
+
+static signed_t* store_root(jakvm_t* vm)
+{
+    return vm->save_data + store_header(vm)->root_offset;
 }
 
-// loads or creates the persistent file and mmaps it into g_save_data
-// the filename is essentially [csh] g_image:r.sav
-static signed_t* open_save_data()
+// lays out an empty store in a page
+static void store_format(signed_t* p)
 {
-    // determine file name
-    char* rName = (char*)malloc(strlen(g_image) + 4);
-    char* p = strrchr(g_image, '.');
+    memset(p, 0, STORE_PAGE_BYTES);
+    store_header_t* h = (store_header_t*)p;
+    memcpy(h->magic, STORE_MAGIC, 4);
+    h->version = STORE_VERSION;
+    h->page_words = STORE_PAGE_WORDS;
+    h->pages = 1;
+    // the slot directory takes the first half of the page, the root the rest
+    h->root_offset = STORE_PAGE_WORDS / 2;
+    h->root_words = STORE_PAGE_WORDS / 2;
+    h->max_slots = (h->root_offset * sizeof(signed_t) - sizeof(store_header_t)) / sizeof(store_slot_t);
+}
+
+// the file may be longer than the header says if a crash came between
+// growing it and checkpointing
+static bool store_valid(signed_t* p, off_t len)
+{
+    store_header_t* h = (store_header_t*)p;
+    return memcmp(h->magic, STORE_MAGIC, 4) == 0
+        && h->version == STORE_VERSION
+        && h->page_words == STORE_PAGE_WORDS
+        && h->pages >= 1
+        && h->max_slots <= STORE_LOCKS - 2
+        && (off_t)h->pages * STORE_PAGE_BYTES <= len;
+}
+
+static char* save_file_name(jakvm_t* vm, char const* ext)
+{
+    char const* base = (vm->save) ? vm->save : vm->image;
+    char* rName = (char*)malloc(strlen(base) + strlen(ext) + 1);
+    char* p = (vm->save) ? NULL : strrchr(base, '.');
     if(p) {
-        (void) strncpy(rName, g_image, p - g_image);
-        rName[p - g_image] = '\0';
+        (void) strncpy(rName, base, p - base);
+        rName[p - base] = '\0';
+    } else {
+        (void) strcpy(rName, base);
+    }
+    (void) strcat(rName, ext);
+    return rName;
+}
+
+static void buffer_append(buffer_t* b, void const* p, size_t n)
+{
+    if(b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->p = (unsigned char*)realloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->len, p, n);
+    b->len += n;
+}
+
+static uint32_t fnv1a(unsigned char const* p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    size_t i = 0;
+    for(; i < n; ++i) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static long ms_since(struct timespec const* t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// follows the mapping to the current size of the shared object
+static void store_remap(jakvm_t* vm)
+{
+    struct stat sb;
+    cassert(fstat(vm->wal.shm, &sb) == 0);
+    size_t len = sb.st_size - vm->wal.ctlBytes;
+    if(len <= vm->save_len) return;
+    void* ptr = mremap(vm->save_data, vm->save_len, len, MREMAP_MAYMOVE);
+    cassert(ptr != MAP_FAILED);
+    vm->save_data = (signed_t*)ptr;
+    vm->save_len = len;
+}
+
+// grows the shared object to hold at least len bytes of store
+static void store_extend(jakvm_t* vm, size_t len)
+{
+    struct stat sb;
+    cassert(fstat(vm->wal.shm, &sb) == 0);
+    if((off_t)(vm->wal.ctlBytes + len) > sb.st_size) cassert(ftruncate(vm->wal.shm, vm->wal.ctlBytes + len) == 0);
+    store_remap(vm);
+}
+
+typedef void (*record_fn)(jakvm_t* vm, wal_record_t const* h, unsigned char const* words, void* ctx);
+
+// walks the complete frames of a log; returns how many bytes they take
+static size_t wal_scan(jakvm_t* vm, unsigned char const* log, size_t bytes, record_fn fn, void* ctx)
+{
+    size_t at = 0;
+    while(at + sizeof(wal_frame_t) <= bytes) {
+        wal_frame_t f;
+        memcpy(&f, log + at, sizeof(f));
+        unsigned char const* rec = log + at + sizeof(f);
+        if(f.magic != WAL_MAGIC
+                || f.bytes > bytes - at - sizeof(f)
+                || fnv1a(rec, f.bytes) != f.sum) {
+            break;
+        }
+        size_t r = 0;
+        while(r + sizeof(wal_record_t) <= f.bytes) {
+            wal_record_t h;
+            memcpy(&h, rec + r, sizeof(h));
+            r += sizeof(h);
+            fn(vm, &h, rec + r, ctx);
+            r += h.words * sizeof(signed_t);
+        }
+        if(vm->wal.ctl->seq <= f.seq) vm->wal.ctl->seq = f.seq + 1;
+        at += sizeof(f) + f.bytes;
+    }
+    return at;
+}
+
+static unsigned char* wal_read(jakvm_t* vm, size_t bytes)
+{
+    unsigned char* log = (unsigned char*)malloc(bytes + 1);
+    cassert(pread(vm->wal.fd, log, bytes, 0) == (ssize_t)bytes);
+    return log;
+}
+
+static void replay_record(jakvm_t* vm, wal_record_t const* h, unsigned char const* words, void* ctx)
+{
+    store_extend(vm, (size_t)(h->offset + h->words) * sizeof(signed_t));
+    memcpy(vm->save_data + h->offset, words, h->words * sizeof(signed_t));
+}
+
+// [lo, hi) in words
+typedef struct {
+    size_t lo, hi;
+} range_t;
+
+static void restore_record(jakvm_t* vm, wal_record_t const* h, unsigned char const* words, void* ctx)
+{
+    range_t* r = (range_t*)ctx;
+    size_t lo = h->offset, hi = (size_t)h->offset + h->words;
+    if(lo < r->lo) lo = r->lo;
+    if(hi > r->hi) hi = r->hi;
+    if(lo >= hi) return;
+    memcpy(vm->save_data + lo, words + (lo - h->offset) * sizeof(signed_t), (hi - lo) * sizeof(signed_t));
+}
+
+static void mark_record(jakvm_t* vm, wal_record_t const* h, unsigned char const* words, void* ctx)
+{
+    unsigned char* dirty = (unsigned char*)ctx;
+    size_t i = h->offset / STORE_PAGE_WORDS;
+    size_t last = ((size_t)h->offset + h->words + STORE_PAGE_WORDS - 1) / STORE_PAGE_WORDS;
+    for(; i < last && i < vm->save_len / STORE_PAGE_BYTES; ++i) dirty[i] = 1;
+}
+
+static void store_mutex(jakvm_t* vm, pthread_mutex_t* m, int id);
+
+static void wal_lock(jakvm_t* vm)
+{
+    store_mutex(vm, &vm->wal.ctl->wal, -1);
+}
+
+static void wal_unlock(jakvm_t* vm)
+{
+    pthread_mutex_unlock(&vm->wal.ctl->wal);
+}
+
+// what lock id covers, in words
+static range_t lock_range(jakvm_t* vm, int id)
+{
+    store_header_t* h = store_header(vm);
+    range_t r = { 0, h->root_offset };
+    if(id == LOCK_ROOT) {
+        r.lo = h->root_offset;
+        r.hi = STORE_PAGE_WORDS;
+    } else if(id != LOCK_HEADER) {
+        store_slot_t* s = &store_slots(vm)[id - LOCK_SLOT(1)];
+        r.lo = (size_t)s->first * STORE_PAGE_WORDS;
+        r.hi = ((size_t)s->first + s->pages) * STORE_PAGE_WORDS;
+    }
+    return r;
+}
+
+// puts back the committed contents of a range: what the .sav has, then
+// what the log has on top
+static void store_restore(jakvm_t* vm, range_t r)
+{
+    wal_lock(vm);
+    store_remap(vm);
+    if(r.hi > vm->save_len / sizeof(signed_t)) r.hi = vm->save_len / sizeof(signed_t);
+    if(r.lo < r.hi) {
+        size_t bytes = (r.hi - r.lo) * sizeof(signed_t);
+        memset(vm->save_data + r.lo, 0, bytes);
+        cassert(pread(vm->save_fd, vm->save_data + r.lo, bytes, r.lo * sizeof(signed_t)) != -1);
+        unsigned char* log = wal_read(vm, vm->wal.ctl->walBytes);
+        wal_scan(vm, log, vm->wal.ctl->walBytes, &restore_record, &r);
+        free(log);
+    }
+    wal_unlock(vm);
+}
+
+// locks one of the shared mutexes; id is a lock id, -1 for the log and
+// -2 for the log sync; cleans up after a dead owner
+static void store_mutex(jakvm_t* vm, pthread_mutex_t* m, int id)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += STORE_LOCK_TIMEOUT;
+    int r = pthread_mutex_timedlock(m, &t);
+    if(r == ETIMEDOUT) error(vm, "save data lock timed out");
+    if(r == EOWNERDEAD) {
+        if(id == -1) {
+            // it may have died halfway through a frame
+            cassert(ftruncate(vm->wal.fd, vm->wal.ctl->walBytes) == 0);
+            vm->wal.ctl->checkpointing = 0;
+        } else if(id >= 0) {
+            store_restore(vm, lock_range(vm, id));
+        }
+        pthread_mutex_consistent(m);
     } else {
-        (void) strcpy(rName, g_image);
+        cassert(r == 0);
+    }
+}
+
+static void store_lock(jakvm_t* vm, int id)
+{
+    if(vm->wal.held[id]) return;
+    store_mutex(vm, &vm->wal.ctl->locks[id], id);
+    vm->wal.held[id] = true;
+}
+
+static void store_unlock(jakvm_t* vm, int id)
+{
+    if(!vm->wal.held[id]) return;
+    pthread_mutex_unlock(&vm->wal.ctl->locks[id]);
+    vm->wal.held[id] = false;
+}
+
+// a read outside of a transaction lets go of its lock right away
+static void store_read_done(jakvm_t* vm, int id)
+{
+    if(!vm->wal.open) store_unlock(vm, id);
+}
+
+// the log sync lock held: makes the log durable up to lsn, if nobody
+// did yet; false if fdatasync failed
+static bool wal_sync_locked(store_conn_t* w, uint64_t lsn)
+{
+    store_ctl_t* c = w->ctl;
+    if(c->synced >= lsn) return true;
+    uint64_t target = __atomic_load_n(&c->lsn, __ATOMIC_ACQUIRE);
+    if(fdatasync(w->fd) != 0) return false;
+    clock_gettime(CLOCK_MONOTONIC, &c->syncedAt);
+    __atomic_store_n(&c->synced, target, __ATOMIC_RELEASE);
+    return true;
+}
+
+// makes the log durable up to lsn; whoever syncs first syncs for everybody
+// who appended before it
+static void wal_sync(jakvm_t* vm, uint64_t lsn)
+{
+    store_ctl_t* c = vm->wal.ctl;
+    if(__atomic_load_n(&c->synced, __ATOMIC_ACQUIRE) >= lsn) return;
+    store_mutex(vm, &c->sync, -2);
+    bool ok = wal_sync_locked(&vm->wal, lsn);
+    pthread_mutex_unlock(&c->sync);
+    cassert(ok);
+}
+
+// DURABLE_INTERVAL: a commit that comes in less than interval ms after
+// the last sync leaves the sync to this thread, which makes it once the
+// interval is up, so that a guest going idle (or just computing) after a
+// commit still has it on disk in time. It cannot end the run: a sync that
+// fails here is left to the next commit's, or to closing the store
+static void* wal_syncer(void* p)
+{
+    store_conn_t* w = (store_conn_t*)p;
+    pthread_mutex_lock(&w->syncLock);
+    while(!w->syncStop) {
+        if(!w->syncDue) {
+            pthread_cond_wait(&w->syncCond, &w->syncLock);
+            continue;
+        }
+        // the interval runs from the last sync, whoever made it
+        struct timespec at = w->ctl->syncedAt;
+        at.tv_sec += w->interval / 1000;
+        at.tv_nsec += (w->interval % 1000) * 1000000L;
+        if(at.tv_nsec >= 1000000000L) {
+            at.tv_sec++;
+            at.tv_nsec -= 1000000000L;
+        }
+        if(pthread_cond_timedwait(&w->syncCond, &w->syncLock, &at) != ETIMEDOUT) continue;
+        uint64_t lsn = w->syncDue;
+        w->syncDue = 0;
+        pthread_mutex_unlock(&w->syncLock);
+        store_ctl_t* c = w->ctl;
+        if(__atomic_load_n(&c->synced, __ATOMIC_ACQUIRE) < lsn) {
+            int r = pthread_mutex_lock(&c->sync);
+            if(r == EOWNERDEAD) pthread_mutex_consistent(&c->sync);
+            if(r == 0 || r == EOWNERDEAD) {
+                wal_sync_locked(w, lsn);
+                pthread_mutex_unlock(&c->sync);
+            }
+        }
+        pthread_mutex_lock(&w->syncLock);
+    }
+    pthread_mutex_unlock(&w->syncLock);
+    return NULL;
+}
+
+// has the syncer make the log durable up to lsn once the interval is up
+static void wal_sync_later(jakvm_t* vm, uint64_t lsn)
+{
+    store_conn_t* w = &vm->wal;
+    if(!w->syncer) {
+        pthread_condattr_t a;
+        pthread_condattr_init(&a);
+        pthread_condattr_setclock(&a, CLOCK_MONOTONIC);
+        pthread_cond_init(&w->syncCond, &a);
+        pthread_condattr_destroy(&a);
+        pthread_mutex_init(&w->syncLock, NULL);
+        w->syncDue = 0;
+        w->syncStop = false;
+        if(pthread_create(&w->syncThread, NULL, &wal_syncer, w)) {
+            // no thread, no waiting: sync now
+            pthread_cond_destroy(&w->syncCond);
+            pthread_mutex_destroy(&w->syncLock);
+            wal_sync(vm, lsn);
+            return;
+        }
+        w->syncer = true;
+    }
+    pthread_mutex_lock(&w->syncLock);
+    if(lsn > w->syncDue) w->syncDue = lsn;
+    pthread_cond_signal(&w->syncCond);
+    pthread_mutex_unlock(&w->syncLock);
+}
+
+// stops the syncer, and makes what it had yet to sync durable now
+static void wal_syncer_stop(jakvm_t* vm)
+{
+    store_conn_t* w = &vm->wal;
+    if(!w->syncer) return;
+    pthread_mutex_lock(&w->syncLock);
+    w->syncStop = true;
+    uint64_t lsn = w->syncDue;
+    pthread_cond_signal(&w->syncCond);
+    pthread_mutex_unlock(&w->syncLock);
+    pthread_join(w->syncThread, NULL);
+    pthread_cond_destroy(&w->syncCond);
+    pthread_mutex_destroy(&w->syncLock);
+    w->syncer = false;
+    if(lsn) wal_sync(vm, lsn);
+}
+
+// processes that died inside a transaction: taking every lock they may
+// have held puts back what they left behind
+static void store_reap(jakvm_t* vm)
+{
+    store_ctl_t* c = vm->wal.ctl;
+    int i = 0;
+    for(; i < STORE_PROCS; ++i) {
+        pid_t pid = __atomic_load_n(&c->procs[i].pid, __ATOMIC_ACQUIRE);
+        if(!pid || i == vm->wal.proc || kill(pid, 0) == 0 || errno != ESRCH) continue;
+        if(c->procs[i].inTxn) {
+            store_lock(vm, LOCK_HEADER);
+            int n = LOCK_SLOT(store_header(vm)->slots), id = LOCK_ROOT;
+            store_unlock(vm, LOCK_HEADER);
+            for(; id <= n; ++id) {
+                store_lock(vm, id);
+                store_unlock(vm, id);
+            }
+            c->procs[i].inTxn = 0;
+        }
+        __atomic_compare_exchange_n(&c->procs[i].pid, &pid, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
+
+// copies the pages the log touched to the .sav and empties the log; only
+// when nobody is inside a transaction, their pages are not committed yet
+static void store_checkpoint(jakvm_t* vm)
+{
+    store_ctl_t* c = vm->wal.ctl;
+    cassert(!vm->wal.open);
+    store_reap(vm);
+
+    wal_lock(vm);
+    __atomic_store_n(&c->checkpointing, 1, __ATOMIC_SEQ_CST);
+    int i = 0;
+    for(; i < STORE_PROCS; ++i) {
+        if(__atomic_load_n(&c->procs[i].inTxn, __ATOMIC_SEQ_CST)) break;
+    }
+    if(i == STORE_PROCS && c->walBytes) {
+        wal_sync(vm, c->lsn);
+        store_remap(vm);
+        size_t pages = vm->save_len / STORE_PAGE_BYTES;
+        unsigned char* dirty = (unsigned char*)calloc(pages, 1);
+        unsigned char* log = wal_read(vm, c->walBytes);
+        wal_scan(vm, log, c->walBytes, &mark_record, dirty);
+        free(log);
+
+        size_t p = 0;
+        for(; p < pages; ++p) {
+            if(!dirty[p]) continue;
+            ssize_t w = pwrite(vm->save_fd, (char*)vm->save_data + p * STORE_PAGE_BYTES, STORE_PAGE_BYTES, p * STORE_PAGE_BYTES);
+            cassert(w == (ssize_t)STORE_PAGE_BYTES);
+        }
+        free(dirty);
+        struct stat sb;
+        cassert(fstat(vm->save_fd, &sb) == 0);
+        off_t len = (off_t)store_header(vm)->pages * STORE_PAGE_BYTES;
+        if(sb.st_size < len) cassert(ftruncate(vm->save_fd, len) == 0);
+        cassert(fdatasync(vm->save_fd) == 0);
+
+        cassert(ftruncate(vm->wal.fd, 0) == 0);
+        c->walBytes = 0;
+    }
+    __atomic_store_n(&c->checkpointing, 0, __ATOMIC_SEQ_CST);
+    wal_unlock(vm);
+}
+
+// sets up the control block and the live copy; the caller is the only
+// process with the store open
+static void store_build(jakvm_t* vm, off_t len)
+{
+    store_ctl_t* c = vm->wal.ctl;
+    memset(c, 0, sizeof(store_ctl_t));
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init(&a);
+    pthread_mutexattr_setpshared(&a, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&a, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&c->wal, &a);
+    pthread_mutex_init(&c->sync, &a);
+    int i = 0;
+    for(; i < STORE_LOCKS; ++i) pthread_mutex_init(&c->locks[i], &a);
+    pthread_mutexattr_destroy(&a);
+    clock_gettime(CLOCK_MONOTONIC, &c->syncedAt);
+
+    cassert(pread(vm->save_fd, vm->save_data, len, 0) == len);
+
+    struct stat sb;
+    cassert(fstat(vm->wal.fd, &sb) == 0);
+    if(sb.st_size) {
+        unsigned char* log = wal_read(vm, sb.st_size);
+        size_t valid = wal_scan(vm, log, sb.st_size, &replay_record, NULL);
+        free(log);
+        // a torn frame at the end was never committed
+        if(valid != (size_t)sb.st_size) cassert(ftruncate(vm->wal.fd, valid) == 0);
+        if(valid) logger(vm, LOG_SAVEFILE|LOG_ERR, "Replaying the save log (%zu bytes)\n", valid);
+        c->walBytes = c->lsn = valid;
     }
-    (void) strcat(rName, ".sav");
+    c->magic = STORE_CTL_MAGIC;
+}
+
+// loads or creates the persistent file and mmaps it into save_data
+// the filename is essentially [csh] image:r.sav
+static signed_t* open_save_data(jakvm_t* vm)
+{
+    char* rName = save_file_name(vm, ".sav");
+    char* wName = save_file_name(vm, ".wal");
 
     // does file exist?
     int fd = open(rName,
             O_CREAT | O_RDWR,
             S_IRUSR|S_IWUSR);
     cassert(fd != -1);
+    vm->wal.fd = open(wName, O_CREAT | O_RDWR | O_APPEND, S_IRUSR|S_IWUSR);
+    cassert(vm->wal.fd != -1);
+    vm->save_fd = fd;
+
+    // processes come and go one at a time; the ones using the store hold
+    // a shared lock on the .sav, so the first one in can tell
+    cassert(flock(vm->wal.fd, LOCK_EX) == 0);
+    bool first = flock(fd, LOCK_EX|LOCK_NB) == 0;
 
     struct stat sb;
     cassert(fstat(fd, &sb) == 0);
+    snprintf(vm->wal.shmName, sizeof(vm->wal.shmName), "/jakvmhs.%lx.%lx", (unsigned long)sb.st_dev, (unsigned long)sb.st_ino);
+    vm->wal.shm = shm_open(vm->wal.shmName, O_CREAT | O_RDWR, S_IRUSR|S_IWUSR);
+    cassert(vm->wal.shm != -1);
+    size_t page = sysconf(_SC_PAGESIZE);
+    vm->wal.ctlBytes = (sizeof(store_ctl_t) + page - 1) / page * page;
 
     off_t len = sb.st_size;
-    size_t expectedLen = 512u;
-    if(len != expectedLen) {
-        logger(LOG_SAVEFILE|LOG_ERR, "File %s is of unexpected size, truncating and nullifying...\n", rName);
-        ftruncate(fd, expectedLen);
+    if(first) {
+        signed_t header[STORE_PAGE_WORDS];
+        memset(header, 0, sizeof(header));
+        cassert(pread(fd, header, sizeof(header), 0) != -1);
+
+        if(!store_valid(header, len)) {
+            // a 256 word save file from before the store becomes the root
+            bool migrate = (len == STORE_LEGACY_BYTES);
+            signed_t legacy[STORE_LEGACY_BYTES / sizeof(signed_t)];
+            memcpy(legacy, header, STORE_LEGACY_BYTES);
+            if(migrate) {
+                logger(vm, LOG_SAVEFILE|LOG_ERR, "File %s is an old save file, converting...\n", rName);
+            } else if(len) {
+                logger(vm, LOG_SAVEFILE|LOG_ERR, "File %s is not a valid save file, truncating and nullifying...\n", rName);
+            }
+
+            store_format(header);
+            if(migrate) memcpy(header + ((store_header_t*)header)->root_offset, legacy, STORE_LEGACY_BYTES);
+            len = STORE_PAGE_BYTES;
+            cassert(ftruncate(fd, len) == 0);
+            cassert(pwrite(fd, header, sizeof(header), 0) == sizeof(header));
+            cassert(fdatasync(fd) == 0);
+            // whatever is logged belongs to the store that was just replaced
+            cassert(ftruncate(vm->wal.fd, 0) == 0);
+        }
+
+        // whatever a previous run left in the shared object is stale
+        cassert(ftruncate(vm->wal.shm, 0) == 0);
+        cassert(ftruncate(vm->wal.shm, vm->wal.ctlBytes + len) == 0);
+    } else {
+        cassert(fstat(vm->wal.shm, &sb) == 0);
+        len = sb.st_size - vm->wal.ctlBytes;
     }
 
+    void* ctl = mmap(NULL, vm->wal.ctlBytes, PROT_READ|PROT_WRITE, MAP_SHARED, vm->wal.shm, 0);
+    cassert(ctl != MAP_FAILED);
+    vm->wal.ctl = (store_ctl_t*)ctl;
+
     // map the save file
     void* ptr = mmap(
             NULL,
-            expectedLen,
+            len,
             PROT_READ|PROT_WRITE,
             MAP_SHARED,
-            fd,
-            0);
-    cassert(ptr);
+            vm->wal.shm,
+            vm->wal.ctlBytes);
+    cassert(ptr != MAP_FAILED);
+    vm->save_data = (signed_t*)ptr;
+    vm->save_len = len;
+    vm->wal.level = DURABLE_INTERVAL;
+    vm->wal.interval = 100;
+
+    if(first) store_build(vm, len);
+    cassert(vm->wal.ctl->magic == STORE_CTL_MAGIC);
+
+    int i = 0;
+    for(; i < STORE_PROCS; ++i) {
+        pid_t none = 0;
+        if(__atomic_compare_exchange_n(&vm->wal.ctl->procs[i].pid, &none, getpid(), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+    }
+    if(i == STORE_PROCS) error(vm, "too many processes using the save data");
+    vm->wal.proc = i;
+    vm->wal.ctl->procs[i].inTxn = 0;
 
-    close(fd);
+    if(first) store_checkpoint(vm);
+    cassert(flock(fd, LOCK_SH) == 0);
+    cassert(flock(vm->wal.fd, LOCK_UN) == 0);
+
+    free(rName);
+    free(wName);
+
+    return vm->save_data;
+}
+
+// get the pointer to the mmap'd region of the persistent file
+static signed_t* get_save_data_ptr(jakvm_t* vm)
+{
+    if(vm->save_data) return vm->save_data;
+    return vm->save_data = open_save_data(vm);
+}
+
+// starts a transaction; waits out a checkpoint in progress
+static void txn_enter(jakvm_t* vm)
+{
+    store_ctl_t* c = vm->wal.ctl;
+    int* flag = &c->procs[vm->wal.proc].inTxn;
+    while(1) {
+        __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+        if(!__atomic_load_n(&c->checkpointing, __ATOMIC_SEQ_CST)) break;
+        __atomic_store_n(flag, 0, __ATOMIC_SEQ_CST);
+        wal_lock(vm);
+        wal_unlock(vm);
+    }
+    vm->wal.open = true;
+}
+
+static void txn_leave(jakvm_t* vm)
+{
+    int id = 0;
+    for(; id < STORE_LOCKS; ++id) store_unlock(vm, id);
+    __atomic_store_n(&vm->wal.ctl->procs[vm->wal.proc].inTxn, 0, __ATOMIC_SEQ_CST);
+    vm->wal.redo.len = 0;
+    vm->wal.undo.len = 0;
+    vm->wal.open = false;
+    vm->wal.implicit = false;
+}
+
+// logs the open transaction, lets go of its locks and decides whether to
+// sync
+static void store_commit(jakvm_t* vm)
+{
+    store_ctl_t* c = vm->wal.ctl;
+    uint64_t lsn = 0;
+    bool full = false;
+    if(vm->wal.redo.len) {
+        wal_lock(vm);
+        wal_frame_t f = { WAL_MAGIC, c->seq++, vm->wal.redo.len, fnv1a(vm->wal.redo.p, vm->wal.redo.len) };
+        // one write per frame: a frame is either whole in the log or torn
+        // at its end
+        struct iovec iov[2] = {
+            { &f, sizeof(f) },
+            { vm->wal.redo.p, vm->wal.redo.len }
+        };
+        size_t n = sizeof(f) + vm->wal.redo.len;
+        cassert(writev(vm->wal.fd, iov, 2) == (ssize_t)n);
+        c->walBytes += n;
+        __atomic_store_n(&c->lsn, c->lsn + n, __ATOMIC_RELEASE);
+        lsn = c->lsn;
+        full = c->walBytes >= WAL_CHECKPOINT_BYTES;
+        wal_unlock(vm);
+    }
+    txn_leave(vm);
+
+    if(lsn && vm->wal.level == DURABLE_COMMIT) {
+        wal_sync(vm, lsn);
+    } else if(lsn && vm->wal.level == DURABLE_INTERVAL) {
+        // group commit: whatever anybody committed since the last sync
+        // goes to disk together, at most interval ms after this commit
+        if(ms_since(&c->syncedAt) >= (long)vm->wal.interval) wal_sync(vm, lsn);
+        else wal_sync_later(vm, lsn);
+    }
+    if(full) store_checkpoint(vm);
+}
+
+// puts back what the open transaction overwrote, newest first
+static void store_abort(jakvm_t* vm)
+{
+    size_t n = 0, at = 0;
+    size_t* starts = NULL;
+    while(at < vm->wal.undo.len) {
+        wal_record_t h;
+        memcpy(&h, vm->wal.undo.p + at, sizeof(h));
+        starts = (size_t*)realloc(starts, (n + 1) * sizeof(size_t));
+        starts[n++] = at;
+        at += sizeof(h) + h.words * sizeof(signed_t);
+    }
+    while(n--) {
+        wal_record_t h;
+        memcpy(&h, vm->wal.undo.p + starts[n], sizeof(h));
+        memcpy(vm->save_data + h.offset, vm->wal.undo.p + starts[n] + sizeof(h), h.words * sizeof(signed_t));
+    }
+    free(starts);
+    txn_leave(vm);
+}
+
+// a write outside of a transaction is a transaction of its own
+static void store_op_begin(jakvm_t* vm)
+{
+    if(vm->wal.open) return;
+    txn_enter(vm);
+    vm->wal.implicit = true;
+}
 
-    return (signed_t*)ptr;
+static void store_op_end(jakvm_t* vm)
+{
+    if(vm->wal.implicit) store_commit(vm);
+}
+
+// the only way anything is written to the store; the lock covering dst
+// must be held
+static void store_write(jakvm_t* vm, void* dst, void const* src, size_t bytes)
+{
+    wal_record_t h = { (signed_t*)dst - vm->save_data, bytes / sizeof(signed_t) };
+    if(!vm->wal.implicit) {
+        buffer_append(&vm->wal.undo, &h, sizeof(h));
+        buffer_append(&vm->wal.undo, dst, bytes);
+    }
+    buffer_append(&vm->wal.redo, &h, sizeof(h));
+    buffer_append(&vm->wal.redo, src, bytes);
+    memmove(dst, src, bytes);
 }
 
-// release mmap'd region
-static void dispose_of_save_data(signed_t** p)
+// release mmap'd region; an unfinished transaction is rolled back, and
+// the last process out checkpoints and removes the shared object
+static void dispose_of_save_data(jakvm_t* vm, signed_t** p)
 {
     cassert(p);
-    munmap(*p, 512);
+    if(vm->wal.open) store_abort(vm);
+    wal_syncer_stop(vm);
+    __atomic_store_n(&vm->wal.ctl->procs[vm->wal.proc].pid, 0, __ATOMIC_RELEASE);
+
+    cassert(flock(vm->wal.fd, LOCK_EX) == 0);
+    if(flock(vm->save_fd, LOCK_EX|LOCK_NB) == 0) {
+        store_checkpoint(vm);
+        shm_unlink(vm->wal.shmName);
+    }
+
+    munmap(*p, vm->save_len);
+    munmap(vm->wal.ctl, vm->wal.ctlBytes);
+    close(vm->wal.shm);
+    close(vm->save_fd);
+    close(vm->wal.fd);
+    free(vm->wal.redo.p);
+    free(vm->wal.undo.p);
+    memset(&vm->wal, 0, sizeof(vm->wal));
+    vm->wal.fd = -1;
+    vm->save_fd = -1;
+    vm->save_len = 0;
     *p = NULL;
 }
 
-// get the pointer to the mmap'd region of the persistent file
-static signed_t* get_save_data_ptr()
+// appends wPages pages to the store; returns the first one; the header
+// lock must be held
+static uint32_t store_grow(jakvm_t* vm, uint32_t pages)
 {
-    if(g_save_data) return g_save_data;
-    return g_save_data = open_save_data();
+    uint32_t first = store_header(vm)->pages;
+    if((uint64_t)first + pages > UINT32_MAX / STORE_PAGE_BYTES) error(vm, "store too big");
+    store_extend(vm, (size_t)(first + pages) * STORE_PAGE_BYTES);
+    uint32_t total = first + pages;
+    store_write(vm, &store_header(vm)->pages, &total, sizeof(total));
+    return first;
 }
 
 // load the executable image
-static void load_image()
+static void load_image(jakvm_t* vm)
 {
-    cassert(g_image);
-    if(g_save_data) dispose_of_save_data(&g_save_data);
-
-    logger(0, "Loading %s\n", g_image);
-
-    int fd = open(g_image, O_RDONLY);
-    cassert(fd != -1);
+    cassert(vm->image);
+    if(vm->save_data) dispose_of_save_data(vm, &vm->save_data);
+
+    logger(vm, 0, "Loading %s\n", vm->image);
+
+    if(vm->snapshot != -1) {
+        // copy on write: only the pages the run touches ever get copied,
+        // and mapping it again drops them; the registers stay
+        signed_t regs[RLAST];
+        memcpy(regs, vm->machine.regs, sizeof(regs));
+        void* p = mmap(&vm->machine, sizeof(machine_t), PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE, vm->snapshot, 0);
+        cassert(p == (void*)&vm->machine);
+        vm->mapped = vm->snapshot;
+        // nothing writes code, so it stays the snapshot's pages, shared
+        // by every VM started from it
+        cassert(mprotect(vm->machine.code, sizeof(vm->machine.code), PROT_READ) == 0);
+        memcpy(vm->machine.regs, regs, sizeof(regs));
+        return;
+    }
 
-    struct stat sb;
-    cassert(fstat(fd, &sb) != -1);
+    vm->mapped = -1;
+    int fd = -1;
+    char const* image = (char const*)vm->imageData;
+    size_t length = vm->imageLength;
+    if(!image) {
+        fd = open(vm->image, O_RDONLY);
+        cassert(fd != -1);
+
+        struct stat sb;
+        cassert(fstat(fd, &sb) != -1);
+        length = sb.st_size;
+    }
 
-    off_t offset = 0;
-    size_t length = sb.st_size;
     cassert(length >= 0x30000);
-    if(length > 0x30000) logger(LOG_ERR, "WARNING: image bigger than the expected %ld bytes\n", 0x30000);
+    if(length > 0x30000) logger(vm, LOG_ERR, "WARNING: image bigger than the expected %ld bytes\n", 0x30000);
 
-    char* image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, offset);
+    if(fd != -1) image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
 
-    // copy memory
-    memcpy(machine.data, image + 0x10000, sizeof(signed_t) * 0x10000);
-    memcpy(machine.code, image, sizeof(code_t) * 0x10000);
+    // copy memory; a snapshot or checkpoint run before left the code read only
+    cassert(mprotect(vm->machine.code, sizeof(vm->machine.code), PROT_READ|PROT_WRITE) == 0);
+    memcpy(vm->machine.data, image + 0x10000, sizeof(signed_t) * 0x10000);
+    memcpy(vm->machine.code, image, sizeof(code_t) * 0x10000);
 
-    munmap(image, sb.st_size);
-    close(fd);
+    if(fd != -1) {
+        munmap((void*)image, length);
+        close(fd);
+    }
 }
 
 //-------------------------------------------------------------
 // stack management
 //-------------------------------------------------------------
 
-static void push(signed_t x)
+static void push(jakvm_t* vm, signed_t x)
 {
-    cassert(machine.regs[SP] < 0x10000);
-    machine.stack_data[machine.regs[SP]++] = x;
+    cassert(vm->machine.regs[SP] < 0x10000);
+    vm->stack[vm->machine.regs[SP]++] = x;
 }
 
-static signed_t pop()
+static signed_t pop(jakvm_t* vm)
 {
-    cassert(machine.regs[SP] > 0);
-    signed_t ret = machine.stack_data[--machine.regs[SP]];
+    cassert(vm->machine.regs[SP] > 0);
+    signed_t ret = vm->stack[--vm->machine.regs[SP]];
     return ret;
 }
 
@@ -206,75 +1176,153 @@ static signed_t pop()
 
 // dereference an internal string as a C string
 // must be free'd
-static char* os_deref_string(unsigned_t pStr)
+static char* os_deref_string(jakvm_t* vm, unsigned_t pStr)
 {
     size_t start = pStr;
     size_t end;
     for(end = start; ; ++end) {
-        if((machine.data[end] & 0xFF00) == 0)
+        if((vm->mem->data[end] & 0xFF00) == 0)
         {
             break;
         }
     }
 
     size_t count = start, len = 0;
-    char* p = (char*)&machine.data[start];
+    char* p = (char*)&vm->mem->data[start];
     char* decoded = (char*)malloc(sizeof(char) * (end - start + 1));
     while(1) {
-        unsigned_t crnt = machine.data[count];
+        unsigned_t crnt = vm->mem->data[count];
         decoded[len++] = (crnt & 0xFF00) >> 8;
         if(!decoded[len - 1]) break;
         ++count;
         cassert(count < 0x10000);
     }
 
-    char* rets = (char*)malloc(sizeof(char) * strlen(decoded));
+    char* rets = (char*)malloc(sizeof(char) * (strlen(decoded) + 1));
     strcpy(rets, decoded);
     free(decoded);
 
     return rets;
 }
 
+// register a memory string and push its short name
+static void os_assign_short_name(jakvm_t* vm)
+{
+    unsigned_t pStr = pop(vm);
+    char* s = os_deref_string(vm, pStr);
+    unsigned_t w = SN_assign(vm->names, s);
+    free(s);
+    if(w == SN_NONE) error(vm, "out of short names");
+    push(vm, w);
+}
+
+// release a short name
+static void os_free_short_name(jakvm_t* vm)
+{
+    unsigned_t w = pop(vm);
+    SN_dispose(vm->names, w);
+}
+
+// copy a short name's string @address in memory encoding; pushes its length
+static void os_deref_short_name(jakvm_t* vm)
+{
+    unsigned_t w = pop(vm);
+    unsigned_t address = pop(vm);
+    char const* s = SN_get(vm->names, w);
+    size_t len = strlen(s);
+    cassert((size_t)address + len < 0x10000);
+
+    size_t i = 0;
+    for(; i < len; ++i) {
+        vm->mem->data[address + i] = (unsigned_t)(unsigned char)s[i] << 8;
+    }
+    vm->mem->data[address + len] = 0;
+    push(vm, len);
+}
+
+// short name lookup for utility libraries; do not free
+static char const* os_from_short_name(jakvm_t* vm, unsigned_t w)
+{
+    return SN_get(vm->names, w);
+}
+
 //-------------------------------------------------------------
 // OS.log
 //-------------------------------------------------------------
 
 // log a single word
-static void os_logword()
+static void os_logword(jakvm_t* vm)
 {
-    signed_t w = pop();
-    switch(g_logger_state) {
+    signed_t w = pop(vm);
+    switch(vm->logger_state) {
     case LS_SECOND:
-        printf("%35X\n", (int)w);
-        g_logger_state = LS_FIRST;
+        fprintf(vm->out, "%35X\n", (int)w);
+        vm->logger_state = LS_FIRST;
         break;
     case LS_FIRST:
-        printf("%35X", (int)w);
-        g_logger_state = LS_SECOND;
+        fprintf(vm->out, "%35X", (int)w);
+        vm->logger_state = LS_SECOND;
         break;
     default:
-        error("undefined log_word state");
+        error(vm, "undefined log_word state");
     }
 }
 
-// log a null terminated memory location
-static void os_logstring_p()
+// log a C string
+static void os_logstring(jakvm_t* vm, char const* s)
 {
-    unsigned_t w = pop();
-    char* s = os_deref_string(w);
-    switch(g_logger_state) {
+    switch(vm->logger_state) {
     case LS_SECOND:
-        printf("%35s\n", s);
-        g_logger_state = LS_FIRST;
+        fprintf(vm->out, "%35s\n", s);
+        vm->logger_state = LS_FIRST;
         break;
     case LS_FIRST:
-        printf("%35s", s);
-        g_logger_state = LS_SECOND;
+        fprintf(vm->out, "%35s", s);
+        vm->logger_state = LS_SECOND;
         break;
     default:
-        error("undefined log_word state");
+        error(vm, "undefined log_word state");
     }
+}
+
+// log a null terminated memory location
+static void os_logstring_p(jakvm_t* vm)
+{
+    unsigned_t w = pop(vm);
+    char* s = os_deref_string(vm, w);
+    os_logstring(vm, s);
+    free(s);
+}
+
+// log a string identified by its short name
+static void os_logstring_sn(jakvm_t* vm)
+{
+    unsigned_t w = pop(vm);
+    os_logstring(vm, SN_get(vm->names, w));
+}
+
+//-------------------------------------------------------------
+// OS.read
+//-------------------------------------------------------------
+
+// read a line from stdin and push a new short name for it
+static void os_read_string(jakvm_t* vm)
+{
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, vm->in);
+    if(len < 0) len = 0;
+    if(len > 0 && line[len - 1] == '\n') --len;
+
+    char* s = (char*)malloc(len + 1);
+    if(len) memcpy(s, line, len);
+    s[len] = '\0';
+    free(line);
+
+    unsigned_t w = SN_assign(vm->names, s);
     free(s);
+    if(w == SN_NONE) error(vm, "out of short names");
+    push(vm, w);
 }
 
 //-------------------------------------------------------------
@@ -282,564 +1330,2759 @@ static void os_logstring_p()
 //-------------------------------------------------------------
 
 // read a single word from persistent storage
-static void os_read_save_word()
+static void os_read_save_word(jakvm_t* vm)
 {
-    signed_t save_word_address = pop();
-    cassert(save_word_address >= 0 && save_word_address < 256);
-
-    signed_t* save_data = get_save_data_ptr();
-    cassert(save_data);
-    push(save_data[save_word_address]);
+    unsigned_t save_word_address = pop(vm);
+
+    get_save_data_ptr(vm);
+    if(save_word_address >= store_header(vm)->root_words) error(vm, "save address out of range");
+    store_lock(vm, LOCK_ROOT);
+    signed_t word = store_root(vm)[save_word_address];
+    store_read_done(vm, LOCK_ROOT);
+    push(vm, word);
 }
 
 // write a single word from persistent storage
-static void os_write_save_word()
+static void os_write_save_word(jakvm_t* vm)
 {
-    signed_t save_word_address = pop();
-    signed_t word = pop();
-    cassert(save_word_address >= 0 && save_word_address < 256);
-
-    signed_t* save_data = get_save_data_ptr();
-    cassert(save_data);
-    save_data[save_word_address] = word;
+    unsigned_t save_word_address = pop(vm);
+    signed_t word = pop(vm);
+
+    get_save_data_ptr(vm);
+    if(save_word_address >= store_header(vm)->root_words) error(vm, "save address out of range");
+    store_op_begin(vm);
+    store_lock(vm, LOCK_ROOT);
+    store_write(vm, &store_root(vm)[save_word_address], &word, sizeof(word));
+    store_op_end(vm);
 }
 
 // transfer N words from persistent storage into memory
-static void os_get_save_data()
+static void os_get_save_data(jakvm_t* vm)
 {
-    signed_t save_data_addr = pop();
-    unsigned_t howMuch = pop();
-    unsigned_t mem_addr = pop();
-
-    cassert(save_data_addr >= 0 && save_data_addr < 256);
-    cassert((size_t)mem_addr + (size_t)howMuch < 0x10000);
-    cassert((size_t)save_data_addr + (size_t)howMuch < 256);
+    unsigned_t save_data_addr = pop(vm);
+    unsigned_t howMuch = pop(vm);
+    unsigned_t mem_addr = pop(vm);
 
-    signed_t* save_data = get_save_data_ptr();
+    get_save_data_ptr(vm);
+    if((size_t)mem_addr + howMuch > 0x10000) error(vm, "range out of memory");
+    if((size_t)save_data_addr + howMuch > store_header(vm)->root_words) error(vm, "save address out of range");
 
-    memcpy(&machine.data[mem_addr], &save_data[save_data_addr], howMuch * sizeof(signed_t));
+    store_lock(vm, LOCK_ROOT);
+    memcpy(&vm->mem->data[mem_addr], &store_root(vm)[save_data_addr], howMuch * sizeof(signed_t));
+    store_read_done(vm, LOCK_ROOT);
 }
 
 // transfer N words from memory to persistent storage
-static void os_put_save_data()
+static void os_put_save_data(jakvm_t* vm)
 {
-    signed_t save_data_addr = pop();
-    unsigned_t howMuch = pop();
-    unsigned_t mem_addr = pop();
+    unsigned_t save_data_addr = pop(vm);
+    unsigned_t howMuch = pop(vm);
+    unsigned_t mem_addr = pop(vm);
+
+    get_save_data_ptr(vm);
+    if((size_t)mem_addr + howMuch > 0x10000) error(vm, "range out of memory");
+    if((size_t)save_data_addr + howMuch > store_header(vm)->root_words) error(vm, "save address out of range");
+
+    store_op_begin(vm);
+    store_lock(vm, LOCK_ROOT);
+    store_write(vm, &store_root(vm)[save_data_addr], &vm->mem->data[mem_addr], howMuch * sizeof(signed_t));
+    store_op_end(vm);
+}
 
-    cassert(mem_addr >= 0 && mem_addr < 256);
-    cassert((size_t)save_data_addr + (size_t)howMuch < 0x10000);
-    cassert((size_t)mem_addr + (size_t)howMuch < 256);
+// (wOld) save_cas(wWhere, wExpected, wNew): stores wNew in the root if
+// it holds wExpected; pushes what it held
+static void os_save_cas(jakvm_t* vm)
+{
+    unsigned_t save_word_address = pop(vm);
+    signed_t expected = pop(vm);
+    signed_t word = pop(vm);
+
+    get_save_data_ptr(vm);
+    if(save_word_address >= store_header(vm)->root_words) error(vm, "save address out of range");
+    store_op_begin(vm);
+    store_lock(vm, LOCK_ROOT);
+    signed_t old = store_root(vm)[save_word_address];
+    if(old == expected) store_write(vm, &store_root(vm)[save_word_address], &word, sizeof(word));
+    store_op_end(vm);
+    push(vm, old);
+}
 
-    signed_t* save_data = get_save_data_ptr();
+// slot entries never change once committed, so only handles not seen
+// before need the header lock
+static store_slot_t* get_slot(jakvm_t* vm, unsigned_t h)
+{
+    get_save_data_ptr(vm);
+    if(h == 0) error(vm, "invalid slot");
+    if(h > vm->wal.knownSlots) {
+        store_lock(vm, LOCK_HEADER);
+        vm->wal.knownSlots = store_header(vm)->slots;
+        store_read_done(vm, LOCK_HEADER);
+        if(h > vm->wal.knownSlots) error(vm, "invalid slot");
+    }
+    store_slot_t* slot = &store_slots(vm)[h - 1];
+    // another process may have grown the store
+    if(((size_t)slot->first + slot->pages) * STORE_PAGE_BYTES > vm->save_len) {
+        store_remap(vm);
+        slot = &store_slots(vm)[h - 1];
+    }
+    return slot;
+}
 
-    memcpy(&save_data[save_data_addr], &machine.data[mem_addr], howMuch * sizeof(signed_t));
+// checks a page transfer and returns where it starts in the store; after
+// the slot is locked, taking the lock may have moved the mapping
+static signed_t* slot_range(jakvm_t* vm, unsigned_t h, unsigned_t page, unsigned_t address, unsigned_t pages)
+{
+    store_slot_t* slot = &store_slots(vm)[h - 1];
+    if((size_t)page + pages > slot->pages) error(vm, "slot page out of range");
+    if((size_t)address + (size_t)pages * STORE_PAGE_WORDS > 0x10000) error(vm, "range out of memory");
+    return vm->save_data + ((size_t)slot->first + page) * STORE_PAGE_WORDS;
 }
 
-//-------------------------------------------------------------
-// OS.interop
-//-------------------------------------------------------------
+// (h) slot_open(pName, wPages): finds a named slot, or creates it with
+// wPages pages; 0 if it does not exist and wPages is 0
+static void os_slot_open(jakvm_t* vm)
+{
+    unsigned_t pName = pop(vm);
+    unsigned_t pages = pop(vm);
+
+    char* name = os_deref_string(vm, pName);
+    if(!*name || strlen(name) >= STORE_NAME_MAX) {
+        free(name);
+        error(vm, "invalid slot name");
+    }
+
+    get_save_data_ptr(vm);
+    // the slot, its pages and the header change together
+    store_op_begin(vm);
+    store_lock(vm, LOCK_HEADER);
+    store_header_t* hdr = store_header(vm);
+    unsigned_t i = 0;
+    for(; i < hdr->slots; ++i) {
+        if(strncmp(store_slots(vm)[i].name, name, STORE_NAME_MAX) == 0) break;
+    }
+    if(i == hdr->slots && pages) {
+        if(hdr->slots >= hdr->max_slots) {
+            free(name);
+            error(vm, "out of slots");
+        }
+        store_slot_t slot;
+        memset(&slot, 0, sizeof(slot));
+        strncpy(slot.name, name, STORE_NAME_MAX);
+        slot.pages = pages;
+        slot.first = store_grow(vm, pages);
+        // the mapping may have moved
+        hdr = store_header(vm);
+        store_write(vm, &store_slots(vm)[hdr->slots], &slot, sizeof(slot));
+        uint16_t slots = hdr->slots + 1;
+        store_write(vm, &hdr->slots, &slots, sizeof(slots));
+    }
+    unsigned_t h = (i < hdr->slots) ? i + 1 : 0;
+    store_op_end(vm);
+    free(name);
+    push(vm, h);
+}
+
+// (w) slot_pages(h)
+static void os_slot_pages(jakvm_t* vm)
+{
+    store_slot_t* slot = get_slot(vm, pop(vm));
+    push(vm, slot->pages);
+}
+
+// store_load(h, wPage, wAddress, wPages): copies whole pages of a slot
+// into memory
+static void os_store_load(jakvm_t* vm)
+{
+    unsigned_t h = pop(vm);
+    unsigned_t page = pop(vm);
+    unsigned_t address = pop(vm);
+    unsigned_t pages = pop(vm);
+    get_slot(vm, h);
+    store_lock(vm, LOCK_SLOT(h));
+    signed_t* src = slot_range(vm, h, page, address, pages);
+    memcpy(&vm->mem->data[address], src, (size_t)pages * STORE_PAGE_BYTES);
+    store_read_done(vm, LOCK_SLOT(h));
+}
+
+// store_save(h, wPage, wAddress, wPages): copies whole pages of memory
+// into a slot
+static void os_store_save(jakvm_t* vm)
+{
+    unsigned_t h = pop(vm);
+    unsigned_t page = pop(vm);
+    unsigned_t address = pop(vm);
+    unsigned_t pages = pop(vm);
+    get_slot(vm, h);
+    store_op_begin(vm);
+    store_lock(vm, LOCK_SLOT(h));
+    signed_t* dst = slot_range(vm, h, page, address, pages);
+    store_write(vm, dst, &vm->mem->data[address], (size_t)pages * STORE_PAGE_BYTES);
+    store_op_end(vm);
+}
+
+// store_sync(): makes everything committed durable and checkpoints
+static void os_store_sync(jakvm_t* vm)
+{
+    get_save_data_ptr(vm);
+    if(vm->wal.open) error(vm, "transaction open");
+    wal_sync(vm, __atomic_load_n(&vm->wal.ctl->lsn, __ATOMIC_ACQUIRE));
+    store_checkpoint(vm);
+}
+
+// txn_begin(): the following writes to the save data commit together
+static void os_txn_begin(jakvm_t* vm)
+{
+    get_save_data_ptr(vm);
+    if(vm->wal.open) error(vm, "transaction already open");
+    txn_enter(vm);
+}
+
+// txn_commit()
+static void os_txn_commit(jakvm_t* vm)
+{
+    get_save_data_ptr(vm);
+    if(!vm->wal.open) error(vm, "no transaction open");
+    store_commit(vm);
+}
+
+// txn_abort(): undoes the writes of the open transaction
+static void os_txn_abort(jakvm_t* vm)
+{
+    get_save_data_ptr(vm);
+    if(!vm->wal.open) error(vm, "no transaction open");
+    store_abort(vm);
+}
+
+// set_durability(wLevel, wInterval)
+static void os_set_durability(jakvm_t* vm)
+{
+    unsigned_t level = pop(vm);
+    unsigned_t interval = pop(vm);
+    if(level > DURABLE_INTERVAL) error(vm, "invalid durability level");
+    get_save_data_ptr(vm);
+    vm->wal.level = (durability_t)level;
+    vm->wal.interval = interval;
+    // anything logged under a weaker level is made durable now
+    if(level == DURABLE_COMMIT) wal_sync(vm, __atomic_load_n(&vm->wal.ctl->lsn, __ATOMIC_ACQUIRE));
+}
+
+//-------------------------------------------------------------
+// OS.heap
+//-------------------------------------------------------------
+
+// Blocks are one header word (the size class) followed by the payload.
+// Freed blocks are threaded through their first payload word onto one list
+// per size class; fresh blocks are bumped off the top of the region.
+// Classes are exact up to 8 words, then 4 per power of two (<=25% waste).
+
+static size_t heap_class_of(size_t n)
+{
+    if(n <= 8) return n - 1;
+    size_t b = 31 - __builtin_clz(n - 1);
+    size_t j = ((n - ((size_t)1 << b)) + ((size_t)1 << (b - 2)) - 1) >> (b - 2);
+    return 8 + (b - 3) * 4 + (j - 1);
+}
+
+static size_t heap_class_size(size_t c)
+{
+    if(c < 8) return c + 1;
+    size_t b = 3 + (c - 8) / 4;
+    size_t j = (c - 8) % 4 + 1;
+    return ((size_t)1 << b) + j * ((size_t)1 << (b - 2));
+}
+
+static void heap_reset(jakvm_t* vm)
+{
+    memset(&vm->heap, 0, sizeof(vm->heap));
+}
+
+// heap_init(wBase, wSize): hand [wBase, wBase + wSize) over to the allocator
+static void os_heap_init(jakvm_t* vm)
+{
+    unsigned_t base = pop(vm);
+    unsigned_t size = pop(vm);
+    cassert(base > 0);
+    cassert((size_t)base + size <= 0x10000);
+
+    heap_reset(vm);
+    vm->heap.base = vm->heap.top = base;
+    vm->heap.end = (size_t)base + size;
+}
+
+// (p) alloc(wSize): pushes a pointer to wSize words, or 0 if out of memory
+static void os_heap_alloc(jakvm_t* vm)
+{
+    size_t n = (unsigned_t)pop(vm);
+    if(!vm->heap.end) error(vm, "heap not initialized");
+    if(n == 0) n = 1;
+    // more than the biggest class, or the whole region, never fits
+    if(n > heap_class_size(HEAP_NCLASSES - 1) || n >= vm->heap.end - vm->heap.base) {
+        push(vm, 0);
+        return;
+    }
+
+    size_t c = heap_class_of(n);
+    size_t p = 0;
+    if(vm->heap.lists[c]) {
+        p = vm->heap.lists[c];
+        vm->heap.lists[c] = vm->mem->data[p];
+        vm->heap.listed -= heap_class_size(c);
+    } else if(vm->heap.top + heap_class_size(c) + 1 <= vm->heap.end) {
+        p = vm->heap.top + 1;
+        vm->heap.top += heap_class_size(c) + 1;
+    } else {
+        // region exhausted: settle for a free block of a bigger class
+        for(++c; c < HEAP_NCLASSES && !vm->heap.lists[c]; ++c)
+            ;
+        if(c == HEAP_NCLASSES) {
+            push(vm, 0);
+            return;
+        }
+        p = vm->heap.lists[c];
+        vm->heap.lists[c] = vm->mem->data[p];
+        vm->heap.listed -= heap_class_size(c);
+    }
+
+    vm->mem->data[p - 1] = c;
+    vm->heap.used += heap_class_size(c);
+    if(vm->heap.used > vm->heap.peak) vm->heap.peak = vm->heap.used;
+    vm->heap.blocks++;
+    push(vm, p);
+}
+
+// free(p): return a block to its class list; free(0) does nothing
+static void os_heap_free(jakvm_t* vm)
+{
+    size_t p = (unsigned_t)pop(vm);
+    if(!p) return;
+    if(p <= vm->heap.base || p >= vm->heap.top) error(vm, "free of a non-heap pointer");
+
+    unsigned_t h = vm->mem->data[p - 1];
+    if(h & HEAP_FREE_BIT) error(vm, "double free");
+    if(h >= HEAP_NCLASSES) error(vm, "heap corruption");
+
+    size_t size = heap_class_size(h);
+    vm->heap.used -= size;
+    vm->heap.blocks--;
+
+    if(p + size == vm->heap.top) {
+        // topmost block goes straight back to the bump region
+        vm->heap.top = p - 1;
+        return;
+    }
+
+    vm->mem->data[p - 1] = h | HEAP_FREE_BIT;
+    vm->mem->data[p] = vm->heap.lists[h];
+    vm->heap.lists[h] = p;
+    vm->heap.listed += size;
+}
+
+// heap_stats(wAddress): writes 6 words @wAddress:
+//   used, peak used, free listed, never allocated, live blocks,
+//   fragmentation (% of free space outside the largest free block)
+static void os_heap_stats(jakvm_t* vm)
+{
+    unsigned_t address = pop(vm);
+    cassert((size_t)address + 6 <= 0x10000);
+
+    size_t untouched = vm->heap.end - vm->heap.top;
+    size_t largest = untouched;
+    size_t c = 0;
+    for(; c < HEAP_NCLASSES; ++c) {
+        if(vm->heap.lists[c] && heap_class_size(c) > largest) largest = heap_class_size(c);
+    }
+    size_t total = vm->heap.listed + untouched;
+
+    vm->mem->data[address + 0] = vm->heap.used;
+    vm->mem->data[address + 1] = vm->heap.peak;
+    vm->mem->data[address + 2] = vm->heap.listed;
+    vm->mem->data[address + 3] = untouched;
+    vm->mem->data[address + 4] = vm->heap.blocks;
+    vm->mem->data[address + 5] = (total) ? 100 - largest * 100 / total : 0;
+}
+
+//-------------------------------------------------------------
+// OS.events
+//-------------------------------------------------------------
+
+// Timers are timerfds and stdin is just fd 0, all registered with one
+// epoll instance, so a guest waiting for any of them sleeps in the kernel.
+// The epoll data of a timer is its handle (1..MAX_TIMERS).
+
+static int events_fd(jakvm_t* vm)
+{
+    if(!vm->events.epfd) {
+        vm->events.epfd = epoll_create1(EPOLL_CLOEXEC);
+        cassert(vm->events.epfd != -1);
+    }
+    return vm->events.epfd;
+}
+
+static void events_reset(jakvm_t* vm)
+{
+    size_t i = 0;
+    for(; i < MAX_TIMERS; ++i) {
+        if(vm->events.timers[i]) close(vm->events.timers[i]);
+    }
+    if(vm->events.epfd) close(vm->events.epfd);
+    memset(&vm->events, 0, sizeof(vm->events));
+}
+
+static void millis_to_timespec(unsigned_t ms, struct timespec* ts)
+{
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000L;
+}
+
+// would reading stdin not block? stdio may already hold what epoll saw
+static bool stdin_buffered(jakvm_t* vm)
+{
+    if(vm->events.stdinReady) return true;
+#ifdef __GLIBC__
+    return vm->in->_IO_read_ptr < vm->in->_IO_read_end;
+#else
+    return false;
+#endif
+}
+
+// (h) timer_arm(wMillis, wInterval): fires after wMillis, then every
+// wInterval milliseconds unless that is 0
+static void os_timer_arm(jakvm_t* vm)
+{
+    unsigned_t ms = pop(vm);
+    unsigned_t interval = pop(vm);
+
+    size_t i = 0;
+    for(; i < MAX_TIMERS && vm->events.timers[i]; ++i)
+        ;
+    if(i == MAX_TIMERS) error(vm, "out of timers");
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    cassert(fd != -1);
+    struct itimerspec its;
+    millis_to_timespec(ms, &its.it_value);
+    millis_to_timespec(interval, &its.it_interval);
+    // a zero it_value would disarm the timer instead
+    if(!ms) its.it_value.tv_nsec = 1;
+    cassert(timerfd_settime(fd, 0, &its, NULL) == 0);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i + 1;
+    cassert(epoll_ctl(events_fd(vm), EPOLL_CTL_ADD, fd, &ev) == 0);
+
+    vm->events.timers[i] = fd;
+    push(vm, i + 1);
+}
+
+// timer_cancel(h)
+static void os_timer_cancel(jakvm_t* vm)
+{
+    unsigned_t h = pop(vm);
+    if(h == 0 || h > MAX_TIMERS || !vm->events.timers[h - 1]) error(vm, "invalid timer");
+    close(vm->events.timers[h - 1]);
+    vm->events.timers[h - 1] = 0;
+}
+
+// watch_stdin(wOn): whether wait_event wakes up for input
+static void os_watch_stdin(jakvm_t* vm)
+{
+    bool on = pop(vm) != 0;
+    if(on == vm->events.stdin) return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_STDIN;
+    int r = epoll_ctl(events_fd(vm), (on) ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fileno(vm->in), &ev);
+    // a regular file (stdin redirected from one) can always be read
+    if(r == -1 && errno == EPERM) vm->events.stdinReady = on;
+    else cassert(r == 0);
+    vm->events.stdin = on;
+}
+
+// (wEvent) wait_event(wTimeout): blocks until a timer fires (pushes its
+// handle), stdin becomes readable (pushes -1) or wTimeout milliseconds
+// pass (pushes 0); a wTimeout of -1 waits forever
+static void os_wait_event(jakvm_t* vm)
+{
+    signed_t timeout = pop(vm);
+
+    if(vm->events.stdin && stdin_buffered(vm)) {
+        push(vm, EVENT_STDIN);
+        return;
+    }
+
+    struct epoll_event ev;
+    int n;
+    do {
+        n = epoll_wait(events_fd(vm), &ev, 1, (timeout < 0) ? -1 : (unsigned_t)timeout);
+    } while(n == -1 && errno == EINTR);
+    cassert(n != -1);
+
+    if(n == 0) {
+        push(vm, 0);
+        return;
+    }
+    if(ev.data.u32 != EVENT_STDIN) {
+        // consume the expirations, or epoll keeps reporting the timer
+        uint64_t expirations;
+        (void) read(vm->events.timers[ev.data.u32 - 1], &expirations, sizeof(expirations));
+    }
+    push(vm, ev.data.u32);
+}
+
+// sleep(wMillis)
+static void os_sleep(jakvm_t* vm)
+{
+    struct timespec ts;
+    millis_to_timespec(pop(vm), &ts);
+    while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+// yield(): ends the slice, so the host can run something else
+static void os_yield(jakvm_t* vm)
+{
+    vm_pause(vm);
+}
+
+//-------------------------------------------------------------
+// OS.windows
+//-------------------------------------------------------------
+
+// A window is a range of pages of machine.data replaced by a mapping of a
+// file (or of a POSIX shared memory object, for names starting with
+// "shm:"). Writable windows are MAP_SHARED; read only ones are
+// MAP_PRIVATE, so stray guest writes stay private. Whatever the window
+// covered is put back when it goes away.
+
+static size_t window_page_words()
+{
+    return sysconf(_SC_PAGESIZE) / sizeof(signed_t);
+}
+
+static window_t* get_window(jakvm_t* vm, unsigned_t h)
+{
+    if(h == 0 || h > MAX_WINDOWS || !vm->windows[h - 1].words) error(vm, "invalid window");
+    return &vm->windows[h - 1];
+}
+
+// (re)map w->offset of the file; pages past its end read as zeros
+static void window_map(jakvm_t* vm, window_t* w)
+{
+    struct stat sb;
+    cassert(fstat(w->fd, &sb) == 0);
+    size_t bytes = w->words * sizeof(signed_t);
+    if(w->writable && sb.st_size < w->offset + (off_t)bytes) {
+        // grow the file rather than fault past its end
+        cassert(ftruncate(w->fd, w->offset + bytes) == 0);
+        sb.st_size = w->offset + bytes;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t inFile = 0;
+    if(sb.st_size > w->offset) {
+        inFile = sb.st_size - w->offset;
+        inFile = (inFile + page - 1) / page * page;
+        if(inFile > bytes) inFile = bytes;
+    }
+
+    char* base = (char*)&vm->mem->data[w->address];
+    if(inFile) {
+        void* p = mmap(base, inFile,
+                PROT_READ|PROT_WRITE,
+                MAP_FIXED | ((w->writable) ? MAP_SHARED : MAP_PRIVATE),
+                w->fd, w->offset);
+        cassert(p == base);
+    }
+    if(inFile < bytes) {
+        void* p = mmap(base + inFile, bytes - inFile,
+                PROT_READ|PROT_WRITE,
+                MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS,
+                -1, 0);
+        cassert(p == base + inFile);
+    }
+}
+
+static void window_close(jakvm_t* vm, window_t* w)
+{
+    void* base = &vm->mem->data[w->address];
+    size_t bytes = w->words * sizeof(signed_t);
+    void* p = mmap(base, bytes, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    cassert(p == base);
+    memcpy(base, w->saved, bytes);
+
+    free(w->saved);
+    close(w->fd);
+    memset(w, 0, sizeof(window_t));
+}
+
+static void windows_reset(jakvm_t* vm)
+{
+    size_t i = 0;
+    for(; i < MAX_WINDOWS; ++i) {
+        if(vm->windows[i].words) window_close(vm, &vm->windows[i]);
+    }
+}
+
+// (h) map_window(pName, wAddress, wWords, wWritable): map the start of a
+// file over wWords words @wAddress; wAddress must be page aligned and
+// wWords is rounded up to whole pages
+static void os_map_window(jakvm_t* vm)
+{
+    unsigned_t pName = pop(vm);
+    size_t address = (unsigned_t)pop(vm);
+    size_t words = (unsigned_t)pop(vm);
+    bool writable = pop(vm) != 0;
+
+    size_t page = window_page_words();
+    words = (words + page - 1) / page * page;
+    if(address % page) error(vm, "window not page aligned");
+    if(!words || address + words > 0x10000) error(vm, "window out of memory");
+
+    size_t i, free_slot = MAX_WINDOWS;
+    for(i = 0; i < MAX_WINDOWS; ++i) {
+        window_t* w = &vm->windows[i];
+        if(!w->words) {
+            if(free_slot == MAX_WINDOWS) free_slot = i;
+        } else if(address < w->address + w->words && w->address < address + words) {
+            error(vm, "windows overlap");
+        }
+    }
+    if(free_slot == MAX_WINDOWS) error(vm, "out of windows");
+
+    char* name = os_deref_string(vm, pName);
+    int flags = (writable) ? O_RDWR|O_CREAT : O_RDONLY;
+    int fd = (strncmp(name, "shm:", 4) == 0)
+        ? shm_open(name + 4, flags, S_IRUSR|S_IWUSR)
+        : open(name, flags, S_IRUSR|S_IWUSR);
+    if(fd == -1) logger(vm, LOG_ERR, "cannot open %s\n", name);
+    free(name);
+    if(fd == -1) error(vm, "map_window failed");
+
+    window_t* w = &vm->windows[free_slot];
+    w->fd = fd;
+    w->writable = writable;
+    w->address = address;
+    w->words = words;
+    w->offset = 0;
+    w->saved = (signed_t*)malloc(words * sizeof(signed_t));
+    memcpy(w->saved, &vm->mem->data[address], words * sizeof(signed_t));
+    window_map(vm, w);
+
+    push(vm, free_slot + 1);
+}
+
+// move_window(h, wPage): slide the window to page wPage of the file
+static void os_move_window(jakvm_t* vm)
+{
+    window_t* w = get_window(vm, pop(vm));
+    unsigned_t page = pop(vm);
+    w->offset = (off_t)page * sysconf(_SC_PAGESIZE);
+    window_map(vm, w);
+}
+
+// sync_window(h): flush a writable window to its file
+static void os_sync_window(jakvm_t* vm)
+{
+    window_t* w = get_window(vm, pop(vm));
+    if(w->writable) cassert(msync(&vm->mem->data[w->address], w->words * sizeof(signed_t), MS_SYNC) == 0);
+}
+
+// unmap_window(h)
+static void os_unmap_window(jakvm_t* vm)
+{
+    window_t* w = get_window(vm, pop(vm));
+    window_close(vm, w);
+}
+
+// (wHi, wLo) window_file_size(h): size of the file in words; wLo on top
+static void os_window_file_size(jakvm_t* vm)
+{
+    window_t* w = get_window(vm, pop(vm));
+    struct stat sb;
+    cassert(fstat(w->fd, &sb) == 0);
+    uint32_t words = sb.st_size / sizeof(signed_t);
+    push(vm, words >> 16);
+    push(vm, words & 0xFFFF);
+}
+
+//-------------------------------------------------------------
+// OS.interop
+//-------------------------------------------------------------
+
+// R/W memory access
+static unsigned_t* os_deref(jakvm_t* vm, unsigned_t address)
+{
+    return &vm->mem->data[address];
+}
+
+static void decode(jakvm_t* vm);
+
+// called from a utility library to start executing VM code from address
+// the code is called like CA would: it runs until it RTs back, with the
+// IN that got us here standing in as the call site
+static void os_exec_vm_code(jakvm_t* vm, unsigned_t address)
+{
+    unsigned_t site = vm->machine.regs[IP];
+    signed_t ra = vm->machine.regs[RA];
+
+    vm->machine.regs[RA] = site;
+    vm->machine.regs[IP] = address;
+    // tasks cannot switch under us
+    vm->tasks.nested++;
+    while(1) {
+        decode(vm);
+        if((unsigned_t)vm->machine.regs[IP] == site) break;
+        vm->machine.regs[IP]++;
+    }
+    vm->tasks.nested--;
+    vm->machine.regs[RA] = ra;
+}
+
+static FILE* os_output(jakvm_t* vm)
+{
+    return vm->out;
+}
+
+// factory method for vm_utilities passed to utility libraries
+static vm_utilities_t os_get_vm_utilities(jakvm_t* vm, ext_lib_t* lib)
+{
+    vm_utilities_t utils;
+    utils.ctx = vm;
+    utils.state = &lib->state;
+    utils.pop = &pop;
+    utils.push = &push;
+    utils.deref_string = &os_deref_string;
+    utils.exec_vm_code = &os_exec_vm_code;
+    utils.deref = &os_deref;
+    utils.from_short_name = &os_from_short_name;
+    utils.error = &error;
+    utils.output = &os_output;
+    return utils;
+}
+
+static ext_lib_t* find_library(jakvm_t* vm, char const* libname)
+{
+    size_t i = 0;
+    for(; i < vm->numLibs; ++i) {
+        if(strcmp(libname, vm->libs[i].name) == 0) return &vm->libs[i];
+    }
+    return NULL;
+}
+
+// loads lib<libname>.so (which takes libname over) and initializes it;
+// what went wrong, or NULL
+static char const* open_library(jakvm_t* vm, char* libname, ext_lib_t** lib)
+{
+    char actualLibName[256];
+    void* dll = NULL;
+
+    if(vm->numLibs == MAX_EXT_LIBS) return "too many libraries";
+
+    // #1 attempt LD_LIBRARY_PATH
+    snprintf(actualLibName, sizeof(actualLibName), "lib%s.so", libname);
+    dll = dlopen(actualLibName, RTLD_LAZY);
+    if(!dll) {
+        // #2 attempt current directory
+        snprintf(actualLibName, sizeof(actualLibName), "./lib%s.so", libname);
+        dll = dlopen(actualLibName, RTLD_LAZY);
+    }
+
+    if(!dll) return "failed to load library";
+    utility_lib_t (*initialize)(void);
+
+    *(void**) (&initialize) = dlsym(dll, "initialize");
+    if(!initialize) return "failed to call initialize";
+
+    // every VM loading a library gets its own entry, so its state
+    // stays its own; the library itself is loaded once per process
+    *lib = &vm->libs[vm->numLibs++];
+    memset(*lib, 0, sizeof(ext_lib_t));
+    (*lib)->name = libname;
+    (*lib)->dll = dll;
+    *(void**) (&(*lib)->release) = dlsym(dll, "release");
+    (*lib)->lib = (*initialize)();
+    return NULL;
+}
+
+// call an arbitrary utility routine from an arbitrary utility library
+static void os_callextroutine(jakvm_t* vm)
+{
+    unsigned_t wLib = pop(vm);
+    unsigned_t wFunc = pop(vm);
+    char* libname = os_deref_string(vm, wLib);
+
+    ext_lib_t* lib = find_library(vm, libname);
+    if(lib) {
+        free(libname);
+    } else {
+        char const* failed = open_library(vm, libname, &lib);
+        if(failed) error(vm, failed);
+    }
+    cassert(wFunc < lib->lib.numUtilities);
+    // exec proc
+    lib->lib.utilities[wFunc](os_get_vm_utilities(vm, lib), &vm->machine.regs);
+}
+
+//-------------------------------------------------------------
+// OS.parallel
+//-------------------------------------------------------------
+
+// parallel_for runs a guest sub once per index on a few host threads.
+// Each thread has a worker VM of its own: registers and a stack (so the
+// usual R.30/R.31 conventions hold inside the sub), sharing the code and
+// data of the VM that called parallel_for. Indices are handed out a chunk
+// at a time; the call returns once every index ran.
+//
+// Workers only get the utilities that touch nothing but data and their
+// own output: logging (3, 5), utility libraries (20), which see a
+// library state of the worker's own for the duration of the call, and
+// channels (61-65).
+typedef struct {
+    jakvm_t* parent;
+    unsigned_t sub, site;
+    size_t first, count, chunk, chunks;
+    size_t next;                // chunk to hand out next
+    int stop;                   // a worker failed, the others give up
+} pfor_t;
+
+typedef struct {
+    pfor_t* job;
+    jakvm_t* vm;
+    pthread_t thread;
+    int failed;
+} pfor_worker_t;
+
+
+static bool pfor_allowed(unsigned_t which)
+{
+    return which == 3 || which == 5 || which == 20 || (which >= 61 && which <= 65);
+}
+
+static void* pfor_work(void* p)
+{
+    pfor_worker_t* w = (pfor_worker_t*)p;
+    pfor_t* job = w->job;
+    jakvm_t* vm = w->vm;
+    if(setjmp(vm->halt)) {
+        // the error, if any, is printed already
+        w->failed = 1;
+        __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    while(!__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+        size_t c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(c >= job->chunks) break;
+        size_t i = c * job->chunk, end = i + job->chunk;
+        if(end > job->count) end = job->count;
+        for(; i < end; ++i) {
+            vm->machine.regs[SP] = 0;
+            vm->machine.regs[IP] = job->site;
+            push(vm, job->first + i);
+            os_exec_vm_code(vm, job->sub);
+        }
+    }
+    return NULL;
+}
+
+// parallel_for(pSub, wFirst, wCount, wChunk): calls pSub(wIndex) for
+// every wIndex in [wFirst, wFirst + wCount), wChunk indices at a time (0
+// picks a chunk size), on as many threads as there are cores
+static void os_parallel_for(jakvm_t* vm)
+{
+    pfor_t job;
+    memset(&job, 0, sizeof(job));
+    job.parent = vm;
+    job.sub = pop(vm);
+    job.first = (unsigned_t)pop(vm);
+    job.count = (unsigned_t)pop(vm);
+    job.chunk = (unsigned_t)pop(vm);
+    job.site = vm->machine.regs[IP];
+    if(!job.count) return;
+
+    size_t n = sysconf(_SC_NPROCESSORS_ONLN);
+    // a few chunks per thread evens out indices that take longer
+    if(!job.chunk) job.chunk = (job.count + n * 4 - 1) / (n * 4);
+    job.chunks = (job.count + job.chunk - 1) / job.chunk;
+    if(n > job.chunks) n = job.chunks;
+
+    pfor_worker_t* workers = (pfor_worker_t*)calloc(n, sizeof(pfor_worker_t));
+    size_t i = 0, started = 0;
+    for(; i < n; ++i) {
+        jakvm_t* w = jakvm_new(vm->image);
+        if(!w) break;
+        w->mem = vm->mem;
+        w->parent = vm;
+        w->in = vm->in;
+        w->out = vm->out;
+        w->err = vm->err;
+        w->flags = vm->flags;
+        w->logger_state = LS_FIRST;
+        workers[i].job = &job;
+        workers[i].vm = w;
+    }
+    cassert(i == n);
+    // the calling thread works too
+    for(i = 1; i < n; ++i) {
+        if(pthread_create(&workers[i].thread, NULL, &pfor_work, &workers[i])) break;
+        ++started;
+    }
+    pfor_work(&workers[0]);
+
+    bool failed = workers[0].failed;
+    for(i = 1; i <= started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        failed = failed || workers[i].failed;
+    }
+    for(i = 0; i < n; ++i) {
+        jakvm_t* w = workers[i].vm;
+        size_t k = 0;
+        for(; k < w->numLibs; ++k) {
+            ext_lib_t* lib = &w->libs[k];
+            if(lib->release && lib->state) lib->release(lib->state);
+        }
+        jakvm_free(w);
+    }
+    free(workers);
+    if(failed) error(vm, "parallel_for: a worker stopped");
+}
+
+//-------------------------------------------------------------
+// OS.channels
+//-------------------------------------------------------------
+
+// A channel is a bounded queue of messages of a fixed number of words,
+// shared by every VM of the process that opens it by name. It is a ring
+// of cells, each with a sequence number telling whose turn it is (Vyukov's
+// bounded queue): senders and receivers each claim a cell with a CAS on
+// their own counter, then copy without holding anything, so any number of
+// both go at it without a lock. Only waiting on a full or empty channel
+// goes through the kernel, on a futex bumped after every message.
+//
+// A channel lives as long as some VM has it open: every run that opens it
+// counts once, until jakvm_end. A handle is the same in every VM that
+// opened the channel, and invalid in the others. A parallel_for worker
+// opens channels on behalf of the VM that called parallel_for.
+#define MAX_CHANNELS 64         // the bits of jakvm_t.channels
+#define CHAN_SPINS 256
+
+typedef struct {
+    // the counters get cache lines of their own
+    size_t sendPos __attribute__((aligned(64)));
+    size_t recvPos __attribute__((aligned(64)));
+    uint32_t event __attribute__((aligned(64)));   // bumped when something changed
+    uint32_t waiters;
+    int closed;
+    int users;                  // VMs that have it open, under g_channelsLock
+    char name[STORE_NAME_MAX];
+    size_t mask;                // cells - 1
+    size_t words;               // per message
+    size_t* seq;
+    signed_t* cells;
+} chan_t;
+
+static chan_t* g_channels[MAX_CHANNELS];
+static pthread_mutex_t g_channelsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// the VM that keeps the channels a VM opens open
+static jakvm_t* chan_owner(jakvm_t* vm)
+{
+    return (vm->parent) ? vm->parent : vm;
+}
+
+// the VM has it open, so it stays until the VM's run ends
+static chan_t* get_channel(jakvm_t* vm, unsigned_t h)
+{
+    uint64_t open = __atomic_load_n(&chan_owner(vm)->channels, __ATOMIC_ACQUIRE);
+    chan_t* c = (h && h <= MAX_CHANNELS && (open >> (h - 1) & 1))
+        ? __atomic_load_n(&g_channels[h - 1], __ATOMIC_ACQUIRE) : NULL;
+    if(!c) error(vm, "invalid channel");
+    return c;
+}
+
+static void chan_free(chan_t* c)
+{
+    free(c->seq);
+    free(c->cells);
+    free(c);
+}
+
+// NULL if there is not enough memory for it
+static chan_t* chan_new(char const* name, size_t capacity, size_t words)
+{
+    size_t cells = 1;
+    while(cells < capacity) cells <<= 1;
+    chan_t* c = (chan_t*)aligned_alloc(64, sizeof(chan_t));
+    if(!c) return NULL;
+    memset(c, 0, sizeof(chan_t));
+    strcpy(c->name, name);
+    c->mask = cells - 1;
+    c->words = words;
+    c->seq = (size_t*)malloc(cells * sizeof(size_t));
+    c->cells = (signed_t*)malloc(cells * words * sizeof(signed_t));
+    if(!c->seq || !c->cells) {
+        chan_free(c);
+        return NULL;
+    }
+    size_t k = 0;
+    for(; k < cells; ++k) c->seq[k] = k;
+    return c;
+}
+
+// closes the VM's hold on every channel it opened; the last one out
+// frees the channel and its name
+static void channels_release(jakvm_t* vm)
+{
+    if(!vm->channels) return;
+    pthread_mutex_lock(&g_channelsLock);
+    size_t i = 0;
+    for(; i < MAX_CHANNELS; ++i) {
+        chan_t* c = g_channels[i];
+        if(!(vm->channels >> i & 1) || --c->users) continue;
+        __atomic_store_n(&g_channels[i], NULL, __ATOMIC_RELEASE);
+        chan_free(c);
+    }
+    __atomic_store_n(&vm->channels, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_channelsLock);
+}
+
+static void chan_wake(chan_t* c)
+{
+    __atomic_fetch_add(&c->event, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &c->event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+static bool chan_try_send(chan_t* c, signed_t* msg)
+{
+    size_t pos = __atomic_load_n(&c->sendPos, __ATOMIC_RELAXED);
+    for(;;) {
+        size_t seq = __atomic_load_n(&c->seq[pos & c->mask], __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if(dif < 0) return false;           // full
+        if(dif > 0) {
+            pos = __atomic_load_n(&c->sendPos, __ATOMIC_RELAXED);
+        } else if(__atomic_compare_exchange_n(&c->sendPos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    memcpy(&c->cells[(pos & c->mask) * c->words], msg, c->words * sizeof(signed_t));
+    __atomic_store_n(&c->seq[pos & c->mask], pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool chan_try_receive(chan_t* c, signed_t* msg)
+{
+    size_t pos = __atomic_load_n(&c->recvPos, __ATOMIC_RELAXED);
+    for(;;) {
+        size_t seq = __atomic_load_n(&c->seq[pos & c->mask], __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(dif < 0) return false;           // empty
+        if(dif > 0) {
+            pos = __atomic_load_n(&c->recvPos, __ATOMIC_RELAXED);
+        } else if(__atomic_compare_exchange_n(&c->recvPos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    memcpy(msg, &c->cells[(pos & c->mask) * c->words], c->words * sizeof(signed_t));
+    __atomic_store_n(&c->seq[pos & c->mask], pos + c->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// retries op until it succeeds (1) or the channel is closed (op's last
+// try); spins a little first, since the other side is usually just about
+// done. Then sleeps, or gives up (-1) if it may not: on a thread taking
+// turns between VMs, the other side may be waiting for this one's turn
+// to end
+static int chan_wait(chan_t* c, bool (*op)(chan_t*, signed_t*), signed_t* msg, bool may_sleep)
+{
+    int i = 0;
+    for(; i < CHAN_SPINS; ++i) {
+        if(op(c, msg)) return 1;
+        if(__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE)) return op(c, msg);
+        __builtin_ia32_pause();
+    }
+    if(!may_sleep) return -1;
+    for(;;) {
+        uint32_t event = __atomic_load_n(&c->event, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&c->waiters, 1, __ATOMIC_SEQ_CST);
+        bool done = op(c, msg);
+        bool closed = !done && __atomic_load_n(&c->closed, __ATOMIC_ACQUIRE);
+        if(!done && !closed) {
+            // returns at once if a message came or went since event was read
+            syscall(SYS_futex, &c->event, FUTEX_WAIT_PRIVATE, event, NULL, NULL, 0);
+        }
+        __atomic_fetch_sub(&c->waiters, 1, __ATOMIC_SEQ_CST);
+        if(done) return 1;
+        if(closed) return op(c, msg);
+    }
+}
+
+// whether the VM may sleep on a channel; if not, chan_retry has the
+// slice end and the utility run again in the next
+static bool chan_may_sleep(jakvm_t* vm)
+{
+    return !vm->sliced || !vm_can_pause(vm);
+}
+
+// puts back what the utility popped (IN's which last) and pauses at the IN
+static void chan_retry(jakvm_t* vm, unsigned_t which, unsigned_t h, unsigned_t address)
+{
+    push(vm, address);
+    push(vm, h);
+    push(vm, which);
+    vm->machine.regs[IP]--;
+    vm_pause(vm);
+}
+
+static signed_t* chan_message(jakvm_t* vm, chan_t* c, unsigned_t address)
+{
+    if((size_t)address + c->words > 0x10000) error(vm, "message out of memory");
+    return &vm->mem->data[address];
+}
+
+// (h) chan_open(pName, wCapacity, wWords): finds the named channel, or
+// creates it for wCapacity messages (rounded up to a power of 2) of wWords
+// words each
+static void os_chan_open(jakvm_t* vm)
+{
+    unsigned_t pName = pop(vm);
+    size_t capacity = (unsigned_t)pop(vm);
+    size_t words = (unsigned_t)pop(vm);
+
+    char* name = os_deref_string(vm, pName);
+    if(!*name || strlen(name) >= STORE_NAME_MAX) {
+        free(name);
+        error(vm, "invalid channel name");
+    }
+
+    jakvm_t* owner = chan_owner(vm);
+    char const* failed = NULL;
+    pthread_mutex_lock(&g_channelsLock);
+    // freed channels leave holes
+    size_t i = 0, hole = MAX_CHANNELS;
+    for(; i < MAX_CHANNELS; ++i) {
+        if(!g_channels[i]) {
+            if(hole == MAX_CHANNELS) hole = i;
+        } else if(strcmp(g_channels[i]->name, name) == 0) {
+            break;
+        }
+    }
+    if(i == MAX_CHANNELS) {
+        i = hole;
+        chan_t* c = NULL;
+        if(i == MAX_CHANNELS) failed = "out of channels";
+        else if(!capacity || !words) failed = "invalid channel size";
+        else if(!(c = chan_new(name, capacity, words))) failed = "out of memory for the channel";
+        if(c) __atomic_store_n(&g_channels[i], c, __ATOMIC_RELEASE);
+    } else if(g_channels[i]->words != words) {
+        failed = "channel message size mismatch";
+    }
+    if(!failed && !(owner->channels >> i & 1)) {
+        g_channels[i]->users++;
+        __atomic_fetch_or(&owner->channels, (uint64_t)1 << i, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_channelsLock);
+    free(name);
+
+    if(failed) error(vm, failed);
+    push(vm, i + 1);
+}
+
+// chan_send(h, wAddress): sends the message @wAddress; waits while the
+// channel is full
+static void os_chan_send(jakvm_t* vm)
+{
+    unsigned_t h = pop(vm), address = pop(vm);
+    chan_t* c = get_channel(vm, h);
+    signed_t* msg = chan_message(vm, c, address);
+    int sent = (__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE)) ? 0
+        : chan_wait(c, &chan_try_send, msg, chan_may_sleep(vm));
+    if(sent < 0) chan_retry(vm, 62, h, address);
+    if(!sent) error(vm, "send on a closed channel");
+    chan_wake(c);
+}
+
+// (wGot) chan_receive(h, wAddress): waits for a message and writes it
+// @wAddress; 0 once the channel is closed and empty
+static void os_chan_receive(jakvm_t* vm)
+{
+    unsigned_t h = pop(vm), address = pop(vm);
+    chan_t* c = get_channel(vm, h);
+    signed_t* msg = chan_message(vm, c, address);
+    int got = chan_wait(c, &chan_try_receive, msg, chan_may_sleep(vm));
+    if(got < 0) chan_retry(vm, 63, h, address);
+    if(got) chan_wake(c);
+    push(vm, got);
+}
+
+// (wGot) chan_try_receive(h, wAddress): like chan_receive, but does not
+// wait; 0 if the channel is empty, -1 if it is closed as well
+static void os_chan_try_receive(jakvm_t* vm)
+{
+    chan_t* c = get_channel(vm, pop(vm));
+    signed_t* msg = chan_message(vm, c, pop(vm));
+    // closed first: a message sent before the close is still seen
+    bool closed = __atomic_load_n(&c->closed, __ATOMIC_ACQUIRE);
+    bool got = chan_try_receive(c, msg);
+    if(got) chan_wake(c);
+    push(vm, (got) ? 1 : (closed) ? -1 : 0);
+}
+
+// chan_close(h): no more messages; receivers get what is left, then 0
+static void os_chan_close(jakvm_t* vm)
+{
+    chan_t* c = get_channel(vm, pop(vm));
+    __atomic_store_n(&c->closed, 1, __ATOMIC_RELEASE);
+    chan_wake(c);
+}
+
+//-------------------------------------------------------------
+// OS.tasks
+//-------------------------------------------------------------
+
+// Tasks are coroutines within a VM: each has registers and a stack of its
+// own and shares everything else. Only the running one's registers are in
+// machine.regs; switching copies them out and the next one's in, and
+// points vm->stack at the next one's stack, so a switch costs the same
+// however many tasks there are. A task runs until it yields, joins a task
+// that did not end yet, or ends; then the next one in the run queue runs
+// (round robin). Stacks are mapped as they are touched, so an idle task
+// takes a page or two.
+//
+// The main program is task 0 (handle 1); the table is set up by the first
+// spawn. A task ends when its sub returns to TASK_RETURN, which stands in
+// for a call site.
+
+static void tasks_reset(jakvm_t* vm)
+{
+    tasks_t* ts = &vm->tasks;
+    size_t i = 1;
+    for(; i < ts->count; ++i) {
+        if(ts->all[i].stack) munmap(ts->all[i].stack, 0x10000 * sizeof(signed_t));
+    }
+    free(ts->all);
+    memset(ts, 0, sizeof(tasks_t));
+    vm->stack = vm->machine.stack_data;
+}
+
+static void tasks_init(jakvm_t* vm)
+{
+    tasks_t* ts = &vm->tasks;
+    if(ts->all) return;
+    ts->max = 64;
+    ts->all = (task_t*)calloc(ts->max, sizeof(task_t));
+    cassert(ts->all);
+    ts->count = 1;
+    ts->all[0].state = TASK_RUNNING;
+    ts->all[0].stack = vm->machine.stack_data;
+    ts->current = 0;
+    ts->head = ts->tail = ts->free = NO_TASK;
+}
+
+static void task_enqueue(jakvm_t* vm, size_t i)
+{
+    tasks_t* ts = &vm->tasks;
+    ts->all[i].state = TASK_READY;
+    ts->all[i].next = NO_TASK;
+    if(ts->tail == NO_TASK) ts->head = i;
+    else ts->all[ts->tail].next = i;
+    ts->tail = i;
+}
 
-// R/W memory access
-static unsigned_t* os_deref(unsigned_t address)
+// leaves the running task where it is and runs the next ready one
+static void task_run_next(jakvm_t* vm)
 {
-    return &machine.data[address];
+    tasks_t* ts = &vm->tasks;
+    size_t i = ts->head;
+    if(i == NO_TASK) error(vm, "every task is waiting on another");
+    ts->head = ts->all[i].next;
+    if(ts->head == NO_TASK) ts->tail = NO_TASK;
+
+    memcpy(ts->all[ts->current].regs, vm->machine.regs, sizeof(vm->machine.regs));
+    task_t* t = &ts->all[i];
+    memcpy(vm->machine.regs, t->regs, sizeof(vm->machine.regs));
+    vm->stack = t->stack;
+    t->state = TASK_RUNNING;
+    ts->current = i;
 }
 
-// called from a utility library to start executing VM code from address
-static void os_exec_vm_code(unsigned_t address)
+static void task_free(jakvm_t* vm, size_t i)
 {
-    error("NOT IMPLEMENTED os_exec_vm_code");
+    tasks_t* ts = &vm->tasks;
+    ts->all[i].state = TASK_FREE;
+    ts->all[i].next = ts->free;
+    ts->free = i;
 }
 
-// factory method for vm_utilities passed to utility libraries
-static vm_utilities_t os_get_vm_utilities()
+static task_t* get_task(jakvm_t* vm, unsigned_t h)
 {
-    vm_utilities_t utils;
-    utils.pop = &pop;
-    utils.push = &push;
-    utils.deref_string = &os_deref_string;
-    utils.exec_vm_code = &os_exec_vm_code;
-    utils.deref = &os_deref;
-    return utils;
+    tasks_t* ts = &vm->tasks;
+    size_t i = (size_t)h - 1;
+    if(!h || i >= ts->count || ts->all[i].state == TASK_FREE) error(vm, "invalid task");
+    return &ts->all[i];
 }
 
-// call an arbitrary utility routine from an arbitrary utility library
-static void os_callextroutine()
+static void no_nested_switch(jakvm_t* vm)
 {
-    unsigned_t wLib = pop();
-    unsigned_t wFunc = pop();
-    char const* libname = os_deref_string(wLib);
+    if(vm->tasks.nested) error(vm, "tasks cannot switch inside a library call");
+}
 
-    typedef struct {
-        char* libname;
-        utility_lib_t utilities;
-    } type_t;
-    static type_t loadedUtilities[128];
-    static size_t numLoadedUtilities;
+// the running task returned from its sub: hands what is on top of its
+// stack to whoever joins it
+static void task_end(jakvm_t* vm)
+{
+    no_nested_switch(vm);
+    tasks_t* ts = &vm->tasks;
+    task_t* t = &ts->all[ts->current];
+    t->result = (vm->machine.regs[SP] > 0) ? vm->stack[vm->machine.regs[SP] - 1] : 0;
+    t->state = TASK_ENDED;
+    if(t->joiner != NO_TASK) {
+        task_t* j = &ts->all[t->joiner];
+        j->stack[j->regs[SP]++] = t->result;
+        task_enqueue(vm, t->joiner);
+        task_free(vm, ts->current);
+    }
+    task_run_next(vm);
+}
 
-    // find so libname
-    size_t i = 0;
-    int found = -1;
-    for(; i < numLoadedUtilities; ++i) {
-        if(strcmp(libname, loadedUtilities[i].libname) == 0) {
-            cassert(wFunc < loadedUtilities[i].utilities.numUtilities);
-            found = i;
-            break;
+// (h) task_spawn(wSub, wArg): a new task calling wSub(wArg), queued
+// behind the ready ones
+static void os_task_spawn(jakvm_t* vm)
+{
+    unsigned_t sub = pop(vm);
+    signed_t arg = pop(vm);
+
+    tasks_init(vm);
+    tasks_t* ts = &vm->tasks;
+    size_t i = ts->free;
+    if(i != NO_TASK) {
+        ts->free = ts->all[i].next;
+    } else {
+        if(ts->count == MAX_TASKS) error(vm, "out of tasks");
+        if(ts->count == ts->max) {
+            ts->max *= 2;
+            ts->all = (task_t*)realloc(ts->all, ts->max * sizeof(task_t));
+            cassert(ts->all);
         }
+        i = ts->count++;
+        memset(&ts->all[i], 0, sizeof(task_t));
     }
-    // load lib if not found || error
-    if(found == -1) {
-        char actualLibName[256];
-        void* dll = NULL;
-
-        // #1 attempt LD_LIBRARY_PATH
-        sprintf(actualLibName, "lib%s.so", libname);
-        dll = dlopen(actualLibName, RTLD_LAZY);
-        if(!dll) {
-            // #2 attempt current directory
-            sprintf(actualLibName, "./lib%s.so", libname);
-            dll = dlopen(actualLibName, RTLD_LAZY);
+    task_t* t = &ts->all[i];
+    if(!t->stack) {
+        void* p = mmap(NULL, 0x10000 * sizeof(signed_t), PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if(p == MAP_FAILED) {
+            t->next = ts->free;
+            ts->free = i;
+            error(vm, "out of memory for task stacks");
         }
+        t->stack = (signed_t*)p;
+    }
+    memset(t->regs, 0, sizeof(t->regs));
+    t->stack[0] = arg;
+    t->regs[SP] = 1;
+    t->regs[RA] = (signed_t)TASK_RETURN;
+    // like CA, IP gets incremented before the first instruction
+    t->regs[IP] = sub - 1;
+    t->joiner = NO_TASK;
+    task_enqueue(vm, i);
+    push(vm, i + 1);
+}
+
+// task_yield(): lets the other ready tasks run first
+static void os_task_yield(jakvm_t* vm)
+{
+    tasks_t* ts = &vm->tasks;
+    if(!ts->all || ts->head == NO_TASK) return;
+    no_nested_switch(vm);
+    task_enqueue(vm, ts->current);
+    task_run_next(vm);
+}
+
+// (w) task_join(h): waits for a task to end; pushes what its sub left on
+// top of its stack
+static void os_task_join(jakvm_t* vm)
+{
+    unsigned_t h = pop(vm);
+    tasks_init(vm);
+    tasks_t* ts = &vm->tasks;
+    task_t* t = get_task(vm, h);
+    size_t i = (size_t)h - 1;
+    if(i == ts->current || t->state == TASK_RUNNING) error(vm, "a task cannot join itself");
+    if(i == 0) error(vm, "the main program cannot be joined");
+    if(t->joiner != NO_TASK) error(vm, "task already joined");
+
+    if(t->state == TASK_ENDED) {
+        push(vm, t->result);
+        task_free(vm, i);
+        return;
+    }
+    no_nested_switch(vm);
+    t->joiner = ts->current;
+    ts->all[ts->current].state = TASK_JOINING;
+    task_run_next(vm);
+}
 
-        if(!dll) error("failed to load library");
-        utility_lib_t (*initialize)(void);
+// (h) task_self()
+static void os_task_self(jakvm_t* vm)
+{
+    push(vm, vm->tasks.current + 1);
+}
 
-        *(void**) (&initialize) = dlsym(dll, "initialize");
-        if(dlerror()) error("failed to call initialize");
+//-------------------------------------------------------------
+// OS.reload
+//-------------------------------------------------------------
 
-        loadedUtilities[numLoadedUtilities].libname = (char*)malloc(strlen(libname));
-        strcpy(loadedUtilities[numLoadedUtilities].libname, libname);
-        loadedUtilities[numLoadedUtilities].utilities = (*initialize)();
-        found = numLoadedUtilities;
-        numLoadedUtilities++;
+// A new build of an image can take over a running VM: its code replaces
+// the code, and the data, the stack and the registers stay what the run
+// made them. The new code is expected to know the data it finds (the same
+// declarations, say, with new ones after them). Nothing is derived from
+// the code ahead of running it, so the next instruction fetched is the new
+// code's; tasks other than the running one carry on at their saved IPs,
+// in the new code. From then on the VM's image is the new build, so RS
+// starts the new build over rather than the old one; the snapshot the run
+// came from holds the old one, so it is dropped and RS loads the image.
+// The save data keeps its name.
+
+// swaps in the code of image; false if it cannot be read, and nothing
+// changed then
+static bool reload_code(jakvm_t* vm, char const* image)
+{
+    int fd = open(image, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return false;
+    struct stat sb;
+    code_t* code = (code_t*)malloc(sizeof(vm->machine.code));
+    bool ok = fstat(fd, &sb) == 0 && sb.st_size >= 0x30000
+        && pread(fd, code, sizeof(vm->machine.code), 0) == sizeof(vm->machine.code);
+    close(fd);
+    if(ok) {
+        // the code of a snapshot or checkpoint is mapped read only
+        cassert(mprotect(vm->machine.code, sizeof(vm->machine.code), PROT_READ|PROT_WRITE) == 0);
+        memcpy(vm->machine.code, code, sizeof(vm->machine.code));
+        // the save data stays the one the run had, named after the old image
+        if(!vm->save) vm->save = save_file_name(vm, "");
+        jakvm_set_image(vm, image, -1);
+        logger(vm, LOG_ERR, "Reloaded the code of %s\n", image);
     }
-    // exec proc
-    loadedUtilities[found].utilities.utilities[wFunc](os_get_vm_utilities(), &machine.regs);
+    free(code);
+    return ok;
+}
+
+// (w) reload_code(pImage, wEntry): swaps in the code of another image and
+// carries on @wEntry of it (0: after the IN); pushes 1, or 0 if the
+// image cannot be read
+static void os_reload_code(jakvm_t* vm)
+{
+    unsigned_t pImage = pop(vm);
+    unsigned_t entry = pop(vm);
+    char* image = os_deref_string(vm, pImage);
+    bool ok = reload_code(vm, image);
+    free(image);
+    push(vm, ok);
+    if(ok && entry) vm->machine.regs[IP] = entry - 1;
 }
 
 //============================================================
 // operations
 //============================================================
 
-static void add()
+static void add(jakvm_t* vm)
 {
-    signed_t b = pop();
-    signed_t a = pop();
-    push(a + b);
+    signed_t b = pop(vm);
+    signed_t a = pop(vm);
+    push(vm, a + b);
 }
 
-static void and()
+static void and(jakvm_t* vm)
 {
-    unsigned_t b = pop();
-    unsigned_t a = pop();
-    push(a & b);
+    unsigned_t b = pop(vm);
+    unsigned_t a = pop(vm);
+    push(vm, a & b);
 }
 
-static void compare()
+static void compare(jakvm_t* vm)
 {
-    signed_t b = pop();
-    signed_t a = pop();
+    signed_t b = pop(vm);
+    signed_t a = pop(vm);
 
-    push(b > a);
+    push(vm, b > a);
 }
 
-static void compare_unsigned()
+static void compare_unsigned(jakvm_t* vm)
 {
-    unsigned_t b = pop();
-    unsigned_t a = pop();
+    unsigned_t b = pop(vm);
+    unsigned_t a = pop(vm);
 
-    push(b > a);
+    push(vm, b > a);
 }
 
-static void compare_signed()
+static void compare_signed(jakvm_t* vm)
 {
-    signed_t b = pop();
-    signed_t a = pop();
+    signed_t b = pop(vm);
+    signed_t a = pop(vm);
+
+    push(vm, b > a);
+}
 
-    push(b > a);
+static void div_op(jakvm_t* vm)
+{
+    signed_t b = pop(vm);
+    signed_t a = pop(vm);
+    push(vm, (b) ? a / b : -32768);
 }
 
-static void div_op()
+// backward jumps, calls, returns to a lower address, resets and running
+// off the end of the code (IP wraps to 0) are the only ways to keep
+// running, so they are where the slice is counted down
+static inline void tick(jakvm_t* vm)
 {
-    signed_t b = pop();
-    signed_t a = pop();
-    push((b) ? a / b : -32768);
+    if(--vm->budget < 0) vm_pause(vm);
 }
 
-static void halt_this_thing()
+static void halt_this_thing(jakvm_t* vm)
 {
-    printf("\n");
-    exit(0);
+    if(vm->save_data) dispose_of_save_data(vm, &vm->save_data);
+    fprintf(vm->out, "\n");
+    vm_exit(vm, 0);
 }
 
-static void interrupt()
+static void interrupt(jakvm_t* vm)
 {
-    unsigned_t which = pop();
+    unsigned_t which = pop(vm);
+    if(vm->parent && !pfor_allowed(which)) error(vm, "utility not available in a parallel_for worker");
     switch(which) {
+    case 1:
+        os_assign_short_name(vm);
+        break;
+    case 2:
+        os_free_short_name(vm);
+        break;
     case 3:
-        os_logword();
+        os_logword(vm);
+        break;
+    case 4:
+        os_logstring_sn(vm);
         break;
     case 5:
-        os_logstring_p();
+        os_logstring_p(vm);
         break;
     case 6:
-        error("NOT IMPLEMENTED: read_word");
+        error(vm, "NOT IMPLEMENTED: read_word");
         break;
     case 7:
-        error("NOT IMPLEMENTED: read_string");
+        os_read_string(vm);
+        break;
+    case 8:
+        os_deref_short_name(vm);
         break;
     case 10:
-        os_read_save_word();
+        os_read_save_word(vm);
         break;
     case 11:
-        os_write_save_word();
+        os_write_save_word(vm);
         break;
     case 12:
-        os_get_save_data();
+        os_get_save_data(vm);
         break;
     case 13:
-        os_put_save_data();
+        os_put_save_data(vm);
+        break;
+    case 14:
+        os_heap_init(vm);
+        break;
+    case 15:
+        os_heap_alloc(vm);
+        break;
+    case 16:
+        os_heap_free(vm);
+        break;
+    case 17:
+        os_heap_stats(vm);
         break;
     case 20:
-        os_callextroutine();
+        os_callextroutine(vm);
+        break;
+    case 30:
+        os_timer_arm(vm);
+        break;
+    case 31:
+        os_timer_cancel(vm);
+        break;
+    case 32:
+        os_watch_stdin(vm);
+        break;
+    case 33:
+        os_wait_event(vm);
+        break;
+    case 34:
+        os_sleep(vm);
+        break;
+    case 35:
+        os_yield(vm);
+        break;
+    case 36:
+        os_reload_code(vm);
+        break;
+    case 40:
+        os_map_window(vm);
+        break;
+    case 41:
+        os_move_window(vm);
+        break;
+    case 42:
+        os_sync_window(vm);
+        break;
+    case 43:
+        os_unmap_window(vm);
+        break;
+    case 44:
+        os_window_file_size(vm);
+        break;
+    case 50:
+        os_slot_open(vm);
+        break;
+    case 51:
+        os_slot_pages(vm);
+        break;
+    case 52:
+        os_store_load(vm);
+        break;
+    case 53:
+        os_store_save(vm);
+        break;
+    case 54:
+        os_store_sync(vm);
+        break;
+    case 55:
+        os_txn_begin(vm);
+        break;
+    case 56:
+        os_txn_commit(vm);
+        break;
+    case 57:
+        os_txn_abort(vm);
+        break;
+    case 58:
+        os_set_durability(vm);
+        break;
+    case 59:
+        os_save_cas(vm);
+        break;
+    case 60:
+        os_parallel_for(vm);
+        break;
+    case 61:
+        os_chan_open(vm);
+        break;
+    case 62:
+        os_chan_send(vm);
+        break;
+    case 63:
+        os_chan_receive(vm);
+        break;
+    case 64:
+        os_chan_try_receive(vm);
+        break;
+    case 65:
+        os_chan_close(vm);
+        break;
+    case 70:
+        os_task_spawn(vm);
+        break;
+    case 71:
+        os_task_yield(vm);
+        break;
+    case 72:
+        os_task_join(vm);
+        break;
+    case 73:
+        os_task_self(vm);
         break;
     case 0:
-        logger(LOG_ERR, "Utility 0 is reserved and undefined\n");
+        logger(vm, LOG_ERR, "Utility 0 is reserved and undefined\n");
         /*FALLTHROUGH*/
     default:
-        error("Undefined utility called");
+        if(which >= JAKVM_HOST_UTILITIES && which < JAKVM_HOST_UTILITIES + JAKVM_MAX_HOST_UTILITIES) {
+            host_utility_t* u = &vm->utilities[which - JAKVM_HOST_UTILITIES];
+            if(u->fn) {
+                u->fn(vm, u->user);
+                break;
+            }
+        }
+        error(vm, "Undefined utility called");
     }
 }
 
-static void ior()
+static void ior(jakvm_t* vm)
+{
+    unsigned_t b = pop(vm);
+    unsigned_t a = pop(vm);
+    push(vm, a | b);
+}
+
+static void jump(jakvm_t* vm)
 {
-    unsigned_t b = pop();
-    unsigned_t a = pop();
-    push(a | b);
+    unsigned_t addr = pop(vm);
+    bool back = addr <= (unsigned_t)vm->machine.regs[IP];
+    vm->machine.regs[IP] = addr - 1;
+    if(back) tick(vm);
 }
 
-static void jump()
+static void jump_ifzero(jakvm_t* vm)
 {
-    unsigned_t addr = pop();
-    machine.regs[IP] = addr - 1;
+    unsigned_t addr = pop(vm);
+    signed_t cond = pop(vm);
+
+    if(!cond) {
+        bool back = addr <= (unsigned_t)vm->machine.regs[IP];
+        vm->machine.regs[IP] = addr - 1;
+        if(back) tick(vm);
+    }
 }
 
-static void jump_ifzero()
+static void load(jakvm_t* vm)
 {
-    unsigned_t addr = pop();
-    signed_t cond = pop();
+    unsigned_t addr = pop(vm);
+    push(vm, vm->mem->data[addr]);
+}
 
-    if(!cond) machine.regs[IP] = addr - 1;
+static void mod(jakvm_t* vm)
+{
+    signed_t b = pop(vm);
+    signed_t a = pop(vm);
+    push(vm, a % b);
 }
 
-static void load()
+static void mul(jakvm_t* vm)
 {
-    unsigned_t addr = pop();
-    push(machine.data[addr]);
+    push(vm, pop(vm) * pop(vm));
 }
 
-static void mod()
+static void neg(jakvm_t* vm)
 {
-    signed_t b = pop();
-    signed_t a = pop();
-    push(a % b);
+    unsigned_t a = pop(vm);
+    push(vm, ~a);
 }
 
-static void mul()
+static void not(jakvm_t* vm)
 {
-    push(pop() * pop());
+    push(vm, !pop(vm));
 }
 
-static void neg()
+static void pop_register(jakvm_t* vm, size_t reg)
 {
-    unsigned_t a = pop();
-    push(~a);
+    vm->machine.regs[reg] = pop(vm);
 }
 
-static void not()
+static void dup_op(jakvm_t* vm)
 {
-    push(!pop());
+    cassert(vm->machine.regs[SP] > 0);
+    signed_t val = vm->stack[vm->machine.regs[SP] - 1];
+    push(vm, val);
 }
 
-static void pop_register(size_t reg)
+static void push_immed(jakvm_t* vm)
 {
-    machine.regs[reg] = pop();
+    unsigned_t addr = vm->machine.regs[IP];
+    unsigned_t hi = vm->mem->code[addr + 1],
+               lo = vm->mem->code[addr + 2];
+    push(vm, (hi << 8) | lo);
+    vm->machine.regs[IP] += 2;
 }
 
-static void dup_op()
+static void register_swap(jakvm_t* vm)
 {
-    cassert(machine.regs[SP] > 0);
-    signed_t val = machine.stack_data[machine.regs[SP] - 1];
-    push(val);
+    unsigned_t tmp = vm->machine.regs[0];
+    vm->machine.regs[0] = vm->machine.regs[SP];
+    vm->machine.regs[SP] = tmp;
 }
 
-static void push_immed()
+static void swap(jakvm_t* vm)
 {
-    unsigned_t addr = machine.regs[IP];
-    unsigned_t hi = machine.code[addr + 1],
-               lo = machine.code[addr + 2];
-    push((hi << 8) | lo);
-    machine.regs[IP] += 2;
+    unsigned_t n = pop(vm);
+    unsigned_t tmp = vm->stack[vm->machine.regs[SP] - 1];
+    vm->stack[vm->machine.regs[SP] - 1] =
+        vm->stack[vm->machine.regs[SP] - 1 - n];
+    vm->stack[vm->machine.regs[SP] - 1 - n] = tmp;
 }
 
-static void register_swap()
+static int pagemap_fd;
+static pthread_once_t pagemap_once = PTHREAD_ONCE_INIT;
+
+static void open_pagemap()
 {
-    unsigned_t tmp = machine.regs[0];
-    machine.regs[0] = machine.regs[SP];
-    machine.regs[SP] = tmp;
+    pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
 }
 
-static void swap()
+// puts back what the run wrote over since the snapshot was mapped: the
+// pages that are no longer the snapshot's (copied on write, or swapped
+// out since) are dropped, so they are the snapshot's shared pages again
+// and the next reset only sees what the next run wrote; the rest is left
+// be; false if that cannot be told, and only loading it all again will do
+static bool restore_dirty_pages(jakvm_t* vm)
 {
-    unsigned_t n = pop();
-    unsigned_t tmp = machine.stack_data[machine.regs[SP] - 1];
-    machine.stack_data[machine.regs[SP] - 1] =
-        machine.stack_data[machine.regs[SP] - 1 - n];
-    machine.stack_data[machine.regs[SP] - 1 - n] = tmp;
+    if(vm->snapshot == -1 || vm->mapped != vm->snapshot) return false;
+    pthread_once(&pagemap_once, &open_pagemap);
+    size_t page = sysconf(_SC_PAGESIZE), n = sizeof(machine_t) / page, i = 0;
+    uint64_t entries[sizeof(machine_t) / 4096];
+    ssize_t want = n * sizeof(uint64_t);
+    if(pagemap_fd == -1 || pread(pagemap_fd, entries, want, (uintptr_t)&vm->machine / page * sizeof(uint64_t)) != want) return false;
+
+    // the registers stay, as with a snapshot loaded
+    signed_t regs[RLAST];
+    memcpy(regs, vm->machine.regs, sizeof(regs));
+    char* base = (char*)&vm->machine;
+    while(i < n) {
+        // a run of pages of the VM's own at a time
+        size_t first = i;
+        for(; i < n; ++i) {
+            bool present = entries[i] >> 63 & 1, swapped = entries[i] >> 62 & 1, file = entries[i] >> 61 & 1;
+            if(!((present && !file) || swapped)) break;
+        }
+        if(i > first) {
+            cassert(madvise(base + first * page, (i - first) * page, MADV_DONTNEED) == 0);
+            vm->resetPages += i - first;
+        } else {
+            ++i;
+        }
+    }
+    memcpy(vm->machine.regs, regs, sizeof(regs));
+    return true;
 }
 
-static void reset()
+// RS: the image as loaded, registers aside, from the top; when it runs
+// from a snapshot, only the pages the run wrote to are put back
+static void reset(jakvm_t* vm)
 {
-    reset_machine_state();
-    load_image();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(vm->save_data) dispose_of_save_data(vm, &vm->save_data);
+    tasks_reset(vm);
+    reset_machine_state(vm);
+    windows_reset(vm);
+    if(!restore_dirty_pages(vm)) load_image(vm);
+    heap_reset(vm);
+    events_reset(vm);
+    // the instruction at 0 is next
+    vm->machine.regs[IP] = -1;
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ++vm->resets;
+    vm->resetNs += (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    // a run starting over keeps running too
+    tick(vm);
 }
 
-static void register_dec(size_t reg)
+static void register_dec(jakvm_t* vm, size_t reg)
 {
-    machine.regs[reg]--;
+    vm->machine.regs[reg]--;
 }
 
-static void register_inc(size_t reg)
+static void register_inc(jakvm_t* vm, size_t reg)
 {
-    machine.regs[reg]++;
+    vm->machine.regs[reg]++;
 }
 
-static void register_mask(size_t reg)
+static void register_mask(jakvm_t* vm, size_t reg)
 {
-    unsigned_t mask = pop();
-    unsigned_t val = machine.regs[reg];
-    push(mask & val);
+    unsigned_t mask = pop(vm);
+    unsigned_t val = vm->machine.regs[reg];
+    push(vm, mask & val);
 }
 
-static void register_push(size_t reg)
+static void register_push(jakvm_t* vm, size_t reg)
 {
-    push(machine.regs[reg]);
+    push(vm, vm->machine.regs[reg]);
 }
 
-static void register_rol(size_t reg)
+static void register_rol(jakvm_t* vm, size_t reg)
 {
-    signed_t x = pop();
+    signed_t x = pop(vm);
     bool left = x > 0;
     unsigned_t amount = x & 0x1F;
-    unsigned_t v = machine.regs[reg];
+    unsigned_t v = vm->machine.regs[reg];
     unsigned_t mask = 0xFFFF;
     if(left) {
         mask <<= amount;
         mask >>= amount;
         mask = ~mask;
-        machine.regs[reg] = ((mask & v) >> amount) | v << amount;
+        vm->machine.regs[reg] = ((mask & v) >> amount) | v << amount;
     } else {
         mask >>= amount;
         mask <<= amount;
         mask = ~mask;
-        machine.regs[reg] = ((mask & v) << amount) | v >> amount;
+        vm->machine.regs[reg] = ((mask & v) << amount) | v >> amount;
     }
 }
 
-static void register_sh(size_t reg)
+static void register_sh(jakvm_t* vm, size_t reg)
 {
-    signed_t x = pop();
+    signed_t x = pop(vm);
     bool left = x > 0;
     unsigned_t amount = x & 0x1F;
     if(left) {
-        machine.regs[reg] <<= amount;
+        vm->machine.regs[reg] <<= amount;
     } else {
-        machine.regs[reg] >>= amount;
+        vm->machine.regs[reg] >>= amount;
     }
 }
 
-static void return_op()
+static void return_op(jakvm_t* vm)
 {
-    unsigned_t addr = machine.regs[RA];
-    machine.regs[IP] = addr;
+    unsigned_t addr = vm->machine.regs[RA];
+    if(addr == TASK_RETURN && vm->tasks.current) {
+        task_end(vm);
+        return;
+    }
+    bool back = addr <= (unsigned_t)vm->machine.regs[IP];
+    vm->machine.regs[IP] = addr;
+    if(back) tick(vm);
 }
 
-static void call_op()
+static void call_op(jakvm_t* vm)
 {
-    unsigned_t addr = pop();
-    machine.regs[RA] = machine.regs[IP];
-    machine.regs[IP] = addr - 1;
+    unsigned_t addr = pop(vm);
+    vm->machine.regs[RA] = vm->machine.regs[IP];
+    vm->machine.regs[IP] = addr - 1;
+    tick(vm);
 }
 
-static void store()
+static void store(jakvm_t* vm)
 {
-    signed_t val = pop();
-    unsigned_t addr = pop();
-    machine.data[addr] = val;
+    signed_t val = pop(vm);
+    unsigned_t addr = pop(vm);
+    vm->mem->data[addr] = val;
 }
 
-static void sub()
+static void sub(jakvm_t* vm)
 {
-    signed_t b = pop();
-    signed_t a = pop();
-    push(a - b);
+    signed_t b = pop(vm);
+    signed_t a = pop(vm);
+    push(vm, a - b);
 }
 
-static void xor()
+static void xor(jakvm_t* vm)
 {
-    unsigned_t b = pop();
-    unsigned_t a = pop();
-    push(a ^ b);
+    unsigned_t b = pop(vm);
+    unsigned_t a = pop(vm);
+    push(vm, a ^ b);
 }
 
 //============================================================
 // decoder
 //============================================================
 
-static void further_decode()
+static void further_decode(jakvm_t* vm)
 {
-    unsigned_t addr = machine.regs[IP];
-    code_t opcode = machine.code[addr];
+    unsigned_t addr = vm->machine.regs[IP];
+    code_t opcode = vm->mem->code[addr];
     switch(opcode) {
         default:
         case 0x00:
             break;
         case 0x01:
-            interrupt();
+            interrupt(vm);
             break;
         case 0x02:
-            reset();
+            reset(vm);
             break;
         case 0x03:
-            dup_op();
+            dup_op(vm);
             break;
         case 0x04:
-            halt_this_thing();
+            halt_this_thing(vm);
             break;
         case 0x05:
-            push_immed();
+            push_immed(vm);
             break;
         case 0x06:
-            call_op();
+            call_op(vm);
             break;
         case 0x07:
-            return_op();
+            return_op(vm);
             break;
         case 0x08:
-            load();
+            load(vm);
             break;
         case 0x09:
-            store();
+            store(vm);
             break;
         case 0x0A:
-            add();
+            add(vm);
             break;
         case 0x0B:
-            sub();
+            sub(vm);
             break;
         case 0x0C:
-            mul();
+            mul(vm);
             break;
         case 0x0D:
-            mod();
+            mod(vm);
             break;
         case 0x0E:
-            div_op();
+            div_op(vm);
             break;
         case 0x0F:
-            register_swap();
+            register_swap(vm);
             break;
         case 0x10:
-            and();
+            and(vm);
             break;
         case 0x11:
-            ior();
+            ior(vm);
             break;
         case 0x12:
-            xor();
+            xor(vm);
             break;
         case 0x13:
-            not();
+            not(vm);
             break;
         case 0x14:
-            swap();
+            swap(vm);
             break;
         case 0x17:
-            neg();
+            neg(vm);
             break;
         case 0x18:
-            compare_signed();
+            compare_signed(vm);
             break;
         case 0x19:
-            compare_unsigned();
+            compare_unsigned(vm);
             break;
         case 0x1E:
-            jump();
+            jump(vm);
             break;
         case 0x1F:
-            jump_ifzero();
+            jump_ifzero(vm);
             break;
     }
 }
 
-static void decode()
+static void decode(jakvm_t* vm)
 {
-    unsigned_t addr = machine.regs[IP];
-    unsigned_t opcode = machine.code[addr];
+    unsigned_t addr = vm->machine.regs[IP];
+    unsigned_t opcode = vm->mem->code[addr];
     switch((opcode >> 5) & 0x7) {
         default:
         case 0x0:
-            further_decode();
+            further_decode(vm);
             break;
         case 0x1:
-            register_mask(opcode & 0x1F);
+            register_mask(vm, opcode & 0x1F);
             break;
         case 0x2:
-            register_sh(opcode & 0x1F);
+            register_sh(vm, opcode & 0x1F);
             break;
         case 0x3:
-            register_rol(opcode & 0x1F);
+            register_rol(vm, opcode & 0x1F);
             break;
         case 0x4:
-            register_push(opcode & 0x1F);
+            register_push(vm, opcode & 0x1F);
             break;
         case 0x5:
-            pop_register(opcode & 0x1F);
+            pop_register(vm, opcode & 0x1F);
             break;
         case 0x6:
-            register_inc(opcode & 0x1F);
+            register_inc(vm, opcode & 0x1F);
             break;
         case 0x7:
-            register_dec(opcode & 0x1F);
+            register_dec(vm, opcode & 0x1F);
             break;
     }
 }
 
 //============================================================
-// main
+// embedding API (see jakvmhs.h)
 //============================================================
 
-static void exec()
+//-------------------------------------------------------------
+// checkpoints
+//-------------------------------------------------------------
+
+// A checkpoint file holds two slots, and every checkpoint goes to the one
+// with the older of the two in it, so a crash while writing one leaves the
+// other. A slot is the machine (laid out as in memory, so a restore maps
+// it copy on write like a snapshot) followed by a header and the rest of
+// the VM's state. The header goes last, once the rest is on disk, and its
+// checksums tell a complete slot from a torn one.
+//
+// Each slot is only written where it differs from what it held: the VM
+// keeps a copy of both slots' machines and compares page by page. In the
+// background, the VM only stops to copy the changed pages; a thread of its
+// own writes them out and syncs.
+
+#define CKPT_MAGIC 0x504B434A       // "JCKP"
+#define CKPT_VERSION 1
+#define CKPT_META_BYTES (16 << 20)  // room for the rest of the state
+#define CKPT_SLOT_BYTES (sizeof(machine_t) + CKPT_META_BYTES)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;        // the highest complete one is restored
+    uint32_t machineSum;        // fnv1a of the machine
+    uint32_t metaSum;           // ...and of the bytes after this header
+    uint32_t metaBytes;
+    int32_t loggerState;
+    int32_t flags;
+    heap_t heap;
+    // then: image\0 save\0 (empty for the image's), the number of
+    // libraries (32 bit) and their names\0, then the short names
+} ckpt_header_t;
+
+struct checkpoint {
+    char* path;
+    int fd;
+    machine_t* slots;           // what each slot holds, as far as valid
+    bool valid[2];
+    uint64_t generation;        // of the newest checkpoint taken
+    // the write in flight, if any
+    int slot;
+    size_t* dirty;              // pages of the slot to write
+    size_t numDirty;
+    buffer_t meta;              // header and the rest of the state
+    bool busy, failed, stop;
+    bool threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static bool ckpt_pwrite(int fd, void const* p, size_t n, off_t at)
+{
+    while(n) {
+        ssize_t written = pwrite(fd, p, n, at);
+        if(written == -1 && errno == EINTR) continue;
+        if(written <= 0) return false;
+        p = (char const*)p + written;
+        n -= written;
+        at += written;
+    }
+    return true;
+}
+
+// writes what ckpt_take staged; the slot's header last, after a sync
+static bool ckpt_write(checkpoint_t* c)
+{
+    off_t base = (off_t)c->slot * CKPT_SLOT_BYTES;
+    char const* slot = (char const*)&c->slots[c->slot];
+    size_t page = sysconf(_SC_PAGESIZE), i = 0;
+    for(; i < c->numDirty; ++i) {
+        off_t at = (off_t)c->dirty[i] * page;
+        if(!ckpt_pwrite(c->fd, slot + at, page, base + at)) return false;
+    }
+    ckpt_header_t* h = (ckpt_header_t*)c->meta.p;
+    h->machineSum = fnv1a((unsigned char const*)slot, sizeof(machine_t));
+    base += sizeof(machine_t);
+    return ckpt_pwrite(c->fd, c->meta.p + sizeof(ckpt_header_t), h->metaBytes, base + sizeof(ckpt_header_t))
+        && fdatasync(c->fd) == 0
+        && ckpt_pwrite(c->fd, h, sizeof(ckpt_header_t), base)
+        && fdatasync(c->fd) == 0;
+}
+
+static void ckpt_written(checkpoint_t* c, bool ok)
+{
+    pthread_mutex_lock(&c->lock);
+    c->valid[c->slot] = ok;
+    if(!ok) c->failed = true;
+    c->busy = false;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void* ckpt_writer(void* p)
+{
+    checkpoint_t* c = (checkpoint_t*)p;
+    pthread_mutex_lock(&c->lock);
+    while(1) {
+        while(!c->busy && !c->stop) pthread_cond_wait(&c->cond, &c->lock);
+        if(!c->busy) break;
+        pthread_mutex_unlock(&c->lock);
+        bool ok = ckpt_write(c);
+        ckpt_written(c, ok);
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// whether the last checkpoint made it to disk, once it did
+static bool ckpt_wait(checkpoint_t* c)
+{
+    pthread_mutex_lock(&c->lock);
+    while(c->busy) pthread_cond_wait(&c->cond, &c->lock);
+    bool ok = !c->failed;
+    c->failed = false;
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+static void ckpt_close(jakvm_t* vm)
+{
+    checkpoint_t* c = vm->checkpoint;
+    if(!c) return;
+    ckpt_wait(c);
+    if(c->threaded) {
+        pthread_mutex_lock(&c->lock);
+        c->stop = true;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->thread, NULL);
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    close(c->fd);
+    munmap(c->slots, 2 * sizeof(machine_t));
+    free(c->dirty);
+    free(c->meta.p);
+    free(c->path);
+    free(c);
+    vm->checkpoint = NULL;
+}
+
+// the VM's checkpoint file, opened (or created) if it is not path yet
+static checkpoint_t* ckpt_open(jakvm_t* vm, char const* path)
+{
+    if(vm->checkpoint && strcmp(vm->checkpoint->path, path) == 0) return vm->checkpoint;
+    ckpt_close(vm);
+    int fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if(fd == -1) return NULL;
+    void* slots = mmap(NULL, 2 * sizeof(machine_t), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(slots == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    checkpoint_t* c = (checkpoint_t*)calloc(1, sizeof(checkpoint_t));
+    c->path = strdup(path);
+    c->fd = fd;
+    c->slots = (machine_t*)slots;
+    c->dirty = (size_t*)malloc(sizeof(machine_t) / sysconf(_SC_PAGESIZE) * sizeof(size_t));
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    return vm->checkpoint = c;
+}
+
+// what a checkpoint cannot hold: host resources the run has open
+static char const* ckpt_unsupported(jakvm_t* vm)
+{
+    size_t i = 0;
+    if(vm->tasks.current) return "tasks are running";
+    for(i = 1; i < vm->tasks.count; ++i) {
+        if(vm->tasks.all[i].state != TASK_FREE) return "tasks are running";
+    }
+    for(i = 0; i < MAX_WINDOWS; ++i) {
+        if(vm->windows[i].words) return "windows are mapped";
+    }
+    for(i = 0; i < MAX_TIMERS; ++i) {
+        if(vm->events.timers[i]) return "timers are set";
+    }
+    if(vm->events.stdin) return "stdin is watched";
+    // neither the store lock nor a channel's messages are in the file
+    if(vm->wal.open) return "transaction open";
+    if(vm->channels) return "channels are open";
+    return NULL;
+}
+
+static void ckpt_put_string(buffer_t* b, char const* s)
+{
+    buffer_append(b, s, strlen(s) + 1);
+}
+
+// stages a checkpoint of the VM as it is now: the pages that changed
+// since the slot was last written, and the rest of the state
+static char const* ckpt_take(jakvm_t* vm, checkpoint_t* c)
+{
+    char const* unsupported = ckpt_unsupported(vm);
+    if(unsupported) return unsupported;
+    if(!ckpt_wait(c)) return "the previous checkpoint failed";
+
+    c->slot = (c->generation + 1) & 1;
+    char* slot = (char*)&c->slots[c->slot];
+    char const* now = (char const*)&vm->machine;
+    size_t page = sysconf(_SC_PAGESIZE), i = 0;
+    c->numDirty = 0;
+    for(; i < sizeof(machine_t); i += page) {
+        if(c->valid[c->slot] && memcmp(slot + i, now + i, page) == 0) continue;
+        memcpy(slot + i, now + i, page);
+        c->dirty[c->numDirty++] = i / page;
+    }
+    // until it is written, the slot is neither what it was nor this
+    c->valid[c->slot] = false;
+
+    ckpt_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = CKPT_MAGIC;
+    h.version = CKPT_VERSION;
+    h.generation = c->generation + 1;
+    h.loggerState = vm->logger_state;
+    h.flags = vm->flags;
+    h.heap = vm->heap;
+    c->meta.len = 0;
+    buffer_append(&c->meta, &h, sizeof(h));
+    ckpt_put_string(&c->meta, vm->image);
+    ckpt_put_string(&c->meta, (vm->save) ? vm->save : "");
+    uint32_t numLibs = vm->numLibs;
+    buffer_append(&c->meta, &numLibs, sizeof(numLibs));
+    for(i = 0; i < vm->numLibs; ++i) ckpt_put_string(&c->meta, vm->libs[i].name);
+    size_t names = SN_save(vm->names, NULL, 0);
+    if(c->meta.len + names > CKPT_META_BYTES) return "too many short names";
+    if(c->meta.len + names > c->meta.cap) {
+        c->meta.cap = c->meta.len + names;
+        c->meta.p = (unsigned char*)realloc(c->meta.p, c->meta.cap);
+    }
+    SN_save(vm->names, c->meta.p + c->meta.len, names);
+    c->meta.len += names;
+
+    ckpt_header_t* staged = (ckpt_header_t*)c->meta.p;
+    staged->metaBytes = c->meta.len - sizeof(ckpt_header_t);
+    staged->metaSum = fnv1a(c->meta.p + sizeof(ckpt_header_t), staged->metaBytes);
+    ++c->generation;
+    return NULL;
+}
+
+static char const* ckpt_get_string(unsigned char const** p, unsigned char const* end)
+{
+    unsigned char const* nul = (unsigned char const*)memchr(*p, '\0', end - *p);
+    if(!nul) return NULL;
+    char const* s = (char const*)*p;
+    *p = nul + 1;
+    return s;
+}
+
+// maps the newest complete slot of c's file over the VM and brings back
+// the rest of its state; false if there is none
+static bool ckpt_restore(jakvm_t* vm, checkpoint_t* c)
+{
+    ckpt_header_t h[2];
+    int order[2] = { 0, 1 }, i = 0;
+    for(; i < 2; ++i) {
+        off_t at = (off_t)i * CKPT_SLOT_BYTES + sizeof(machine_t);
+        if(pread(c->fd, &h[i], sizeof(ckpt_header_t), at) != sizeof(ckpt_header_t)
+                || h[i].magic != CKPT_MAGIC || h[i].version != CKPT_VERSION
+                || h[i].metaBytes > CKPT_META_BYTES - sizeof(ckpt_header_t)) {
+            h[i].generation = 0;
+        }
+    }
+    if(h[1].generation > h[0].generation) {
+        order[0] = 1;
+        order[1] = 0;
+    }
+    for(i = 0; i < 2; ++i) {
+        int slot = order[i];
+        if(!h[slot].generation) continue;
+        off_t base = (off_t)slot * CKPT_SLOT_BYTES;
+        unsigned char* meta = (unsigned char*)malloc(h[slot].metaBytes + 1);
+        bool ok = pread(c->fd, meta, h[slot].metaBytes, base + sizeof(machine_t) + sizeof(ckpt_header_t)) == h[slot].metaBytes
+            && fnv1a(meta, h[slot].metaBytes) == h[slot].metaSum;
+        if(ok) {
+            void* p = mmap(&vm->machine, sizeof(machine_t), PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE, c->fd, base);
+            cassert(p == (void*)&vm->machine);
+            vm->mapped = -1;
+            ok = fnv1a((unsigned char const*)&vm->machine, sizeof(machine_t)) == h[slot].machineSum;
+        }
+
+        unsigned char const* q = meta;
+        unsigned char const* end = meta + h[slot].metaBytes;
+        char const* image = (ok) ? ckpt_get_string(&q, end) : NULL;
+        char const* save = (image) ? ckpt_get_string(&q, end) : NULL;
+        uint32_t numLibs = 0;
+        ok = save && (size_t)(end - q) >= sizeof(numLibs);
+        if(ok) {
+            memcpy(&numLibs, q, sizeof(numLibs));
+            q += sizeof(numLibs);
+        }
+        char const* libs[MAX_EXT_LIBS];
+        uint32_t l = 0;
+        for(; ok && l < numLibs; ++l) ok = l < MAX_EXT_LIBS && (libs[l] = ckpt_get_string(&q, end)) != NULL;
+        ok = ok && SN_load(vm->names, q, end - q) == 0;
+        if(!ok) {
+            free(meta);
+            continue;
+        }
+
+        // the code is never written, so it stays shared with the file
+        cassert(mprotect(vm->machine.code, sizeof(vm->machine.code), PROT_READ) == 0);
+        free(vm->image);
+        vm->image = strdup(image);
+        vm->imageData = NULL;
+        vm->imageLength = 0;
+        free(vm->save);
+        vm->save = (*save) ? strdup(save) : NULL;
+        vm->logger_state = (logger_state_t)h[slot].loggerState;
+        vm->flags = h[slot].flags;
+        vm->heap = h[slot].heap;
+        // the libraries come back, what they kept does not
+        for(l = 0; l < numLibs; ++l) {
+            if(find_library(vm, libs[l])) continue;
+            ext_lib_t* lib;
+            char* name = strdup(libs[l]);
+            char const* failed = open_library(vm, name, &lib);
+            if(failed) error(vm, failed);
+        }
+        free(meta);
+
+        // the next checkpoint only writes what changes from here
+        memcpy(&c->slots[slot], &vm->machine, sizeof(machine_t));
+        c->valid[slot] = true;
+        c->valid[!slot] = false;
+        c->generation = h[slot].generation;
+        return true;
+    }
+    return false;
+}
+
+static void exec(jakvm_t* vm)
 {
     while(1) {
-        decode();
-        machine.regs[IP]++;
+        decode(vm);
+        if(vm->machine.regs[IP] == -1) tick(vm);
+        vm->machine.regs[IP]++;
+    }
+}
+
+// a VM maps things over its own memory (windows, snapshots), so it gets
+// a mapping of its own instead of a piece of the malloc heap
+static size_t jakvm_bytes()
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(jakvm_t) + page - 1) / page * page;
+}
+
+jakvm_t* jakvm_new(char const* image)
+{
+    size_t align = __alignof__(jakvm_t), bytes = jakvm_bytes();
+    char* p = (char*)mmap(NULL, bytes + align, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) return NULL;
+    char* at = (char*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if(at > p) munmap(p, at - p);
+    munmap(at + bytes, p + align - at);
+    jakvm_t* vm = (jakvm_t*)at;
+    vm->image = strdup(image);
+    vm->mem = &vm->machine;
+    vm->stack = vm->machine.stack_data;
+    vm->budget = LONG_MAX;
+    vm->snapshot = -1;
+    vm->mapped = -1;
+    vm->save_fd = -1;
+    vm->wal.fd = -1;
+    vm->flags = ~0;
+    vm->names = SN_new();
+    vm->in = stdin;
+    vm->out = stdout;
+    vm->err = stderr;
+    return vm;
+}
+
+jakvm_t* jakvm_new_from_memory(char const* name, void const* image, size_t length)
+{
+    jakvm_t* vm = jakvm_new(name);
+    if(vm) {
+        vm->imageData = image;
+        vm->imageLength = length;
+    }
+    return vm;
+}
+
+void jakvm_set_image(jakvm_t* vm, char const* image, int snapshot)
+{
+    // a descriptor may stand for another snapshot by now
+    vm->mapped = -1;
+    free(vm->image);
+    vm->image = strdup(image);
+    vm->imageData = NULL;
+    vm->imageLength = 0;
+    vm->snapshot = snapshot;
+}
+
+void jakvm_set_io(jakvm_t* vm, FILE* in, FILE* out, FILE* err)
+{
+    vm->in = in;
+    vm->out = out;
+    vm->err = err;
+}
+
+void jakvm_set_save(jakvm_t* vm, char const* name)
+{
+    free(vm->save);
+    vm->save = (name) ? strdup(name) : NULL;
+}
+
+int jakvm_bind_library(jakvm_t* vm, char const* name)
+{
+    if(find_library(vm, name)) return 0;
+    char* libname = strdup(name);
+    ext_lib_t* lib;
+    char const* failed = open_library(vm, libname, &lib);
+    if(!failed) return 0;
+    fprintf(vm->err, "%s: %s\n", name, failed);
+    free(libname);
+    return -1;
+}
+
+// gets the VM ready to run its image from the top; returns 0, or the exit
+// status if it cannot
+int jakvm_load(jakvm_t* vm)
+{
+    vm->status = 0;
+    if(setjmp(vm->halt)) return vm->status;
+    memset(vm->machine.regs, 0, sizeof(vm->machine.regs));
+    SN_reset(vm->names);
+    vm->logger_state = LS_FIRST;
+    reset_machine_state(vm);
+    load_image(vm);
+    return 0;
+}
+
+// runs the loaded image for a slice of about budget backward jumps and
+// calls (no limit if 0); JAKVM_PAUSED when the slice ran out or the image
+// yielded, and another slice carries on where it stopped; otherwise the
+// run is over and this is its exit status
+int jakvm_slice(jakvm_t* vm, long budget)
+{
+    vm->budget = (budget > 0) ? budget : LONG_MAX;
+    vm->sliced = budget > 0;
+    if(setjmp(vm->halt) == 0) exec(vm);
+    if(vm->status == JAKVM_PAUSED) return JAKVM_PAUSED;
+    return jakvm_end(vm);
+}
+
+int jakvm_step(jakvm_t* vm)
+{
+    vm->status = JAKVM_PAUSED;
+    if(setjmp(vm->halt) == 0) {
+        decode(vm);
+        vm->machine.regs[IP]++;
     }
+    if(vm->status == JAKVM_PAUSED) return JAKVM_PAUSED;
+    return jakvm_end(vm);
 }
 
-int main(int argc, char* argv[])
+// runs the image from the top until it halts or fails; returns the exit
+// status; a VM can run any number of times, each run starts afresh
+int jakvm_run(jakvm_t* vm)
 {
-    if(argc < 2 || strcmp(argv[1], "-h") == 0) usage(argv[0]);
-    cassert(argc == 2);
-    memset(&machine.regs[0], 0, sizeof(signed_t) * RLAST);
-    g_image = argv[1];
+    if(jakvm_load(vm)) return jakvm_end(vm);
+    int status;
+    // nothing else to run when it yields
+    while((status = jakvm_slice(vm, 0)) == JAKVM_PAUSED)
+        ;
+    return status;
+}
+
+// cleans up after a run that ended (or is given up on); returns its exit
+// status
+int jakvm_end(jakvm_t* vm)
+{
+    // a failure while cleaning up leaves the rest of it be
+    int status = vm->status;
+    if(setjmp(vm->halt) == 0) {
+        if(vm->save_data) dispose_of_save_data(vm, &vm->save_data);
+        windows_reset(vm);
+        events_reset(vm);
+        heap_reset(vm);
+        tasks_reset(vm);
+        channels_release(vm);
+    }
+    if(vm->resets) {
+        logger(vm, LOG_ERR, "%lu resets, %.1f us each, %.1f pages restored each\n", vm->resets,
+                vm->resetNs / 1000.0 / vm->resets, (double)vm->resetPages / vm->resets);
+    }
+    vm->resets = vm->resetNs = vm->resetPages = 0;
+    // libraries stay loaded, what they kept for this run goes
+    size_t i = 0;
+    for(; i < vm->numLibs; ++i) {
+        ext_lib_t* lib = &vm->libs[i];
+        if(lib->release && lib->state) lib->release(lib->state);
+        lib->state = NULL;
+    }
+    fflush(vm->out);
+    fflush(vm->err);
+    return status;
+}
+
+void jakvm_free(jakvm_t* vm)
+{
+    if(vm->status == JAKVM_PAUSED) jakvm_end(vm);
+    size_t i = 0;
+    for(; i < vm->numLibs; ++i) {
+        ext_lib_t* lib = &vm->libs[i];
+        dlclose(lib->dll);
+        free(lib->name);
+    }
+    ckpt_close(vm);
+    SN_delete(vm->names);
+    free(vm->image);
+    free(vm->save);
+    munmap(vm, jakvm_bytes());
+}
+
+// bytes of memory the VM has to itself: the pages of its mapping it wrote
+// to; the ones it only read are the snapshot's, shared by all VMs
+// started from it
+size_t jakvm_rss(jakvm_t* vm)
+{
+    size_t page = sysconf(_SC_PAGESIZE), n = jakvm_bytes() / page, rss = 0;
+    uint64_t* entries = (uint64_t*)malloc(n * sizeof(uint64_t));
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    ssize_t want = n * sizeof(uint64_t);
+    if(fd != -1 && pread(fd, entries, want, (uintptr_t)vm / page * sizeof(uint64_t)) == want) {
+        size_t i = 0;
+        for(; i < n; ++i) {
+            // present, and anonymous: a private copy
+            if((entries[i] >> 63 & 1) && !(entries[i] >> 61 & 1)) rss += page;
+        }
+    }
+    if(fd != -1) close(fd);
+    free(entries);
+    return rss;
+}
+
+// the machine of vm as it is now, as a file other VMs can start from
+// (set their snapshot to it); -1 on failure; close it when done
+int jakvm_snapshot(jakvm_t* vm)
+{
+    int fd = memfd_create("jakvm-snapshot", MFD_CLOEXEC);
+    if(fd == -1) return -1;
+    if(write(fd, &vm->machine, sizeof(machine_t)) != sizeof(machine_t)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// a snapshot of image as loaded, before the first instruction; -1 if it
+// cannot be loaded, running it says why
+int jakvm_snapshot_image(char const* image)
+{
+    jakvm_t* vm = jakvm_new(image);
+    FILE* null = fopen("/dev/null", "w");
+    volatile int fd = -1;
+    if(vm && null) {
+        vm->out = vm->err = null;
+        if(setjmp(vm->halt) == 0) {
+            reset_machine_state(vm);
+            load_image(vm);
+            fd = jakvm_snapshot(vm);
+        }
+    }
+    if(null) fclose(null);
+    if(vm) jakvm_free(vm);
+    return fd;
+}
+
+int jakvm_checkpoint(jakvm_t* vm, char const* path, int background)
+{
+    checkpoint_t* c = ckpt_open(vm, path);
+    char const* failed = (c) ? ckpt_take(vm, c) : strerror(errno);
+    if(failed) {
+        fprintf(vm->err, "cannot checkpoint to %s: %s\n", path, failed);
+        return -1;
+    }
+    if(background && !c->threaded) c->threaded = pthread_create(&c->thread, NULL, &ckpt_writer, c) == 0;
+    pthread_mutex_lock(&c->lock);
+    c->busy = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    // without a thread, it is written here and now
+    if(!c->threaded) ckpt_written(c, ckpt_write(c));
+    return (background || ckpt_wait(c)) ? 0 : -1;
+}
+
+int jakvm_checkpoint_wait(jakvm_t* vm)
+{
+    return (!vm->checkpoint || ckpt_wait(vm->checkpoint)) ? 0 : -1;
+}
+
+int jakvm_restore(jakvm_t* vm, char const* path)
+{
+    vm->status = 0;
+    if(setjmp(vm->halt)) return vm->status;
+    if(vm->save_data) dispose_of_save_data(vm, &vm->save_data);
+    tasks_reset(vm);
+    windows_reset(vm);
+    events_reset(vm);
+    checkpoint_t* c = ckpt_open(vm, path);
+    cassert(c);
+    ckpt_wait(c);
+    if(!ckpt_restore(vm, c)) {
+        fprintf(vm->err, "%s: no checkpoint to restore\n", path);
+        vm_exit(vm, 255);
+    }
+    logger(vm, 0, "Restored %s from %s\n", vm->image, path);
+    return 0;
+}
+
+int jakvm_reload(jakvm_t* vm, char const* image, int entry)
+{
+    if(setjmp(vm->halt)) return jakvm_end(vm);
+    if(!reload_code(vm, image)) {
+        fprintf(vm->err, "cannot reload %s\n", image);
+        return JAKVM_NO_IMAGE;
+    }
+    if(entry == -1) return JAKVM_PAUSED;
+    signed_t next = 0;
+    int status = jakvm_call(vm, entry, 0, NULL, &next);
+    if(status == JAKVM_PAUSED && next) vm->machine.regs[IP] = next;
+    return status;
+}
+
+// what a sub called by the host returns to; no image has code up there
+#define HOST_CALL_SITE 0xFFFE
+
+int jakvm_call(jakvm_t* vm, unsigned_t address, int nargs, signed_t const* args, signed_t* result)
+{
+    signed_t ip = vm->machine.regs[IP], sp = vm->machine.regs[SP];
+    vm->status = JAKVM_PAUSED;
+    if(setjmp(vm->halt)) return jakvm_end(vm);
+    int i = nargs;
+    while(i--) push(vm, args[i]);
+    vm->machine.regs[IP] = HOST_CALL_SITE;
+    os_exec_vm_code(vm, address);
+    signed_t top = (vm->machine.regs[SP] > sp) ? pop(vm) : 0;
+    if(result) *result = top;
+    vm->machine.regs[SP] = sp;
+    vm->machine.regs[IP] = ip;
+    return JAKVM_PAUSED;
+}
+
+signed_t jakvm_reg(jakvm_t* vm, unsigned reg)
+{
+    return (reg < RLAST) ? vm->machine.regs[reg] : 0;
+}
 
-    g_logger_state = LS_FIRST;
+void jakvm_set_reg(jakvm_t* vm, unsigned reg, signed_t value)
+{
+    if(reg < RLAST) vm->machine.regs[reg] = value;
+}
 
-    reset_machine_state();
-    load_image();
+unsigned_t* jakvm_memory(jakvm_t* vm)
+{
+    return (unsigned_t*)vm->mem->data;
+}
 
-    exec();
+int jakvm_register_utility(jakvm_t* vm, unsigned_t which, jakvm_utility_fn fn, void* user)
+{
+    if(which < JAKVM_HOST_UTILITIES || which >= JAKVM_HOST_UTILITIES + JAKVM_MAX_HOST_UTILITIES) return -1;
+    vm->utilities[which - JAKVM_HOST_UTILITIES].fn = fn;
+    vm->utilities[which - JAKVM_HOST_UTILITIES].user = user;
     return 0;
 }
+
+signed_t jakvm_pop(jakvm_t* vm)
+{
+    return pop(vm);
+}
+
+void jakvm_push(jakvm_t* vm, signed_t x)
+{
+    push(vm, x);
+}
+
+void jakvm_error(jakvm_t* vm, char const* msg)
+{
+    error(vm, msg);
+}
@@ -2,22 +2,39 @@
 #define JAKVMHS_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 typedef int16_t signed_t;
 typedef uint16_t unsigned_t;
 typedef uint8_t code_t;
 
+/* the VM a utility is running in; see vm_utilities_t */
+typedef struct jakvm jakvm_t;
+
 typedef struct {
+    /* the VM making the call; pass it back to every function below */
+    jakvm_t* ctx;
+    /* the library's own state for this VM, NULL at first; if the library
+     * exports void release(void*), it is called with it when the VM
+     * goes away */
+    void** state;
+
     /* manipulate the VM stack (e.g. for grabbing parameters) */
-    signed_t (*pop)();
-    void (*push)(signed_t);
+    signed_t (*pop)(jakvm_t*);
+    void (*push)(jakvm_t*, signed_t);
 
-    /* start a procedure call into the VM; returns */
-    void (*exec_vm_code)(unsigned_t address);
+    /* start a procedure call into the VM; returns when it RTs */
+    void (*exec_vm_code)(jakvm_t*, unsigned_t address);
     /* dereference a pointer */
-    unsigned_t* (*deref)(unsigned_t address);
+    unsigned_t* (*deref)(jakvm_t*, unsigned_t address);
     /* dereference a string pointer; needs to be free'd */
-    char* (*deref_string)(unsigned_t address);
+    char* (*deref_string)(jakvm_t*, unsigned_t address);
+    /* dereference a short name; do not free */
+    char const* (*from_short_name)(jakvm_t*, unsigned_t name);
+    /* abort the VM with a message; does not return */
+    void (*error)(jakvm_t*, char const* msg);
+    /* where the VM's standard output goes; print there, not to stdout */
+    FILE* (*output)(jakvm_t*);
 } vm_utilities_t;
 
 typedef void (*utility_fn)(vm_utilities_t, signed_t (*regs)[33]);
@@ -26,4 +43,122 @@ typedef struct {
     utility_fn* utilities;
 } utility_lib_t;
 
+/* Embedding: libjakvmhs (.a or .so) runs images in the host process.
+ * A VM runs an image from the top any number of times; VMs share
+ * nothing, so each can run on a thread of its own. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* registers, for jakvm_reg */
+#define JAKVM_RA 30
+#define JAKVM_SP 31
+#define JAKVM_IP 32
+#define JAKVM_REGS 33
+
+/* the run is not over: jakvm_slice or jakvm_step carry on with it */
+#define JAKVM_PAUSED -1
+
+/* a VM for an image file (.hss); NULL if out of memory */
+jakvm_t* jakvm_new(char const* image);
+/* a VM for the length bytes of image; they are not copied, so they have
+ * to stay put until the VM is freed; name stands in for the file name
+ * (in messages, and the save data is name.sav) */
+jakvm_t* jakvm_new_from_memory(char const* name, void const* image, size_t length);
+/* gives up on a paused run, if any, and frees the VM */
+void jakvm_free(jakvm_t* vm);
+/* runs an image file from now on; snapshot (see jakvm_snapshot) is
+ * mapped instead of loading it, if not -1 */
+void jakvm_set_image(jakvm_t* vm, char const* image, int snapshot);
+/* the image's stdin, stdout and stderr (stdin, stdout and stderr at
+ * first); the VM does not close them */
+void jakvm_set_io(jakvm_t* vm, FILE* in, FILE* out, FILE* err);
+/* the save data is name.sav (and name.wal) from the next run on, instead
+ * of the image's; NULL goes back to the image's */
+void jakvm_set_save(jakvm_t* vm, char const* name);
+/* loads and initializes utility library lib<name>.so ahead of the first
+ * run calling it; 0, or -1 (and a message on the VM's stderr) if it
+ * cannot */
+int jakvm_bind_library(jakvm_t* vm, char const* name);
+
+/* runs the image from the top until it halts or fails; returns the exit
+ * status: 0 on HL, 42 on errors */
+int jakvm_run(jakvm_t* vm);
+/* a run a step at a time: gets the image ready to run from the top;
+ * 0, or the exit status if it cannot (the run is over then) */
+int jakvm_load(jakvm_t* vm);
+/* runs the loaded image for about budget backward jumps and returns,
+ * calls and resets (no limit if 0), or until it yields; JAKVM_PAUSED if the run is not over,
+ * else its exit status. With a budget, a wait on a channel ends the slice
+ * instead of the thread sleeping; a transaction never ends a slice */
+int jakvm_slice(jakvm_t* vm, long budget);
+/* idem, a single instruction */
+int jakvm_step(jakvm_t* vm);
+/* gives up on a paused run; returns its exit status so far */
+int jakvm_end(jakvm_t* vm);
+/* calls the sub at address of a loaded or paused image, like CA would,
+ * with args[0] on top of the stack; JAKVM_PAUSED once it returned, with
+ * what it left on top of the stack in *result (0 if nothing); if it
+ * stopped the VM instead, the run is over and this is its exit status */
+int jakvm_call(jakvm_t* vm, unsigned_t address, int nargs, signed_t const* args, signed_t* result);
+/* swaps in the code of image in a loaded or paused VM; its data, stack
+ * and registers stay, and image is the one RS starts over from (the VM
+ * no longer runs from a snapshot; its save data keeps its name); with an entry other than -1, then calls the sub at
+ * entry of the new code (like jakvm_call), and if it leaves a word other
+ * than 0 on top of the stack, the run carries on there instead of at IP;
+ * JAKVM_PAUSED once done, JAKVM_NO_IMAGE if image cannot be read (nothing
+ * changed then), or the exit status if the hook stopped the VM */
+#define JAKVM_NO_IMAGE -2
+int jakvm_reload(jakvm_t* vm, char const* image, int entry);
+
+/* registers and the 0x10000 words of memory, between steps or slices */
+signed_t jakvm_reg(jakvm_t* vm, unsigned reg);
+void jakvm_set_reg(jakvm_t* vm, unsigned reg, signed_t value);
+unsigned_t* jakvm_memory(jakvm_t* vm);
+
+/* utilities of the host's own, called with IN like the built in ones,
+ * numbered JAKVM_HOST_UTILITIES and up; fn gets its parameters with
+ * jakvm_pop and leaves its results with jakvm_push; returns 0, or -1 if
+ * which is out of range; a NULL fn takes the utility out again */
+#define JAKVM_HOST_UTILITIES 128
+#define JAKVM_MAX_HOST_UTILITIES 128
+typedef void (*jakvm_utility_fn)(jakvm_t* vm, void* user);
+int jakvm_register_utility(jakvm_t* vm, unsigned_t which, jakvm_utility_fn fn, void* user);
+/* only while the VM runs, i.e. from a utility; jakvm_error does not
+ * return, the run stops with status 42 */
+signed_t jakvm_pop(jakvm_t* vm);
+void jakvm_push(jakvm_t* vm, signed_t x);
+void jakvm_error(jakvm_t* vm, char const* msg);
+
+/* the VM's machine as it is now, as a file VMs can start from (see
+ * jakvm_set_image); -1 on failure; close it when done */
+int jakvm_snapshot(jakvm_t* vm);
+/* a snapshot of an image file as loaded; -1 if it cannot be loaded */
+int jakvm_snapshot_image(char const* image);
+/* bytes of memory the VM has to itself */
+size_t jakvm_rss(jakvm_t* vm);
+
+/* writes the whole state of a loaded or paused VM (registers, memory,
+ * heap, short names, logger state, the libraries it loaded and the name
+ * of its save data) to the checkpoint file path; only what changed since
+ * the checkpoint it replaces (of the last two in the file) is written;
+ * with background, a thread of the VM's own does the writing while the
+ * VM carries on; 0, or -1 (and a message on the VM's stderr) if it
+ * cannot: while tasks, windows, timers, a transaction or channels are
+ * open, or if the previous checkpoint's write failed */
+int jakvm_checkpoint(jakvm_t* vm, char const* path, int background);
+/* waits for a background checkpoint to be on disk; 0, or -1 if writing
+ * it failed */
+int jakvm_checkpoint_wait(jakvm_t* vm);
+/* instead of jakvm_load: gets the VM ready to carry on from the newest
+ * complete checkpoint in path, mapped copy on write; libraries are loaded
+ * again and start afresh; 0, or the exit status if it cannot (255 when
+ * path holds no checkpoint) */
+int jakvm_restore(jakvm_t* vm, char const* path);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
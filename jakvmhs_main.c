@@ -0,0 +1,808 @@
+// jakvmhs.bin: runs images with libjakvmhs, one or many side by side
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jakvmhs.h"
+
+static void usage(char const* imgname)
+{
+    printf("Usage: %s [-j N | -i N] [-s N] image.hss\n", imgname);
+    printf("       %s [-j N] [-s N] image.hss image.hss...\n", imgname);
+    printf("    -j N  run N copies side by side\n");
+    printf("    -i N  load N copies, report their memory, run none\n");
+    printf("    -s N  a thread per core instead of per copy, running each\n");
+    printf("          copy in turn for N backward jumps, calls and resets\n");
+    printf("       %s -c file [-s N] [-e N] image.hss\n", imgname);
+    printf("    checkpoints the run to file every second (between slices\n");
+    printf("    of N); carries on from there if it is cut short; SIGHUP\n");
+    printf("    reloads the image's code, calling the sub @N of it first\n");
+    printf("    several images run side by side, N copies (1) of each\n");
+    printf("       %s -S socket [-j N] [-l lib]... image.hss...\n", imgname);
+    printf("    serves runs of the images on a unix socket, N at a time\n");
+    printf("    (one per core), with the libraries loaded, until SIGINT\n");
+    printf("    or SIGTERM\n");
+    printf("       %s -C socket [-n N] image.hss\n", imgname);
+    printf("    runs the image on a server; -n N: N times, reports latencies\n");
+    printf("       %s -F [-j N] [-l lib]... [-o DIR] image.hss\n", imgname);
+    printf("    loads the image and libraries, then forks a run per line on\n");
+    printf("    stdin: input (- for none) [save name]; N at a time (1);\n");
+    printf("    their output goes to DIR/<run>.out and .err, or nowhere\n");
+    exit(255);
+}
+
+static long ms_since(struct timespec const* t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+typedef struct {
+    char const* image;
+    int snapshot;
+    int status;
+    size_t rss;
+} run_t;
+
+static void* run_thread(void* p)
+{
+    run_t* r = (run_t*)p;
+    jakvm_t* vm = jakvm_new(r->image);
+    if(vm) jakvm_set_image(vm, r->image, r->snapshot);
+    r->status = (vm) ? jakvm_run(vm) : 42;
+    if(vm) r->rss = jakvm_rss(vm);
+    if(vm) jakvm_free(vm);
+    return NULL;
+}
+
+// -i N: N VMs loaded and ready to run the image, none of them running;
+// reports what they take
+static int idle(char const* image, int snapshot, int n)
+{
+    FILE* null = fopen("/dev/null", "w");
+    jakvm_t** vms = (jakvm_t**)calloc(n, sizeof(jakvm_t*));
+    size_t rss = 0;
+    int i = 0, status = 0;
+    for(; i < n && !status; ++i) {
+        vms[i] = jakvm_new(image);
+        if(!vms[i]) {
+            fprintf(stderr, "out of memory after %d VMs\n", i);
+            status = 42;
+            break;
+        }
+        jakvm_set_image(vms[i], image, snapshot);
+        jakvm_set_io(vms[i], stdin, null, null);
+        status = jakvm_load(vms[i]);
+        rss += jakvm_rss(vms[i]);
+    }
+    long pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f && fscanf(f, "%*ld %ld", &pages) != 1) pages = 0;
+    if(f) fclose(f);
+    fprintf(stderr, "%d idle VMs: %zu KB each to themselves, %ld MB resident in all\n",
+            i, (i) ? rss / i / 1024 : 0, pages * sysconf(_SC_PAGESIZE) >> 20);
+    while(i--) jakvm_free(vms[i]);
+    free(vms);
+    fclose(null);
+    return status;
+}
+
+// -s N: the runs are dealt out to a thread per core, and each thread
+// takes turns running its VMs for a slice of N backward jumps, calls and
+// resets
+typedef struct {
+    pthread_t thread;
+    run_t* runs;
+    int n, self, threads;
+    long slice;
+} slicer_t;
+
+static void* slice_thread(void* p)
+{
+    slicer_t* s = (slicer_t*)p;
+    int mine = (s->n - s->self + s->threads - 1) / s->threads;
+    jakvm_t** vms = (jakvm_t**)calloc(mine, sizeof(jakvm_t*));
+    int i = 0, live = 0;
+    for(; i < mine; ++i) {
+        run_t* r = &s->runs[s->self + i * s->threads];
+        jakvm_t* vm = jakvm_new(r->image);
+        if(!vm) {
+            r->status = 42;
+            continue;
+        }
+        jakvm_set_image(vm, r->image, r->snapshot);
+        if(jakvm_load(vm)) {
+            r->status = jakvm_end(vm);
+            jakvm_free(vm);
+            continue;
+        }
+        vms[i] = vm;
+        ++live;
+    }
+    while(live) {
+        for(i = 0; i < mine; ++i) {
+            if(!vms[i]) continue;
+            int status = jakvm_slice(vms[i], s->slice);
+            if(status == JAKVM_PAUSED) continue;
+            run_t* r = &s->runs[s->self + i * s->threads];
+            r->status = status;
+            r->rss = jakvm_rss(vms[i]);
+            jakvm_free(vms[i]);
+            vms[i] = NULL;
+            --live;
+        }
+    }
+    free(vms);
+    return NULL;
+}
+
+//-------------------------------------------------------------
+// -S: resident server
+//-------------------------------------------------------------
+
+// The server loads its images once and keeps a VM per thread, binding the
+// libraries given with -l to it before the first request, so no request
+// pays for loading one; the libraries a VM loads stay loaded from request
+// to request, and each request starts afresh from the image's snapshot.
+//
+// A request is a line naming one of the images, then what the image reads
+// on stdin, up to the client's end of writes. The reply streams back as
+// frames: a type ('o' for stdout, 'e' for stderr, 's' for the exit status,
+// last), a 32 bit length and that many bytes.
+
+#define MAX_LIBS 64             // -l, for -S and -F
+
+typedef struct {
+    int listener;
+    char** images;
+    int* snapshots;
+    int numImages;
+    char const** libs;
+    int numLibs;
+    pthread_mutex_t lock;
+    long* latencies;            // us, per request served
+    size_t numLatencies, maxLatencies;
+} server_t;
+
+static server_t g_server;
+
+typedef struct {
+    int fd;
+    char type;
+} stream_t;
+
+static bool send_all(int fd, void const* p, size_t n)
+{
+    while(n) {
+        ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+        if(sent == -1 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        p = (char const*)p + sent;
+        n -= sent;
+    }
+    return true;
+}
+
+static bool send_frame(int fd, char type, void const* p, uint32_t n)
+{
+    char header[5];
+    header[0] = type;
+    memcpy(header + 1, &n, 4);
+    return send_all(fd, header, 5) && send_all(fd, p, n);
+}
+
+static ssize_t stream_write(void* cookie, char const* p, size_t n)
+{
+    stream_t* s = (stream_t*)cookie;
+    return send_frame(s->fd, s->type, p, n) ? (ssize_t)n : -1;
+}
+
+static int compare_longs(void const* a, void const* b)
+{
+    long x = *(long const*)a, y = *(long const*)b;
+    return (x > y) - (x < y);
+}
+
+static void report_latencies(char const* what, long* us, size_t n)
+{
+    if(!n) {
+        fprintf(stderr, "no %s\n", what);
+        return;
+    }
+    qsort(us, n, sizeof(long), &compare_longs);
+    fprintf(stderr, "%zu %s: p50 %ld us, p99 %ld us, max %ld us\n",
+            n, what, us[n / 2], us[n * 99 / 100], us[n - 1]);
+}
+
+static void serve_request(jakvm_t* vm, int fd)
+{
+    char name[4096];
+    size_t len = 0;
+    // byte by byte: whatever follows the line is the image's stdin
+    while(len < sizeof(name) - 1 && read(fd, &name[len], 1) == 1 && name[len] != '\n') ++len;
+    name[len] = '\0';
+
+    int status = 255, i = 0;
+    for(; i < g_server.numImages && strcmp(g_server.images[i], name) != 0; ++i)
+        ;
+    if(i == g_server.numImages) {
+        char msg[4200];
+        int n = snprintf(msg, sizeof(msg), "no image %s on this server\n", name);
+        send_frame(fd, 'e', msg, n);
+    } else {
+        stream_t o = { fd, 'o' }, e = { fd, 'e' };
+        cookie_io_functions_t io = { NULL, &stream_write, NULL, NULL };
+        FILE* in = fdopen(dup(fd), "r");
+        FILE* out = fopencookie(&o, "w", io);
+        FILE* err = fopencookie(&e, "w", io);
+        if(in && out && err) {
+            jakvm_set_image(vm, g_server.images[i], g_server.snapshots[i]);
+            jakvm_set_io(vm, in, out, err);
+            status = jakvm_run(vm);
+        }
+        if(in) fclose(in);
+        if(out) fclose(out);
+        if(err) fclose(err);
+    }
+    int32_t s = status;
+    send_frame(fd, 's', &s, sizeof(s));
+}
+
+static void* serve(void* p)
+{
+    (void)p;
+    jakvm_t* vm = jakvm_new("");
+    if(!vm) {
+        fprintf(stderr, "out of memory\n");
+        exit(42);
+    }
+    int i = 0;
+    for(; i < g_server.numLibs; ++i) {
+        if(jakvm_bind_library(vm, g_server.libs[i])) exit(255);
+    }
+    for(;;) {
+        int fd = accept(g_server.listener, NULL, NULL);
+        if(fd == -1) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            exit(42);
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        serve_request(vm, fd);
+        close(fd);
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+        pthread_mutex_lock(&g_server.lock);
+        if(g_server.numLatencies == g_server.maxLatencies) {
+            g_server.maxLatencies = (g_server.maxLatencies) ? g_server.maxLatencies * 2 : 1024;
+            g_server.latencies = (long*)realloc(g_server.latencies, g_server.maxLatencies * sizeof(long));
+        }
+        g_server.latencies[g_server.numLatencies++] = us;
+        pthread_mutex_unlock(&g_server.lock);
+    }
+    return NULL;
+}
+
+// serves until SIGINT or SIGTERM, then reports the latencies
+static int server(char const* path, char** images, int numImages, char const** libs, int numLibs, int threads)
+{
+    g_server.images = images;
+    g_server.numImages = numImages;
+    g_server.libs = libs;
+    g_server.numLibs = numLibs;
+    g_server.snapshots = (int*)calloc(numImages, sizeof(int));
+    pthread_mutex_init(&g_server.lock, NULL);
+    int i = 0;
+    for(; i < numImages; ++i) {
+        g_server.snapshots[i] = jakvm_snapshot_image(images[i]);
+        if(g_server.snapshots[i] == -1) {
+            fprintf(stderr, "cannot load %s\n", images[i]);
+            return 255;
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    g_server.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(g_server.listener == -1
+            || bind(g_server.listener, (struct sockaddr*)&addr, sizeof(addr)) == -1
+            || listen(g_server.listener, SOMAXCONN) == -1) {
+        perror(path);
+        return 255;
+    }
+
+    // only this thread takes the signals
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    for(i = 0; i < threads; ++i) {
+        pthread_t t;
+        if(pthread_create(&t, NULL, &serve, NULL)) {
+            fprintf(stderr, "failed to start thread %d\n", i);
+            exit(42);
+        }
+    }
+    fprintf(stderr, "serving %d images on %s with %d threads\n", numImages, path, threads);
+    int sig;
+    sigwait(&stop, &sig);
+
+    close(g_server.listener);
+    unlink(path);
+    pthread_mutex_lock(&g_server.lock);
+    report_latencies("requests", g_server.latencies, g_server.numLatencies);
+    // the threads may be in the middle of a request; they just go
+    exit(0);
+}
+
+//-------------------------------------------------------------
+// -C: client
+//-------------------------------------------------------------
+
+static int connect_to(char const* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror(path);
+        exit(255);
+    }
+    return fd;
+}
+
+static bool recv_all(int fd, void* p, size_t n)
+{
+    while(n) {
+        ssize_t got = read(fd, p, n);
+        if(got == -1 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        p = (char*)p + got;
+        n -= got;
+    }
+    return true;
+}
+
+// one request: sends input (until EOF) while it passes the frames coming
+// back on to out and err; returns the image's exit status
+static int request(char const* path, char const* image, int input, FILE* out, FILE* err)
+{
+    int fd = connect_to(path);
+    char line[4200];
+    int n = snprintf(line, sizeof(line), "%s\n", image);
+    if(!send_all(fd, line, n)) return 255;
+    if(input == -1) shutdown(fd, SHUT_WR);
+
+    int status = 255;
+    char buf[65536];
+    bool done = false;
+    while(!done) {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { input, POLLIN, 0 } };
+        if(poll(fds, (input == -1) ? 1 : 2, -1) == -1) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(input != -1 && fds[1].revents) {
+            ssize_t got = read(input, buf, sizeof(buf));
+            if(got > 0 && send_all(fd, buf, got)) continue;
+            shutdown(fd, SHUT_WR);
+            input = -1;
+        }
+        if(!fds[0].revents) continue;
+
+        char header[5];
+        uint32_t len;
+        if(!recv_all(fd, header, 5)) break;
+        memcpy(&len, header + 1, 4);
+        while(len) {
+            size_t chunk = (len < sizeof(buf)) ? len : sizeof(buf);
+            if(!recv_all(fd, buf, chunk)) break;
+            if(header[0] == 's' && chunk == sizeof(int32_t)) {
+                int32_t s;
+                memcpy(&s, buf, sizeof(s));
+                status = s;
+                done = true;
+            } else if(header[0] == 'o' || header[0] == 'e') {
+                fwrite(buf, 1, chunk, (header[0] == 'o') ? out : err);
+            }
+            len -= chunk;
+        }
+    }
+    fflush(out);
+    fflush(err);
+    close(fd);
+    return status;
+}
+
+// -C path image: runs image on the server as if it ran here; with -n N,
+// runs it N times with nothing on stdin, drops the output and reports
+// the latencies
+static int client(char const* path, char const* image, int n)
+{
+    if(n == 1) return request(path, image, STDIN_FILENO, stdout, stderr);
+
+    FILE* null = fopen("/dev/null", "w");
+    long* us = (long*)malloc(n * sizeof(long));
+    int i = 0, status = 0;
+    for(; i < n; ++i) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int s = request(path, image, -1, null, null);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        us[i] = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+        if(s > status) status = s;
+    }
+    report_latencies("requests, round trip", us, n);
+    free(us);
+    fclose(null);
+    return status;
+}
+
+//-------------------------------------------------------------
+// -F: fork server
+//-------------------------------------------------------------
+
+// The fork server loads the image (and binds the libraries given with -l)
+// once, then forks a run per line read on stdin from that ready state, so
+// a run costs a fork and the guest's own work. A line is an input file
+// (- for none) and, optionally, the name of the save data the run uses
+// (name.sav, name.wal) instead of the image's.
+//
+// Up to N runs go on at once; a line per run goes to stdout as it ends:
+// "run I: status S, T us". Their output goes to DIR/I.out and DIR/I.err
+// with -o DIR, else nowhere.
+
+typedef struct {
+    pid_t pid;
+    size_t run;
+    struct timespec start;
+} forked_t;
+
+static long us_since(struct timespec const* t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000000 + (now.tv_nsec - t->tv_nsec) / 1000;
+}
+
+// the child: runs the loaded image and never returns
+static void fork_run(jakvm_t* vm, size_t run, char const* input, char const* save, char const* dir)
+{
+    char out[4096], err[4096];
+    snprintf(out, sizeof(out), "%s/%lu.out", (dir) ? dir : "", (unsigned long)run);
+    snprintf(err, sizeof(err), "%s/%lu.err", (dir) ? dir : "", (unsigned long)run);
+    FILE* in = fopen((strcmp(input, "-") != 0) ? input : "/dev/null", "r");
+    FILE* o = fopen((dir) ? out : "/dev/null", "w");
+    FILE* e = fopen((dir) ? err : "/dev/null", "w");
+    if(!in || !o || !e) {
+        fprintf(stderr, "run %lu: cannot open %s\n", (unsigned long)run,
+                (!in) ? input : (!o) ? out : err);
+        _exit(255);
+    }
+    jakvm_set_io(vm, in, o, e);
+    if(save) jakvm_set_save(vm, save);
+    int status;
+    while((status = jakvm_slice(vm, 0)) == JAKVM_PAUSED)
+        ;
+    _exit(status);
+}
+
+// waits for one of the runs going on; returns its exit status
+static int fork_wait(forked_t* slots, int* running, long* us)
+{
+    int ws;
+    pid_t pid;
+    while((pid = wait(&ws)) == -1 && errno == EINTR)
+        ;
+    if(pid == -1) {
+        perror("wait");
+        exit(42);
+    }
+    int i = 0;
+    for(; i < *running && slots[i].pid != pid; ++i)
+        ;
+    int status = WIFEXITED(ws) ? WEXITSTATUS(ws) : 128 + WTERMSIG(ws);
+    us[slots[i].run] = us_since(&slots[i].start);
+    printf("run %lu: status %d, %ld us\n", (unsigned long)slots[i].run, status, us[slots[i].run]);
+    fflush(stdout);
+    slots[i] = slots[--*running];
+    return status;
+}
+
+static int fork_server(char const* image, char const** libs, int numLibs, char const* dir, int n)
+{
+    jakvm_t* vm = jakvm_new(image);
+    if(!vm) {
+        fprintf(stderr, "out of memory\n");
+        return 42;
+    }
+    int i = 0, status = 0;
+    for(; i < numLibs; ++i) {
+        if(jakvm_bind_library(vm, libs[i])) return 255;
+    }
+    if((status = jakvm_load(vm)) != 0) return status;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    forked_t* slots = (forked_t*)calloc(n, sizeof(forked_t));
+    long* us = NULL;
+    size_t runs = 0, maxRuns = 0, failed = 0;
+    int running = 0;
+    char* line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, stdin) != -1) {
+        char* input = strtok(line, " \t\r\n");
+        if(!input || input[0] == '#') continue;
+        char* save = strtok(NULL, " \t\r\n");
+        if(runs == maxRuns) {
+            maxRuns = (maxRuns) ? maxRuns * 2 : 1024;
+            us = (long*)realloc(us, maxRuns * sizeof(long));
+        }
+        if(running == n && fork_wait(slots, &running, us)) ++failed;
+
+        forked_t* f = &slots[running];
+        f->run = runs++;
+        clock_gettime(CLOCK_MONOTONIC, &f->start);
+        f->pid = fork();
+        if(f->pid == -1) {
+            perror("fork");
+            exit(42);
+        }
+        if(f->pid == 0) fork_run(vm, f->run, input, save, dir);
+        ++running;
+    }
+    while(running) {
+        if(fork_wait(slots, &running, us)) ++failed;
+    }
+    long ms = ms_since(&start);
+    fprintf(stderr, "%lu runs (%lu failed) in %ld ms, %d at a time: %.1f runs/s\n",
+            (unsigned long)runs, (unsigned long)failed, ms, n, (ms) ? runs * 1000.0 / ms : 0.0);
+    report_latencies("runs", us, runs);
+    free(line);
+    free(us);
+    free(slots);
+    jakvm_end(vm);
+    jakvm_free(vm);
+    return failed ? 1 : 0;
+}
+
+//-------------------------------------------------------------
+// -c: checkpointed run
+//-------------------------------------------------------------
+
+// The image runs in slices, with a checkpoint to the file between slices
+// every second, written in the background. A run that finds a checkpoint
+// there carries on from it instead of starting from the top; SIGINT and
+// SIGTERM take a last one and stop. Once the run halts the file goes; a
+// run that fails (in a reload hook, say) leaves it, so that it can carry
+// on from the last checkpoint once the failure is dealt with.
+//
+// SIGHUP swaps in the code of the image file as it is then (a new build
+// put in its place), keeping the data, and with -e N calls the sub @N of
+// it first (see jakvm_reload).
+
+#define CHECKPOINT_SLICE 100000
+#define CHECKPOINT_EVERY_MS 1000
+
+static volatile sig_atomic_t g_stop, g_reload;
+
+static void stop_run(int sig)
+{
+    g_stop = sig;
+}
+
+static void reload_run(int sig)
+{
+    (void)sig;
+    g_reload = 1;
+}
+
+static int checkpointed(char const* image, char const* path, long slice, int entry)
+{
+    jakvm_t* vm = jakvm_new(image);
+    if(!vm) {
+        fprintf(stderr, "out of memory\n");
+        return 42;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &stop_run;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = &reload_run;
+    sigaction(SIGHUP, &sa, NULL);
+
+    // a file without a complete checkpoint (the first one was cut short)
+    // starts the run over
+    int status = 255;
+    if(access(path, F_OK) == 0) status = jakvm_restore(vm, path);
+    if(status == 255) status = jakvm_load(vm);
+    if(status) {
+        jakvm_end(vm);
+        jakvm_free(vm);
+        return status;
+    }
+
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    while((status = jakvm_slice(vm, (slice) ? slice : CHECKPOINT_SLICE)) == JAKVM_PAUSED) {
+        if(g_stop) {
+            status = (jakvm_checkpoint(vm, path, 0) == 0) ? 128 + g_stop : 42;
+            jakvm_end(vm);
+            jakvm_free(vm);
+            return status;
+        }
+        if(g_reload) {
+            g_reload = 0;
+            status = jakvm_reload(vm, image, entry);
+            if(status != JAKVM_PAUSED && status != JAKVM_NO_IMAGE) break;
+        }
+        if(ms_since(&last) >= CHECKPOINT_EVERY_MS) {
+            // one that fails is tried again next time
+            jakvm_checkpoint(vm, path, 1);
+            clock_gettime(CLOCK_MONOTONIC, &last);
+        }
+    }
+    jakvm_checkpoint_wait(vm);
+    jakvm_free(vm);
+    if(status) fprintf(stderr, "status %d, keeping %s\n", status, path);
+    else unlink(path);
+    return status;
+}
+
+int main(int argc, char* argv[])
+{
+    int n = 1;
+    long slice = 0;
+    bool idling = false;
+    char const* serving = NULL;
+    char const* calling = NULL;
+    int requests = 1, threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool forking = false;
+    char const* libs[MAX_LIBS];
+    int numLibs = 0;
+    char const* dir = NULL;
+    char const* checkpoint = NULL;
+    int entry = -1;
+    int opt;
+    while((opt = getopt(argc, argv, "hj:i:s:S:C:n:Fl:o:c:e:")) != -1) {
+        switch(opt) {
+        case 'c':
+            checkpoint = optarg;
+            break;
+        case 'e':
+            entry = strtol(optarg, NULL, 0);
+            if(entry < 0 || entry > 0xFFFF) usage(argv[0]);
+            break;
+        case 'F':
+            forking = true;
+            break;
+        case 'l':
+            if(numLibs == MAX_LIBS) usage(argv[0]);
+            libs[numLibs++] = optarg;
+            break;
+        case 'o':
+            dir = optarg;
+            break;
+        case 'S':
+            serving = optarg;
+            break;
+        case 'C':
+            calling = optarg;
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            if(requests < 1) usage(argv[0]);
+            break;
+        case 'i':
+            idling = true;
+            /*FALLTHROUGH*/
+        case 'j':
+            n = atoi(optarg);
+            break;
+        case 's':
+            slice = atol(optarg);
+            if(slice < 1) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    argv += optind - 1;
+    int images = argc - optind;
+    if(serving && images) return server(serving, argv + 1, images, libs, numLibs, (n > 1) ? n : threads);
+    if(calling && images == 1) return client(calling, argv[1], requests);
+    if(forking && images == 1 && n >= 1) return fork_server(argv[1], libs, numLibs, dir, n);
+    if(checkpoint && images == 1 && n == 1) return checkpointed(argv[1], checkpoint, slice, entry);
+    if(serving || calling || forking || checkpoint || numLibs) usage(argv[0]);
+    if(!images || n < 1 || (idling && images > 1)) usage(argv[0]);
+
+    // every image is loaded once; runs (and RS) map that copy on write
+    int* snapshots = (int*)calloc(images, sizeof(int));
+    int i = 0;
+    for(; i < images; ++i) snapshots[i] = jakvm_snapshot_image(argv[1 + i]);
+    if(idling) return idle(argv[1], snapshots[0], n);
+    if(n == 1 && images == 1) {
+        run_t r = { argv[1], snapshots[0], 0 };
+        run_thread(&r);
+        return r.status;
+    }
+
+    // -j N: as many VMs running the image side by side, one thread each;
+    // several images run side by side the same way, a VM each (the stages
+    // of a pipeline, say, passing messages over channels)
+    n *= images;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_t* runs = (run_t*)calloc(n, sizeof(run_t));
+    for(i = 0; i < n; ++i) {
+        runs[i].image = argv[1 + i % images];
+        runs[i].snapshot = snapshots[i % images];
+    }
+    if(slice) {
+        int threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(threads > n) threads = n;
+        slicer_t* slicers = (slicer_t*)calloc(threads, sizeof(slicer_t));
+        for(i = 0; i < threads; ++i) {
+            slicer_t* sl = &slicers[i];
+            sl->runs = runs;
+            sl->n = n;
+            sl->self = i;
+            sl->threads = threads;
+            sl->slice = slice;
+            if(pthread_create(&sl->thread, NULL, &slice_thread, sl)) {
+                fprintf(stderr, "failed to start thread %d\n", i);
+                exit(42);
+            }
+        }
+        for(i = 0; i < threads; ++i) pthread_join(slicers[i].thread, NULL);
+        free(slicers);
+    } else {
+        pthread_t* threads = (pthread_t*)calloc(n, sizeof(pthread_t));
+        for(i = 0; i < n; ++i) {
+            if(pthread_create(&threads[i], NULL, &run_thread, &runs[i])) {
+                fprintf(stderr, "failed to start VM %d\n", i);
+                exit(42);
+            }
+        }
+        for(i = 0; i < n; ++i) pthread_join(threads[i], NULL);
+        free(threads);
+    }
+    int status = 0;
+    size_t rss = 0;
+    for(i = 0; i < n; ++i) {
+        if(runs[i].status > status) status = runs[i].status;
+        rss += runs[i].rss;
+    }
+    fprintf(stderr, "%d runs in %ld ms, %zu KB each to themselves\n", n, ms_since(&start), rss / n / 1024);
+    free(runs);
+    for(i = 0; i < images; ++i) {
+        if(snapshots[i] != -1) close(snapshots[i]);
+    }
+    free(snapshots);
+    return status;
+}
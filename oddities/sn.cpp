@@ -1,8 +1,9 @@
-#include <map>
 #include <string>
-#include <list>
+#include <vector>
+#include <unordered_map>
 #include <utility>
-#include <algorithm>
+#include <cstring>
+#include <cstdint>
 
 extern "C" {
 #include "sn.h"
@@ -12,130 +13,206 @@ namespace {
 
 class SN
 {
-    std::map<unsigned short, std::string> map_;
-    std::list<std::pair<unsigned short, unsigned short> > holes_;
-    unsigned short max_;
+    typedef std::unordered_map<std::string, unsigned short> index_t;
+
+    // a short name is an index into slots_; live slots point at their
+    // entry in index_ (node based, so the pointer survives rehashing),
+    // dead slots are chained together through next
+    struct Slot
+    {
+        index_t::value_type* entry;
+        unsigned refs;
+        unsigned short next;
+    };
+
+    std::vector<Slot> slots_;
+    index_t index_;
+    unsigned short free_;
 public:
     SN()
-    : map_()
-    , holes_()
-    , max_(0)
+    : slots_()
+    , index_()
+    , free_(SN_NONE)
     {}
 
     unsigned short Add(std::string const& s)
     {
-        auto inserted = map_.insert(std::make_pair(GetNewKey(), s));
-        return inserted.first->first;
+        // equal strings share the same short name
+        auto found = index_.find(s);
+        if(found != index_.end()) {
+            ++slots_[found->second].refs;
+            return found->second;
+        }
+
+        unsigned short w = GetNewKey();
+        if(w == SN_NONE) return SN_NONE;
+
+        auto inserted = index_.insert(std::make_pair(s, w));
+        Slot& slot = slots_[w];
+        slot.entry = &*inserted.first;
+        slot.refs = 1;
+        return w;
     }
 
     std::string const& Get(unsigned short w)
     {
         static std::string blank("");
-        auto found = map_.find(w);
-        if(found == map_.end()) return blank;
-        return found->second;
+        if(w >= slots_.size() || !slots_[w].entry) return blank;
+        return slots_[w].entry->first;
     }
 
     void Erase(unsigned short w)
     {
-        auto found = map_.find(w);
-        if(found == map_.end()) return;
+        if(w >= slots_.size() || !slots_[w].entry) return;
+        Slot& slot = slots_[w];
+        if(--slot.refs) return;
 
-        DisposeOfKey(found->first);
-        map_.erase(found);
+        index_.erase(index_.find(slot.entry->first));
+        DisposeOfKey(w);
     }
 
     void Reset()
     {
-        map_.clear();
-        holes_.clear();
-        max_ = 0;
+        slots_.clear();
+        index_.clear();
+        free_ = SN_NONE;
     }
 
-private:
-    unsigned short GetNewKey()
+    // the free list and reference counts go along, so the names handed
+    // out after a Load are the ones that would have been handed out
+    std::string Save() const
     {
-        unsigned short num = 0;
-        unsigned short* pnum = NULL;
-        if(holes_.size()) {
-            auto p = holes_.begin();
-            num = (*p).first;
-            pnum = &num;
-            ++(*p).first;
-            if(p->first == p->second) {
-                holes_.erase(holes_.begin());
-            }
+        std::string out;
+        Put(out, free_);
+        Put(out, (uint32_t)slots_.size());
+        for(auto const& slot : slots_) {
+            Put(out, (uint32_t)slot.refs);
+            Put(out, slot.next);
+            if(!slot.entry) continue;
+            Put(out, (uint32_t)slot.entry->first.size());
+            out += slot.entry->first;
         }
+        return out;
+    }
 
-        if(pnum) {
-            return *pnum;
-        } else {
-            return max_++;
+    bool Load(char const* p, size_t n)
+    {
+        Reset();
+        uint32_t count;
+        if(!Get(p, n, free_) || !Get(p, n, count) || count > SN_NONE) return Fail();
+        slots_.resize(count);
+        for(auto& slot : slots_) {
+            uint32_t refs, len;
+            if(!Get(p, n, refs) || !Get(p, n, slot.next)) return Fail();
+            slot.refs = refs;
+            slot.entry = NULL;
+            if(!refs) continue;
+            if(!Get(p, n, len) || len > n) return Fail();
+            unsigned short w = &slot - &slots_[0];
+            auto inserted = index_.insert(std::make_pair(std::string(p, len), w));
+            if(!inserted.second) return Fail();
+            slot.entry = &*inserted.first;
+            p += len;
+            n -= len;
         }
+        return n == 0 || Fail();
     }
 
-    void DisposeOfKey(unsigned short w)
+private:
+    template<typename T>
+    static void Put(std::string& out, T x)
     {
-        if(w == max_ - 1) {
-            --max_;
-            return;
-        }
+        out.append(reinterpret_cast<char const*>(&x), sizeof(x));
+    }
 
-        bool inserted = false;
-        std::for_each(holes_.begin(), holes_.end(), [&](decltype(holes_)::value_type& o){
-                if(w == o.second) {
-                    inserted = true;
-                    o.second++;
-                } else if(o.first - 1 == w) {
-                    inserted = true;
-                    o.first--;
-                }
-            });
-
-        if(!inserted) {
-            decltype(holes_)::value_type item;
-            item.first = w;
-            item.second = w + 1;
-            holes_.push_back(item);
-            holes_.sort([&](decltype(holes_)::value_type const& a, decltype(holes_)::value_type const& b){
-                    return a.first < b.first;
-                });
-        }
-        
-        for(auto i = holes_.begin(); i != holes_.end();) {
-            auto prev = i++;
-            if(i == holes_.end()) break;
-            if(prev->second >= i->first) {
-                prev->second = i->second;
-                holes_.erase(i);
-                i = prev;
-            }
+    template<typename T>
+    static bool Get(char const*& p, size_t& n, T& x)
+    {
+        if(n < sizeof(x)) return false;
+        memcpy(&x, p, sizeof(x));
+        p += sizeof(x);
+        n -= sizeof(x);
+        return true;
+    }
+
+    bool Fail()
+    {
+        Reset();
+        return false;
+    }
+
+    unsigned short GetNewKey()
+    {
+        if(free_ != SN_NONE) {
+            unsigned short w = free_;
+            free_ = slots_[w].next;
+            return w;
         }
+
+        if(slots_.size() >= SN_NONE) return SN_NONE;
+        Slot slot = { NULL, 0, SN_NONE };
+        slots_.push_back(slot);
+        return slots_.size() - 1;
+    }
+
+    void DisposeOfKey(unsigned short w)
+    {
+        Slot& slot = slots_[w];
+        slot.entry = NULL;
+        slot.refs = 0;
+        slot.next = free_;
+        free_ = w;
     }
 };
 
 } // namespace
 
-static SN SNMgr;
+// a table per VM, so VMs running side by side never share one;
+// SN_table is only ever an SN behind an opaque pointer
+static SN& table(SN_table* t)
+{
+    return *reinterpret_cast<SN*>(t);
+}
+
+SN_table* SN_new()
+{
+    return reinterpret_cast<SN_table*>(new SN);
+}
+
+void SN_delete(SN_table* t)
+{
+    delete &table(t);
+}
 
-unsigned short SN_assign(char const* s)
+unsigned short SN_assign(SN_table* t, char const* s)
 {
-    std::string str(s);
-    return SNMgr.Add(s);
+    return table(t).Add(s);
 }
 
-char const* SN_get(unsigned short w)
+char const* SN_get(SN_table* t, unsigned short w)
 {
-    std::string const& got = SNMgr.Get(w);
+    std::string const& got = table(t).Get(w);
     return got.c_str();
 }
 
-void SN_dispose(unsigned short w)
+void SN_dispose(SN_table* t, unsigned short w)
+{
+    table(t).Erase(w);
+}
+
+void SN_reset(SN_table* t)
+{
+    table(t).Reset();
+}
+
+size_t SN_save(SN_table* t, void* p, size_t n)
 {
-    SNMgr.Erase(w);
+    std::string saved = table(t).Save();
+    if(saved.size() <= n) memcpy(p, saved.data(), saved.size());
+    return saved.size();
 }
 
-void SN_reset()
+int SN_load(SN_table* t, void const* p, size_t n)
 {
-    SNMgr.Reset();
+    return table(t).Load(static_cast<char const*>(p), n) ? 0 : -1;
 }
@@ -1,7 +1,18 @@
 #ifndef SN_H
 #define SN_H
-    unsigned short SN_assign(char const*);
-    char const* SN_get(unsigned short);
-    void SN_dispose(unsigned short);
-    void SN_reset();
+    /* returned by SN_assign when the table is full; never a valid name */
+#define SN_NONE 0xFFFF
+    typedef struct SN_table SN_table;
+    SN_table* SN_new();
+    void SN_delete(SN_table*);
+    unsigned short SN_assign(SN_table*, char const*);
+    char const* SN_get(SN_table*, unsigned short);
+    void SN_dispose(SN_table*, unsigned short);
+    void SN_reset(SN_table*);
+    /* the table as bytes for SN_load; returns how many, and writes them
+     * to p only if that many fit in n */
+    size_t SN_save(SN_table*, void* p, size_t n);
+    /* replaces the table with one SN_save wrote; 0, or -1 (and an empty
+     * table) if p is not that */
+    int SN_load(SN_table*, void const* p, size_t n);
 #endif
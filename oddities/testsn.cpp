@@ -1,8 +1,34 @@
 #include "sn.cpp"
 #include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+// assign/free cycles over a sliding window of live names, so both the
+// free list and the dedup index are exercised
+static void bench(SN_table* t, size_t cycles, size_t window)
+{
+    char buf[32];
+    std::vector<unsigned short> live(window, SN_NONE);
+
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < cycles; ++i) {
+        unsigned short& w = live[i % window];
+        if(w != SN_NONE) SN_dispose(t, w);
+        // every 4th string repeats a recent one and hits the dedup path
+        sprintf(buf, "name %lu", (unsigned long)((i & 3) ? i : i - 2));
+        w = SN_assign(t, buf);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("bench: %lu cycles, window %lu: %.1f ns/cycle\n",
+            (unsigned long)cycles, (unsigned long)window, ns / cycles);
+    SN_reset(t);
+}
 
 int main(int argc, char* argv[])
 {
+    SN_table* t = SN_new();
     char const* s1 = "ala bala";
     char const* s2 = "ala b2la";
     char const* s3 = "ala b3la";
@@ -11,48 +37,67 @@ int main(int argc, char* argv[])
     char const* s6 = "ala b6la";
     char const* s7 = "ala b7la";
 
-    short sn1 = SN_assign(s1);
-    short sn2 = SN_assign(s2);
-    short sn3 = SN_assign(s3);
-    short sn4 = SN_assign(s4);
-    short sn5 = SN_assign(s5);
-    short sn6 = SN_assign(s6);
-    short sn7 = SN_assign(s7);
-
-    printf("s1: %d -> %s\n", (int)sn1, SN_get(sn1));
-    printf("s2: %d -> %s\n", (int)sn2, SN_get(sn2));
-    printf("s3: %d -> %s\n", (int)sn3, SN_get(sn3));
-    printf("s4: %d -> %s\n", (int)sn4, SN_get(sn4));
-    printf("s5: %d -> %s\n", (int)sn5, SN_get(sn5));
-    printf("s6: %d -> %s\n", (int)sn6, SN_get(sn6));
-    printf("s7: %d -> %s\n", (int)sn7, SN_get(sn7));
-
-    SN_dispose(sn2);
-    printf("null: '%s'\n", SN_get(sn2));
-    short sn8 = SN_assign(s2);
+    short sn1 = SN_assign(t, s1);
+    short sn2 = SN_assign(t, s2);
+    short sn3 = SN_assign(t, s3);
+    short sn4 = SN_assign(t, s4);
+    short sn5 = SN_assign(t, s5);
+    short sn6 = SN_assign(t, s6);
+    short sn7 = SN_assign(t, s7);
+
+    printf("s1: %d -> %s\n", (int)sn1, SN_get(t, sn1));
+    printf("s2: %d -> %s\n", (int)sn2, SN_get(t, sn2));
+    printf("s3: %d -> %s\n", (int)sn3, SN_get(t, sn3));
+    printf("s4: %d -> %s\n", (int)sn4, SN_get(t, sn4));
+    printf("s5: %d -> %s\n", (int)sn5, SN_get(t, sn5));
+    printf("s6: %d -> %s\n", (int)sn6, SN_get(t, sn6));
+    printf("s7: %d -> %s\n", (int)sn7, SN_get(t, sn7));
+
+    SN_dispose(t, sn2);
+    printf("null: '%s'\n", SN_get(t, sn2));
+    short sn8 = SN_assign(t, s2);
     printf("fill hole: %d\n", (int)sn8);
 
-    SN_dispose(sn2);
-    SN_dispose(sn4);
-    SN_dispose(sn3);
-    printf("0 -> %s\n", SN_get(sn1));
-    printf("6 -> %s\n", SN_get(sn7));
-    short sn9 = SN_assign(s2);
-    short sn10 = SN_assign(s3);
-    short sn11 = SN_assign(s4);
-    short sn14 = SN_assign(s1);
+    SN_dispose(t, sn2);
+    SN_dispose(t, sn4);
+    SN_dispose(t, sn3);
+    printf("0 -> %s\n", SN_get(t, sn1));
+    printf("6 -> %s\n", SN_get(t, sn7));
+    short sn9 = SN_assign(t, s2);
+    short sn10 = SN_assign(t, s3);
+    short sn11 = SN_assign(t, s4);
+    short sn14 = SN_assign(t, s1);
     printf("%d %d %d\n", (int)sn9, (int)sn10, (int)sn11);
-    printf("%s;%s;%s\n", SN_get(sn9), SN_get(sn10), SN_get(sn11));
-    printf("%d -> %s\n", (int)sn14, SN_get(sn14));
-    SN_dispose(sn14);
+    printf("%s;%s;%s\n", SN_get(t, sn9), SN_get(t, sn10), SN_get(t, sn11));
+    printf("%d -> %s\n", (int)sn14, SN_get(t, sn14));
+    SN_dispose(t, sn14);
+
+    SN_dispose(t, sn7);
+    printf("null: '%s'\n", SN_get(t, sn7));
+    short sn12 = SN_assign(t, s7);
+    printf("%d -> %s\n", (int)sn12, SN_get(t, sn12));
+
+    // a saved table hands out what the original would have
+    SN_dispose(t, sn5);
+    std::vector<char> saved(SN_save(t, NULL, 0));
+    SN_save(t, saved.data(), saved.size());
+    SN_table* u = SN_new();
+    printf("load: %d\n", SN_load(u, saved.data(), saved.size()));
+    printf("%s;%s\n", SN_get(u, sn1), SN_get(u, sn12));
+    printf("%d %d\n", (int)SN_assign(t, s6), (int)SN_assign(u, s6));
+    printf("%d %d\n", (int)SN_assign(t, "new"), (int)SN_assign(u, "new"));
+    int bad = SN_load(u, saved.data(), saved.size() - 1);
+    printf("bad load: %d '%s'\n", bad, SN_get(u, sn1));
+    SN_delete(u);
 
-    SN_dispose(sn7);
-    printf("null: '%s'\n", SN_get(sn7));
-    short sn12 = SN_assign(s7);
-    printf("%d -> %s\n", (int)sn12, SN_get(sn12));
+    SN_reset(t);
+    printf("'%s'\n", SN_get(t, sn1));
 
-    SN_reset();
-    printf("'%s'\n", SN_get(sn1));
+    size_t cycles = (argc > 1) ? strtoul(argv[1], NULL, 0) : 4000000;
+    bench(t, cycles, 16);
+    bench(t, cycles, 1024);
+    bench(t, cycles, 60000);
 
+    SN_delete(t);
     return 0;
 }
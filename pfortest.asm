@@ -0,0 +1,108 @@
+; runs the same sub over 4096 indices twice, once with CA in a loop and
+; once with parallel_for; logs how many results differ (should be 0), then
+; the sum of the results
+.data
+:target 1   0
+:arrA   4096 -
+:arrB   4096 -
+
+.code
+    PI  :target         ; target = arrB
+    PI  :arrB
+    ST
+    PI  0               ; for(i = 0; i != 4096; ++i) work(i)
+    PR.16
+:serial
+    RP.16
+    PI  4096
+    SU
+    PI  :serial_done
+    JZ
+    RP.16
+    PI  :work
+    CA
+    RI.16
+    PI  :serial
+    JP
+:serial_done
+
+    PI  :target         ; target = arrA
+    PI  :arrA
+    ST
+    PI  0               ; parallel_for(work, 0, 4096, 0)
+    PI  4096
+    PI  0
+    PI  :work
+    PI  60
+    IN
+
+    PI  0               ; diff = 0, sum = 0
+    PR.17
+    PI  0
+    PR.18
+    PI  0               ; for(i = 0; i != 4096; ++i)
+    PR.16
+:compare
+    RP.16
+    PI  4096
+    SU
+    PI  :compared
+    JZ
+    PI  :arrA           ;   diff += arrA[i] != arrB[i]
+    RP.16
+    AD
+    LD
+    DU
+    PI  :arrB
+    RP.16
+    AD
+    LD
+    SU
+    PI  :same
+    JZ
+    RI.17
+:same
+    RP.18               ;   sum += arrA[i]
+    AD
+    PR.18
+    RI.16
+    PI  :compare
+    JP
+:compared
+    RP.17               ; log_word(diff), log_word(sum)
+    PI  3
+    IN
+    RP.18
+    PI  3
+    IN
+    HL
+
+;==========================================
+; work(wIndex): target[wIndex] = 256 LCG steps starting from wIndex
+:work
+    PR.0                ; i
+    RP.0                ; x = i
+    PR.1
+    PI  256             ; n = 256
+    PR.2
+:work_loop
+    RP.2
+    PI  :work_done
+    JZ
+    RP.1                ; x = x * 25173 + 13849
+    PI  25173
+    MU
+    PI  13849
+    AD
+    PR.1
+    RD.2
+    PI  :work_loop
+    JP
+:work_done
+    PI  :target         ; target[i] = x
+    LD
+    RP.0
+    AD
+    RP.1
+    ST
+    RT
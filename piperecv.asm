@@ -0,0 +1,46 @@
+; last stage of a pipeline: receives {i, pass} messages from the channel
+; "pipe" until it is closed; logs how many came (mod 65536) and the sum of
+; both words of each
+.data
+:name   5   'pipe', 0
+:msg    2   -
+
+.code
+    PI  2               ; c = chan_open(@name, 256, 2)
+    PI  256
+    PI  :name
+    PI  61
+    IN
+    PR.16
+    PI  0               ; n = 0, sum = 0
+    PR.2
+    PI  0
+    PR.3
+:receive
+    PI  :msg            ; while(chan_receive(c, @msg)) {
+    RP.16
+    PI  63
+    IN
+    PI  :done
+    JZ
+    RI.2                ;   ++n
+    PI  :msg            ;   sum += msg[0] + msg[1]
+    LD
+    PI  :msg
+    PI  1
+    AD
+    LD
+    AD
+    RP.3
+    AD
+    PR.3
+    PI  :receive
+    JP                  ; }
+:done
+    RP.2                ; log_word(n), log_word(sum)
+    PI  3
+    IN
+    RP.3
+    PI  3
+    IN
+    HL
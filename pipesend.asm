@@ -0,0 +1,52 @@
+; first stage of a pipeline: sends 1000000 messages {i, pass} down the
+; channel "pipe", then closes it; runs alongside piperecv:
+;   jakvmhs.bin pipesend.hss piperecv.hss
+.data
+:name   5   'pipe', 0
+:msg    2   -
+
+.code
+    PI  2               ; c = chan_open(@name, 256, 2)
+    PI  256
+    PI  :name
+    PI  61
+    IN
+    PR.16
+    PI  40              ; pass = 40
+    PR.1
+:pass
+    RP.1
+    PI  :done
+    JZ                  ; while(pass) {
+    PI  0               ;   i = 0
+    PR.0
+:send
+    RP.0
+    PI  25000
+    SU
+    PI  :sent
+    JZ                  ;   while(i != 25000) {
+    PI  :msg            ;     chan_send(c, {i, pass})
+    RP.0
+    ST
+    PI  :msg
+    PI  1
+    AD
+    RP.1
+    ST
+    PI  :msg
+    RP.16
+    PI  62
+    IN
+    RI.0                ;     ++i
+    PI  :send
+    JP                  ;   }
+:sent
+    RD.1                ;   --pass
+    PI  :pass
+    JP                  ; }
+:done
+    RP.16               ; chan_close(c)
+    PI  65
+    IN
+    HL
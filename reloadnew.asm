@@ -0,0 +1,41 @@
+; the new build of reloadtest.asm: same data, and a hook @4 the old code
+; jumps to once it swapped this code in; the hook then starts over with RS,
+; which has to bring back this build: it logs 3
+.data
+:count  1   0
+:image  14  'reloadnew.hss', 0
+
+.code
+    PI  :main           ; the hook has to be @4
+    JP
+:hook
+    PR.6                ; what reload_code pushed
+    PI  2               ; log_word(2): the new code runs
+    PI  3
+    IN
+    PI  :count          ; log_word(count * 2), log_word(R.5)
+    LD
+    PI  2
+    MU
+    PI  3
+    IN
+    RP.5
+    PI  3
+    IN
+    PI  3               ; log_word(what the old code left on the stack)
+    IN
+    RP.6                ; log_word(what reload_code pushed)
+    PI  3
+    IN
+    PI  1               ; R.7 = 1, RS keeps the registers
+    PR.7
+    RS
+:main
+    RP.7                ; only ever meant to be reloaded into a run:
+    PI  :done           ; after the RS, log_word(3)
+    JZ
+    PI  3
+    PI  3
+    IN
+:done
+    HL
@@ -0,0 +1,29 @@
+; logs 1, builds up some state, then swaps in the code of reloadnew.hss
+; with reload_code; the new code carries on @4 and logs 2, then that
+; state: 2A 64, then 7 1, then 3 from the new code after an RS
+.data
+:count  1   0
+:image  14  'reloadnew.hss', 0
+
+.code
+    PI  1               ; log_word(1): the old code runs
+    PI  3
+    IN
+    PI  :count          ; count = 21
+    PI  21
+    ST
+    PI  100             ; R.5 = 100
+    PR.5
+    PI  7               ; 7 stays on the stack
+    PI  4               ; reload_code(@image, 4)
+    PI  :image
+    PI  36
+    IN
+    PI  :failed
+    JZ
+    HL
+:failed
+    PI  0               ; log_word(0): the image could not be read
+    PI  3
+    IN
+    HL
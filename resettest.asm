@@ -0,0 +1,58 @@
+; RS brings back the image as loaded, registers aside: R.10 counts the
+; runs, and every run checks that the words it scribbled over (in 4 pages
+; of data) are back; after 1000 runs (999 resets) logs the count (3E8) and
+; how many runs found them changed (0); the cost of a reset goes to stderr
+.data
+:words  1   5
+:pad1   2047 -
+:page1  1   6
+:pad2   2047 -
+:page2  1   7
+:pad3   2047 -
+:page3  1   8
+
+.code
+    PI  :words          ; changed += words + page1 + page2 + page3 != 26
+    LD
+    PI  :page1
+    LD
+    AD
+    PI  :page2
+    LD
+    AD
+    PI  :page3
+    LD
+    AD
+    PI  26
+    SU
+    PI  :same
+    JZ
+    RI.11
+:same
+    PI  :words          ; scribble over them
+    PI  -1
+    ST
+    PI  :page1
+    PI  -1
+    ST
+    PI  :page2
+    PI  -1
+    ST
+    PI  :page3
+    PI  -1
+    ST
+    RI.10               ; if(++count != 1000) reset
+    RP.10
+    PI  1000
+    SU
+    PI  :done
+    JZ
+    RS
+:done
+    RP.10               ; log_word(count), log_word(changed)
+    PI  3
+    IN
+    RP.11
+    PI  3
+    IN
+    HL
@@ -0,0 +1,64 @@
+; a fixed amount of pure guest work, no I/O, no save data: 256 passes of
+; a pseudo random walk over a 4096 word array; logs a checksum (always
+; the same) so the runs can be compared
+;
+; for timing VMs side by side: jakvmhs.bin -j N scalebench.hss reports
+; the wall time of N runs, which should stay that of one run as long as
+; N is not above the number of cores
+.data
+:arr    4096 -
+
+.code
+    PI  1               ; x = 1, sum = 0
+    PR.1
+    PI  0
+    PR.2
+    PI  256             ; pass = 256
+    PR.3
+:pass
+    RP.3
+    PI  :done
+    JZ                  ; while(pass) {
+    PI  0               ;   i = 0
+    PR.0
+:walk
+    RP.0
+    PI  4096
+    SU
+    PI  :walked
+    JZ                  ;   while(i != 4096) {
+    RP.1                ;     x = x * 25173 + 13849
+    PI  25173
+    MU
+    PI  13849
+    AD
+    PR.1
+    PI  :arr            ;     arr[i] += x
+    RP.0
+    AD
+    DU
+    LD
+    RP.1
+    AD
+    ST
+    PI  :arr            ;     sum ^= arr[x & 4095]
+    RP.1
+    PI  4095
+    AN
+    AD
+    LD
+    RP.2
+    XR
+    PR.2
+    RI.0                ;     ++i
+    PI  :walk
+    JP                  ;   }
+:walked
+    RD.3                ;   --pass
+    PI  :pass
+    JP                  ; }
+:done
+    RP.2                ; log_word(sum)
+    PI  3
+    IN
+    HL
@@ -0,0 +1,38 @@
+; bumps a counter in the save data 1000 times with compare and swap; run
+; several copies at once: the counter goes up by 1000 for each of them
+.code
+    PI  1000            ; n = 1000
+    PR.0
+:loop
+    RP.0
+    PI  :done
+    JZ                  ; while(n) {
+:retry
+    PI  0               ;   do { old = read_save_word(0)
+    PI  10
+    IN
+    PR.1
+    RP.1                ;   } while(save_cas(0, old, old + 1) != old)
+    PI  1
+    AD
+    RP.1
+    PI  0
+    PI  59
+    IN
+    RP.1
+    SU
+    PI  :next
+    JZ
+    PI  :retry
+    JP
+:next
+    RD.0                ;   --n
+    PI  :loop
+    JP                  ; }
+:done
+    PI  0               ; log_word(read_save_word(0))
+    PI  10
+    IN
+    PI  3
+    IN
+    HL
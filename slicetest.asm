@@ -0,0 +1,42 @@
+; counts to 5 in a busy loop, logging the count after each 10000 turns
+; round; the yield at 3 hands the thread back to the host early.
+; Run side by side on one thread, copies take turns:
+;   jakvmhs.bin -j 3 -s 4000 slicetest.hss
+.code
+    PI  1               ; for(n = 1; n != 6; ++n) {
+    PR.16
+:count
+    RP.16
+    PI  6
+    SU
+    PI  :done
+    JZ
+    PI  10000           ;   for(i = 10000; i; --i);
+    PR.0
+:spin
+    RP.0
+    PI  :spun
+    JZ
+    RD.0
+    PI  :spin
+    JP
+:spun
+    RP.16               ;   log_word(n)
+    PI  3
+    IN
+    RP.16               ;   if(n == 3) yield()
+    PI  3
+    SU
+    PI  :yield
+    JZ
+    PI  :next
+    JP
+:yield
+    PI  35
+    IN
+:next
+    RI.16
+    PI  :count
+    JP                  ; }
+:done
+    HL
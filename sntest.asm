@@ -0,0 +1,42 @@
+.data
+:hellow 13  'hello world!', 0
+:prompt 12  'your name? ', 0
+:copy   40  -
+
+.code
+    PI  :hellow         ; w = assign_short_name(@hellow)
+    PI  1
+    IN
+    PR.16
+
+    RP.16               ; log_string(w)
+    PI  4
+    IN
+
+    PI  :prompt         ; log_string_p(@prompt)
+    PI  5
+    IN
+
+    PI  7               ; n = read_string()
+    IN
+    PR.17
+
+    PI  :copy           ; deref_short_name(n, @copy)
+    RP.17
+    PI  8
+    IN
+    PI  3               ; log_word(length)
+    IN
+
+    PI  :copy           ; log_string_p(@copy)
+    PI  5
+    IN
+
+    RP.17               ; free_short_name(n)
+    PI  2
+    IN
+    RP.16               ; free_short_name(w)
+    PI  2
+    IN
+
+    HL
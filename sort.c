@@ -0,0 +1,339 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jakvmhs.h"
+
+// Sorting, searching and partitioning of guest memory, in place.
+//
+// words are sorted with an LSD radix sort; records (wStride words each,
+// keyed by the signed word at wKeyOffset) with an introsort over record
+// indices, so a guest comparator always sees records at their original
+// addresses, and the permutation is applied once at the end
+//
+// guest callbacks are called like CA would call them:
+//   less(pA, pB) pushes nonzero if record A goes before record B
+//   pred(p) pushes nonzero if the record goes to the front
+// a callback address of 0 means "none"
+
+typedef int (*less_fn)(void* ctx, uint32_t a, uint32_t b);
+
+typedef struct {
+    vm_utilities_t vm;
+    unsigned_t base, stride, fn;
+} guest_cb_t;
+
+//-------------------------------------------------------------
+// helpers
+//-------------------------------------------------------------
+
+static unsigned_t* words(vm_utilities_t vm, unsigned_t address, size_t n)
+{
+    if((size_t)address + n > 0x10000) vm.error(vm.ctx, "range out of memory");
+    return vm.deref(vm.ctx, address);
+}
+
+// order preserving map of a word into unsigned space
+static unsigned_t bias(unsigned_t w, int isSigned)
+{
+    return (isSigned) ? w ^ 0x8000 : w;
+}
+
+static int less_packed(void* ctx, uint32_t a, uint32_t b)
+{
+    return a < b;
+}
+
+static int less_guest(void* ctx, uint32_t a, uint32_t b)
+{
+    guest_cb_t* cb = (guest_cb_t*)ctx;
+    cb->vm.push(cb->vm.ctx, cb->base + a * cb->stride);
+    cb->vm.push(cb->vm.ctx, cb->base + b * cb->stride);
+    cb->vm.exec_vm_code(cb->vm.ctx, cb->fn);
+    return cb->vm.pop(cb->vm.ctx) != 0;
+}
+
+static int pred_guest(guest_cb_t* cb, size_t i)
+{
+    cb->vm.push(cb->vm.ctx, cb->base + i * cb->stride);
+    cb->vm.exec_vm_code(cb->vm.ctx, cb->fn);
+    return cb->vm.pop(cb->vm.ctx) != 0;
+}
+
+//-------------------------------------------------------------
+// introsort
+//-------------------------------------------------------------
+
+static void insertion_sort(uint32_t* a, size_t n, less_fn less, void* ctx)
+{
+    size_t i = 1;
+    for(; i < n; ++i) {
+        uint32_t x = a[i];
+        size_t j = i;
+        for(; j > 0 && less(ctx, x, a[j - 1]); --j) a[j] = a[j - 1];
+        a[j] = x;
+    }
+}
+
+static void sift_down(uint32_t* a, size_t i, size_t n, less_fn less, void* ctx)
+{
+    uint32_t x = a[i];
+    while(2 * i + 1 < n) {
+        size_t c = 2 * i + 1;
+        if(c + 1 < n && less(ctx, a[c], a[c + 1])) ++c;
+        if(!less(ctx, x, a[c])) break;
+        a[i] = a[c];
+        i = c;
+    }
+    a[i] = x;
+}
+
+static void heap_sort(uint32_t* a, size_t n, less_fn less, void* ctx)
+{
+    size_t i = n / 2;
+    while(i-- > 0) sift_down(a, i, n, less, ctx);
+    for(i = n; i-- > 1;) {
+        uint32_t t = a[0];
+        a[0] = a[i];
+        a[i] = t;
+        sift_down(a, 0, i, less, ctx);
+    }
+}
+
+static void intro_sort(uint32_t* a, size_t n, size_t depth, less_fn less, void* ctx)
+{
+    while(n > 16) {
+        if(depth-- == 0) {
+            heap_sort(a, n, less, ctx);
+            return;
+        }
+
+        // median of three into a[0], then Hoare partition around it
+        size_t m = n / 2;
+        uint32_t t;
+#define SWAP(I, J) (t = a[I], a[I] = a[J], a[J] = t)
+        if(less(ctx, a[m], a[0])) SWAP(m, 0);
+        if(less(ctx, a[n - 1], a[m])) SWAP(n - 1, m);
+        if(less(ctx, a[m], a[0])) SWAP(m, 0);
+        SWAP(0, m);
+        uint32_t pivot = a[0];
+        size_t i = 0, j = n;
+        while(1) {
+            while(less(ctx, a[++i], pivot) && i < n - 1)
+                ;
+            while(less(ctx, pivot, a[--j]) && j > 0)
+                ;
+            if(i >= j) break;
+            SWAP(i, j);
+        }
+        SWAP(0, j);
+#undef SWAP
+
+        // recurse into the smaller half, loop on the bigger one
+        if(j < n - j - 1) {
+            intro_sort(a, j, depth, less, ctx);
+            a += j + 1;
+            n -= j + 1;
+        } else {
+            intro_sort(a + j + 1, n - j - 1, depth, less, ctx);
+            n = j;
+        }
+    }
+    insertion_sort(a, n, less, ctx);
+}
+
+static void sort_indices(uint32_t* a, size_t n, less_fn less, void* ctx)
+{
+    size_t depth = 0, k = n;
+    for(; k; k >>= 1) depth += 2;
+    intro_sort(a, n, depth, less, ctx);
+}
+
+//-------------------------------------------------------------
+// utilities
+//-------------------------------------------------------------
+
+// sort_words(pArr, wCount, wSigned)
+static void sort_words_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pArr = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    int isSigned = vm.pop(vm.ctx) != 0;
+    unsigned_t* arr = words(vm, pArr, count);
+
+    unsigned_t* tmp = (unsigned_t*)malloc((size_t)count * sizeof(unsigned_t) + 1);
+    size_t counts[2][257];
+    memset(counts, 0, sizeof(counts));
+
+    size_t i;
+    for(i = 0; i < count; ++i) {
+        unsigned_t k = bias(arr[i], isSigned);
+        counts[0][(k & 0xFF) + 1]++;
+        counts[1][(k >> 8) + 1]++;
+    }
+    for(i = 0; i < 256; ++i) {
+        counts[0][i + 1] += counts[0][i];
+        counts[1][i + 1] += counts[1][i];
+    }
+
+    for(i = 0; i < count; ++i) {
+        unsigned_t k = bias(arr[i], isSigned);
+        tmp[counts[0][k & 0xFF]++] = arr[i];
+    }
+    for(i = 0; i < count; ++i) {
+        unsigned_t k = bias(tmp[i], isSigned);
+        arr[counts[1][k >> 8]++] = tmp[i];
+    }
+    free(tmp);
+}
+
+// sort_records(pArr, wCount, wStride, wKeyOffset, wLess)
+// without wLess records are ordered by their signed key, stably
+static void sort_records_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pArr = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t stride = vm.pop(vm.ctx);
+    unsigned_t keyOffset = vm.pop(vm.ctx);
+    unsigned_t fn = vm.pop(vm.ctx);
+    if(stride == 0 || keyOffset >= stride) vm.error(vm.ctx, "invalid record layout");
+    unsigned_t* arr = words(vm, pArr, (size_t)count * stride);
+
+    uint32_t* order = (uint32_t*)malloc(count * sizeof(uint32_t) + 1);
+    size_t i;
+    if(fn) {
+        guest_cb_t cb = { vm, pArr, stride, fn };
+        for(i = 0; i < count; ++i) order[i] = i;
+        sort_indices(order, count, &less_guest, &cb);
+    } else {
+        // (key, index) packed into one integer: plain compares, stable
+        for(i = 0; i < count; ++i) order[i] = (uint32_t)bias(arr[i * stride + keyOffset], 1) << 16 | i;
+        sort_indices(order, count, &less_packed, NULL);
+    }
+
+    unsigned_t* sorted = (unsigned_t*)malloc((size_t)count * stride * sizeof(unsigned_t) + 1);
+    for(i = 0; i < count; ++i) {
+        memcpy(&sorted[i * stride], &arr[(order[i] & 0xFFFF) * stride], stride * sizeof(unsigned_t));
+    }
+    memcpy(arr, sorted, (size_t)count * stride * sizeof(unsigned_t));
+    free(sorted);
+    free(order);
+}
+
+// (wIndex) bsearch_words(pArr, wCount, wKey, wSigned)
+// index of the first word not less than wKey in a sorted array
+static void bsearch_words_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pArr = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t key = vm.pop(vm.ctx);
+    int isSigned = vm.pop(vm.ctx) != 0;
+    unsigned_t* arr = words(vm, pArr, count);
+
+    unsigned_t k = bias(key, isSigned);
+    size_t lo = 0, hi = count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(bias(arr[mid], isSigned) < k) lo = mid + 1;
+        else hi = mid;
+    }
+    vm.push(vm.ctx, lo);
+}
+
+// (wIndex) bsearch_records(pArr, wCount, wStride, wKeyOffset, wKey)
+// index of the first record whose signed key is not less than wKey
+static void bsearch_records_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pArr = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t stride = vm.pop(vm.ctx);
+    unsigned_t keyOffset = vm.pop(vm.ctx);
+    signed_t key = vm.pop(vm.ctx);
+    if(stride == 0 || keyOffset >= stride) vm.error(vm.ctx, "invalid record layout");
+    signed_t* arr = (signed_t*)words(vm, pArr, (size_t)count * stride);
+
+    size_t lo = 0, hi = count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(arr[mid * stride + keyOffset] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    vm.push(vm.ctx, lo);
+}
+
+// (wCount) partition_words(pArr, wCount, wPivot, wSigned)
+// moves the words less than wPivot to the front; pushes how many there are
+static void partition_words_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pArr = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t pivot = vm.pop(vm.ctx);
+    int isSigned = vm.pop(vm.ctx) != 0;
+    unsigned_t* arr = words(vm, pArr, count);
+
+    unsigned_t p = bias(pivot, isSigned);
+    size_t i = 0, j = count;
+    while(1) {
+        while(i < j && bias(arr[i], isSigned) < p) ++i;
+        while(i < j && bias(arr[j - 1], isSigned) >= p) --j;
+        if(i >= j) break;
+        unsigned_t t = arr[i];
+        arr[i] = arr[j - 1];
+        arr[j - 1] = t;
+    }
+    vm.push(vm.ctx, i);
+}
+
+// (wCount) partition_records(pArr, wCount, wStride, wKeyOffset, wPivot, wPred)
+// stable; records whose signed key is less than wPivot, or for which
+// wPred holds if given, go to the front; pushes how many there are
+static void partition_records_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pArr = vm.pop(vm.ctx);
+    unsigned_t count = vm.pop(vm.ctx);
+    unsigned_t stride = vm.pop(vm.ctx);
+    unsigned_t keyOffset = vm.pop(vm.ctx);
+    signed_t pivot = vm.pop(vm.ctx);
+    unsigned_t fn = vm.pop(vm.ctx);
+    if(stride == 0 || keyOffset >= stride) vm.error(vm.ctx, "invalid record layout");
+    signed_t* arr = (signed_t*)words(vm, pArr, (size_t)count * stride);
+
+    // decide everything first, so a predicate sees records in place
+    unsigned char* front = (unsigned char*)malloc(count + 1);
+    guest_cb_t cb = { vm, pArr, stride, fn };
+    size_t i, n = 0;
+    for(i = 0; i < count; ++i) {
+        front[i] = (fn) ? pred_guest(&cb, i) : arr[i * stride + keyOffset] < pivot;
+        n += front[i];
+    }
+
+    signed_t* out = (signed_t*)malloc((size_t)count * stride * sizeof(signed_t) + 1);
+    size_t a = 0, b = n;
+    for(i = 0; i < count; ++i) {
+        size_t to = (front[i]) ? a++ : b++;
+        memcpy(&out[to * stride], &arr[i * stride], stride * sizeof(signed_t));
+    }
+    memcpy(arr, out, (size_t)count * stride * sizeof(signed_t));
+    free(out);
+    free(front);
+    vm.push(vm.ctx, n);
+}
+
+utility_lib_t initialize()
+{
+    static utility_fn utils[] = {
+        &sort_words_fn,
+        &sort_records_fn,
+        &bsearch_words_fn,
+        &bsearch_records_fn,
+        &partition_words_fn,
+        &partition_records_fn,
+    };
+
+    static utility_lib_t ret = {
+        sizeof(utils) / sizeof(utils[0]),
+        utils
+    };
+
+    return ret;
+}
@@ -0,0 +1,224 @@
+; sorts the same 2000 pseudo random words three times:
+;   guest insertion sort, native radix sort, native introsort with a guest
+;   comparator; logs the milliseconds each took, then the number of
+;   positions where the results disagree (should be 0)
+.data
+:sortlib 5  'sort', 0
+:testlib 10 'testutils', 0
+:arrA   2000 -
+:arrB   2000 -
+:arrC   2000 -
+
+.code
+    PI  0               ; fill(i = 0, x = 1)
+    PR.0
+    PI  1
+    PR.1
+:fill
+    RP.0
+    PI  2000
+    SU
+    PI  :filled
+    JZ                  ; while(i != 2000) {
+    RP.1                ;   x = x * 25173 + 13849
+    PI  25173
+    MU
+    PI  13849
+    AD
+    PR.1
+    PI  :arrA           ;   arrA[i] = arrB[i] = arrC[i] = x
+    RP.0
+    AD
+    RP.1
+    ST
+    PI  :arrB
+    RP.0
+    AD
+    RP.1
+    ST
+    PI  :arrC
+    RP.0
+    AD
+    RP.1
+    ST
+    RI.0                ;   ++i
+    PI  :fill
+    JP                  ; }
+:filled
+
+    PI  :clock          ; t0
+    CA
+    PR.16
+
+    PI  :arrA           ; isort(@arrA, 2000)
+    PI  2000
+    PI  :isort
+    CA
+
+    PI  :clock          ; t1
+    CA
+    PR.17
+
+    PI  1               ; sort_words(@arrB, 2000, signed)
+    PI  2000
+    PI  :arrB
+    PI  0
+    PI  :sortlib
+    PI  20
+    IN
+
+    PI  :clock          ; t2
+    CA
+    PR.18
+
+    PI  :less           ; sort_records(@arrC, 2000, 1, 0, :less)
+    PI  0
+    PI  1
+    PI  2000
+    PI  :arrC
+    PI  1
+    PI  :sortlib
+    PI  20
+    IN
+
+    PI  :clock          ; t3
+    CA
+    PR.19
+
+    RP.17               ; log_word(t1 - t0)
+    RP.16
+    SU
+    PI  3
+    IN
+    RP.18               ; log_word(t2 - t1)
+    RP.17
+    SU
+    PI  3
+    IN
+    RP.19               ; log_word(t3 - t2)
+    RP.18
+    SU
+    PI  3
+    IN
+
+    PI  0               ; bad = 0, i = 0
+    PR.2
+    PI  0
+    PR.0
+:check
+    RP.0
+    PI  2000
+    SU
+    PI  :checked
+    JZ                  ; while(i != 2000) {
+    PI  :arrA           ;   bad += arrA[i] != arrB[i]
+    RP.0
+    AD
+    LD
+    PI  :arrB
+    RP.0
+    AD
+    LD
+    SU
+    NT
+    NT
+    RP.2
+    AD
+    PR.2
+    PI  :arrA           ;   bad += arrA[i] != arrC[i]
+    RP.0
+    AD
+    LD
+    PI  :arrC
+    RP.0
+    AD
+    LD
+    SU
+    NT
+    NT
+    RP.2
+    AD
+    PR.2
+    RI.0                ;   ++i
+    PI  :check
+    JP                  ; }
+:checked
+    RP.2                ; log_word(bad)
+    PI  3
+    IN
+    HL
+
+;==========================================
+; (w) clock(): milliseconds, from testutils
+:clock
+    PI  2
+    PI  :testlib
+    PI  20
+    IN
+    RT
+;==========================================
+; (w) less(pA, pB): *pA < *pB
+:less
+    PR.1                ; pB
+    PR.0                ; pA
+    RP.0
+    LD
+    RP.1
+    LD
+    CS
+    RT
+;==========================================
+; isort(p, n): insertion sort of n signed words @p
+:isort
+    PR.1                ; n
+    PR.0                ; p
+    PI  1               ; i = 1
+    PR.2
+:isort_outer
+    RP.2                ; if(i == n) return
+    RP.1
+    SU
+    PI  :isort_done
+    JZ
+    RP.0                ; x = p[i]
+    RP.2
+    AD
+    LD
+    PR.3
+    RP.2                ; j = i
+    PR.4
+:isort_inner
+    RP.4                ; while(j != 0
+    PI  :isort_place
+    JZ
+    RP.0                ;   && (y = p[j - 1]) > x) {
+    RP.4
+    AD
+    PI  1
+    SU
+    LD
+    PR.5
+    RP.3
+    RP.5
+    CS
+    PI  :isort_place
+    JZ
+    RP.0                ;   p[j] = y
+    RP.4
+    AD
+    RP.5
+    ST
+    RD.4                ;   --j
+    PI  :isort_inner
+    JP                  ; }
+:isort_place
+    RP.0                ; p[j] = x
+    RP.4
+    AD
+    RP.3
+    ST
+    RI.2                ; ++i
+    PI  :isort_outer
+    JP
+:isort_done
+    RT
@@ -0,0 +1,69 @@
+; pages memory out to a named slot of the store and back
+.data
+:name   6   'shard', 0
+
+.code
+    PI  4               ; s = slot_open(@name, 4)
+    PI  :name
+    PI  50
+    IN
+    PR.16
+
+    PI  0               ; for(i = 0; i != 2048; ++i) [0x8000 + i] = i
+    PR.0
+:fill
+    RP.0
+    PI  2048
+    SU
+    PI  :filled
+    JZ
+    PI  0x8000
+    RP.0
+    AD
+    RP.0
+    ST
+    RI.0
+    PI  :fill
+    JP
+:filled
+    PI  1               ; store_save(s, 2, 0x8000, 1)
+    PI  0x8000
+    PI  2
+    RP.16
+    PI  53
+    IN
+    PI  1               ; store_load(s, 0, 0x8000, 1), fresh page: zeros
+    PI  0x8000
+    PI  0
+    RP.16
+    PI  52
+    IN
+    PI  0x87FF          ; log_word([0x87FF]): 0
+    LD
+    PI  3
+    IN
+    PI  1               ; store_load(s, 2, 0x8000, 1)
+    PI  0x8000
+    PI  2
+    RP.16
+    PI  52
+    IN
+    PI  0x87FF          ; log_word([0x87FF]): 7FF
+    LD
+    PI  3
+    IN
+
+    PI  0               ; log_word(slot_open(@name, 0)), same slot: 1
+    PI  :name
+    PI  50
+    IN
+    PI  3
+    IN
+    RP.16               ; log_word(slot_pages(s)): 4
+    PI  51
+    IN
+    PI  3
+    IN
+    PI  54              ; store_sync()
+    IN
+    HL
@@ -0,0 +1,71 @@
+.data
+:lib    9   'strutils', 0
+:hellow 13  'Hello World!', 0
+:world  6   'WORLD', 0
+
+.code
+    PI  0               ; log_word(strlen(@hellow, wide))
+    PI  :hellow
+    PI  0
+    PI  :lib
+    PI  20
+    IN
+    PI  3
+    IN
+
+    PI  0               ; log_word(strcasecmp(@hellow + 6, @world, wide))
+    PI  :world
+    PI  :hellow
+    PI  6
+    AD
+    PI  2
+    PI  :lib
+    PI  20
+    IN
+    PI  3
+    IN
+
+    PI  0               ; strcase(@hellow, upper, wide)
+    PI  1
+    PI  :hellow
+    PI  5
+    PI  :lib
+    PI  20
+    IN
+    PI  0               ; log_word(strstr(@hellow, @world, wide))
+    PI  :world
+    PI  :hellow
+    PI  4
+    PI  :lib
+    PI  20
+    IN
+    PI  3
+    IN
+
+    PI  :hellow         ; strpack(@hellow, @hellow)
+    PI  :hellow
+    PI  6
+    PI  :lib
+    PI  20
+    IN
+    PI  1               ; log_word(strchr(@hellow, '!', packed))
+    PI  0x21
+    PI  :hellow
+    PI  3
+    PI  :lib
+    PI  20
+    IN
+    PI  3
+    IN
+
+    PI  :hellow         ; strunpack(@hellow, @hellow)
+    PI  :hellow
+    PI  7
+    PI  :lib
+    PI  20
+    IN
+    PI  :hellow         ; log_string_p(@hellow)
+    PI  5
+    IN
+
+    HL
@@ -0,0 +1,434 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "jakvmhs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+// String utilities working in place on guest strings, without allocating.
+//
+// two encodings are understood, selected by wPacked:
+//   0  one character per word, in the high byte (what asm.bin produces);
+//      the first word with a zero high byte ends the string
+//   1  two characters per word, high byte first; the first zero byte
+//      ends the string
+//
+// both are turned into a stream of characters in string order, 16 (SSE2)
+// or 32 (AVX2) at a time, so the kernels below do not care about the
+// encoding; whatever does not fit a whole block before the end of memory
+// is done one character at a time
+//
+// indices and lengths are in characters; "not found" is -1
+
+typedef struct {
+    unsigned_t const* p;
+    size_t max;         // characters available before the end of memory
+    int packed;
+} gstr_t;
+
+static int g_avx2 = 0;
+
+//-------------------------------------------------------------
+// helpers
+//-------------------------------------------------------------
+
+static gstr_t gstr(vm_utilities_t vm, unsigned_t address, int packed)
+{
+    gstr_t s;
+    s.p = vm.deref(vm.ctx, address);
+    s.max = (0x10000 - (size_t)address) * ((packed) ? 2 : 1);
+    s.packed = packed;
+    return s;
+}
+
+static unsigned char char_at(gstr_t const* s, size_t i)
+{
+    if(!s->packed) return s->p[i] >> 8;
+    return (i & 1) ? s->p[i >> 1] & 0xFF : s->p[i >> 1] >> 8;
+}
+
+static unsigned char fold(unsigned char c, int upper)
+{
+    if(upper) return (c >= 'a' && c <= 'z') ? c - 0x20 : c;
+    return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+}
+
+static signed_t sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+#ifdef HAVE_SSE2
+// 16 characters starting at character i (a multiple of 16)
+static __m128i load16(gstr_t const* s, size_t i)
+{
+    if(s->packed) {
+        __m128i v = _mm_loadu_si128((__m128i const*)&s->p[i >> 1]);
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+    __m128i a = _mm_loadu_si128((__m128i const*)&s->p[i]);
+    __m128i b = _mm_loadu_si128((__m128i const*)&s->p[i + 8]);
+    return _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+}
+
+// fold 'A'..'Z' (or 'a'..'z') bytes of v by 0x20
+static __m128i fold16(__m128i v, int upper)
+{
+    __m128i lo = _mm_set1_epi8((upper) ? 'a' - 1 : 'A' - 1);
+    __m128i hi = _mm_set1_epi8((upper) ? 'z' + 1 : 'Z' + 1);
+    __m128i in = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+    __m128i d = _mm_and_si128(in, _mm_set1_epi8(0x20));
+    return (upper) ? _mm_sub_epi8(v, d) : _mm_add_epi8(v, d);
+}
+
+__attribute__((target("avx2")))
+static __m256i load32(gstr_t const* s, size_t i)
+{
+    if(s->packed) {
+        __m256i v = _mm256_loadu_si256((__m256i const*)&s->p[i >> 1]);
+        return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    }
+    __m256i a = _mm256_loadu_si256((__m256i const*)&s->p[i]);
+    __m256i b = _mm256_loadu_si256((__m256i const*)&s->p[i + 16]);
+    __m256i v = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+    // packus works per 128 bit lane; put the quarters back in order
+    return _mm256_permute4x64_epi64(v, 0xD8);
+}
+
+__attribute__((target("avx2")))
+static __m256i fold32(__m256i v, int upper)
+{
+    __m256i lo = _mm256_set1_epi8((upper) ? 'a' - 1 : 'A' - 1);
+    __m256i hi = _mm256_set1_epi8((upper) ? 'z' + 1 : 'Z' + 1);
+    __m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+    __m256i d = _mm256_and_si256(in, _mm256_set1_epi8(0x20));
+    return (upper) ? _mm256_sub_epi8(v, d) : _mm256_add_epi8(v, d);
+}
+#endif
+
+//-------------------------------------------------------------
+// kernels
+//-------------------------------------------------------------
+
+// index of the first character that is 0 or c, from character i on
+static size_t scan_tail(vm_utilities_t vm, gstr_t const* s, size_t i, unsigned char c)
+{
+    for(; i < s->max; ++i) {
+        unsigned char x = char_at(s, i);
+        if(!x || x == c) return i;
+    }
+    vm.error(vm.ctx, "unterminated string");
+    return 0;
+}
+
+#ifdef HAVE_SSE2
+__attribute__((target("avx2")))
+static size_t scan_avx2(vm_utilities_t vm, gstr_t const* s, size_t i, unsigned char c)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i cc = _mm256_set1_epi8(c);
+    for(; i + 32 <= s->max; i += 32) {
+        __m256i v = load32(s, i);
+        uint32_t m = _mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, zero),
+                    _mm256_cmpeq_epi8(v, cc)));
+        if(m) return i + __builtin_ctz(m);
+    }
+    return scan_tail(vm, s, i, c);
+}
+#endif
+
+static size_t scan(vm_utilities_t vm, gstr_t const* s, size_t i, unsigned char c)
+{
+#ifdef HAVE_SSE2
+    // packed blocks start on a word
+    if(s->packed && (i & 1) && i < s->max) {
+        unsigned char x = char_at(s, i);
+        if(!x || x == c) return i;
+        ++i;
+    }
+    if(g_avx2) return scan_avx2(vm, s, i, c);
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i cc = _mm_set1_epi8(c);
+    for(; i + 16 <= s->max; i += 16) {
+        __m128i v = load16(s, i);
+        unsigned m = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(v, zero),
+                    _mm_cmpeq_epi8(v, cc)));
+        if(m) return i + __builtin_ctz(m);
+    }
+#endif
+    return scan_tail(vm, s, i, c);
+}
+
+// compare from character i on, one character at a time
+static signed_t compare_tail(vm_utilities_t vm, gstr_t const* a, gstr_t const* b, size_t i, int nocase)
+{
+    for(; i < a->max && i < b->max; ++i) {
+        unsigned char x = char_at(a, i), y = char_at(b, i);
+        if(nocase) {
+            x = fold(x, 0);
+            y = fold(y, 0);
+        }
+        if(x != y || !x) return sign((int)x - (int)y);
+    }
+    vm.error(vm.ctx, "unterminated string");
+    return 0;
+}
+
+#ifdef HAVE_SSE2
+__attribute__((target("avx2")))
+static signed_t compare_avx2(vm_utilities_t vm, gstr_t const* a, gstr_t const* b, int nocase)
+{
+    __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 32 <= a->max && i + 32 <= b->max; i += 32) {
+        __m256i x = load32(a, i), y = load32(b, i);
+        if(nocase) {
+            x = fold32(x, 0);
+            y = fold32(y, 0);
+        }
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y))
+            | (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero));
+        if(m) return compare_tail(vm, a, b, i + __builtin_ctz(m), nocase);
+    }
+    return compare_tail(vm, a, b, i, nocase);
+}
+#endif
+
+static signed_t compare(vm_utilities_t vm, gstr_t const* a, gstr_t const* b, int nocase)
+{
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    if(g_avx2) return compare_avx2(vm, a, b, nocase);
+
+    __m128i zero = _mm_setzero_si128();
+    for(; i + 16 <= a->max && i + 16 <= b->max; i += 16) {
+        __m128i x = load16(a, i), y = load16(b, i);
+        if(nocase) {
+            x = fold16(x, 0);
+            y = fold16(y, 0);
+        }
+        unsigned m = (~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF)
+            | _mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+        if(m) return compare_tail(vm, a, b, i + __builtin_ctz(m), nocase);
+    }
+#endif
+    return compare_tail(vm, a, b, i, nocase);
+}
+
+// fold the first n words of p; packed words fold both bytes, the others
+// only their high byte
+static void fold_words(unsigned_t* p, size_t n, int packed, int upper)
+{
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    if(packed) {
+        for(; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadu_si128((__m128i const*)&p[i]);
+            _mm_storeu_si128((__m128i*)&p[i], fold16(v, upper));
+        }
+    } else {
+        __m128i lo = _mm_set1_epi16((upper) ? 'a' << 8 : 'A' << 8);
+        __m128i hi = _mm_set1_epi16((upper) ? 'z' << 8 : 'Z' << 8);
+        __m128i mask = _mm_set1_epi16((short)0xFF00);
+        __m128i d = _mm_set1_epi16(0x2000);
+        for(; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadu_si128((__m128i const*)&p[i]);
+            __m128i h = _mm_and_si128(v, mask);
+            // characters >= 0x80 are negative here and never in range
+            __m128i in = _mm_andnot_si128(
+                    _mm_or_si128(_mm_cmplt_epi16(h, lo), _mm_cmpgt_epi16(h, hi)),
+                    _mm_set1_epi16(-1));
+            __m128i dd = _mm_and_si128(in, d);
+            v = (upper) ? _mm_sub_epi16(v, dd) : _mm_add_epi16(v, dd);
+            _mm_storeu_si128((__m128i*)&p[i], v);
+        }
+    }
+#endif
+    for(; i < n; ++i) {
+        unsigned_t w = p[i];
+        unsigned_t low = (packed) ? fold(w & 0xFF, upper) : w & 0xFF;
+        p[i] = (unsigned_t)fold(w >> 8, upper) << 8 | low;
+    }
+}
+
+//-------------------------------------------------------------
+// utilities
+//-------------------------------------------------------------
+
+// (wLen) strlen(p, wPacked)
+static void strlen_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t p = vm.pop(vm.ctx);
+    int packed = vm.pop(vm.ctx) != 0;
+    gstr_t s = gstr(vm, p, packed);
+    vm.push(vm.ctx, scan(vm, &s, 0, 0));
+}
+
+// (w) strcmp(pA, pB, wPacked): -1, 0 or 1
+static void strcmp_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pA = vm.pop(vm.ctx);
+    unsigned_t pB = vm.pop(vm.ctx);
+    int packed = vm.pop(vm.ctx) != 0;
+    gstr_t a = gstr(vm, pA, packed), b = gstr(vm, pB, packed);
+    vm.push(vm.ctx, compare(vm, &a, &b, 0));
+}
+
+// (w) strcasecmp(pA, pB, wPacked): -1, 0 or 1, ignoring ASCII case
+static void strcasecmp_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pA = vm.pop(vm.ctx);
+    unsigned_t pB = vm.pop(vm.ctx);
+    int packed = vm.pop(vm.ctx) != 0;
+    gstr_t a = gstr(vm, pA, packed), b = gstr(vm, pB, packed);
+    vm.push(vm.ctx, compare(vm, &a, &b, 1));
+}
+
+// (wIndex) strchr(p, wChar, wPacked)
+static void strchr_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t p = vm.pop(vm.ctx);
+    unsigned char c = vm.pop(vm.ctx);
+    int packed = vm.pop(vm.ctx) != 0;
+    gstr_t s = gstr(vm, p, packed);
+    size_t i = scan(vm, &s, 0, c);
+    vm.push(vm.ctx, (char_at(&s, i) == c) ? (signed_t)i : -1);
+}
+
+// (wIndex) strstr(pHaystack, pNeedle, wPacked)
+static void strstr_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pH = vm.pop(vm.ctx);
+    unsigned_t pN = vm.pop(vm.ctx);
+    int packed = vm.pop(vm.ctx) != 0;
+    gstr_t h = gstr(vm, pH, packed), n = gstr(vm, pN, packed);
+
+    size_t nlen = scan(vm, &n, 0, 0);
+    if(!nlen) {
+        vm.push(vm.ctx, 0);
+        return;
+    }
+
+    // jump between occurrences of the first character, then verify
+    unsigned char first = char_at(&n, 0);
+    size_t at = 0;
+    while(1) {
+        at = scan(vm, &h, at, first);
+        if(!char_at(&h, at)) break;
+
+        size_t j = 1;
+        for(; j < nlen && at + j < h.max && char_at(&h, at + j) == char_at(&n, j); ++j)
+            ;
+        if(j == nlen) {
+            vm.push(vm.ctx, at);
+            return;
+        }
+        // the haystack ran out: nothing further along can match either
+        if(at + j >= h.max || !char_at(&h, at + j)) break;
+        ++at;
+    }
+    vm.push(vm.ctx, -1);
+}
+
+// (wLen) strcase(p, wUpper, wPacked): fold the string in place
+static void strcase_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t p = vm.pop(vm.ctx);
+    int upper = vm.pop(vm.ctx) != 0;
+    int packed = vm.pop(vm.ctx) != 0;
+    gstr_t s = gstr(vm, p, packed);
+    size_t len = scan(vm, &s, 0, 0);
+    fold_words(vm.deref(vm.ctx, p), (packed) ? (len + 1) / 2 : len, packed, upper);
+    vm.push(vm.ctx, len);
+}
+
+// (wLen) strpack(pWide, pPacked): re-encode a string two characters per
+// word; pPacked may be pWide
+static void strpack_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pW = vm.pop(vm.ctx);
+    unsigned_t pP = vm.pop(vm.ctx);
+    gstr_t s = gstr(vm, pW, 0);
+    size_t len = scan(vm, &s, 0, 0);
+    size_t n = len / 2 + 1;     // with the terminator
+    if((size_t)pP + n > 0x10000) vm.error(vm.ctx, "range out of memory");
+    unsigned_t const* src = s.p;
+    unsigned_t* dst = vm.deref(vm.ctx, pP);
+
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    // a block's source is read before anything at or past it is written
+    for(; i + 8 < n && 2 * i + 16 <= len; i += 8) {
+        __m128i c = load16(&s, 2 * i);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(_mm_slli_epi16(c, 8), _mm_srli_epi16(c, 8)));
+    }
+#endif
+    for(; i < n; ++i) {
+        unsigned_t hi = (2 * i < len) ? src[2 * i] & 0xFF00 : 0;
+        unsigned_t lo = (2 * i + 1 < len) ? src[2 * i + 1] >> 8 : 0;
+        dst[i] = hi | lo;
+    }
+    vm.push(vm.ctx, len);
+}
+
+// (wLen) strunpack(pPacked, pWide): re-encode a string one character per
+// word; pWide may be pPacked or start after it, but must not overlap it
+// from below
+static void strunpack_fn(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    unsigned_t pP = vm.pop(vm.ctx);
+    unsigned_t pW = vm.pop(vm.ctx);
+    gstr_t s = gstr(vm, pP, 1);
+    size_t len = scan(vm, &s, 0, 0);
+    if((size_t)pW + len + 1 > 0x10000) vm.error(vm.ctx, "range out of memory");
+    unsigned_t* dst = vm.deref(vm.ctx, pW);
+
+    if(pW < pP && (size_t)pW + len + 1 > pP) vm.error(vm.ctx, "overlapping strunpack");
+
+    // the output is twice as long: go backwards when it starts later
+    size_t i;
+    if(pW >= pP) {
+        dst[len] = 0;
+        for(i = len; i-- > 0;) dst[i] = (unsigned_t)char_at(&s, i) << 8;
+    } else {
+        for(i = 0; i < len; ++i) dst[i] = (unsigned_t)char_at(&s, i) << 8;
+        dst[len] = 0;
+    }
+    vm.push(vm.ctx, len);
+}
+
+// runs once, when the library is loaded, however many VMs use it
+__attribute__((constructor)) static void setup()
+{
+#ifdef HAVE_SSE2
+    __builtin_cpu_init();
+    g_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+utility_lib_t initialize()
+{
+    static utility_fn utils[] = {
+        &strlen_fn,
+        &strcmp_fn,
+        &strcasecmp_fn,
+        &strchr_fn,
+        &strstr_fn,
+        &strcase_fn,
+        &strpack_fn,
+        &strunpack_fn,
+    };
+
+    static utility_lib_t ret = {
+        sizeof(utils) / sizeof(utils[0]),
+        utils
+    };
+
+    return ret;
+}
@@ -0,0 +1,91 @@
+; 1000 tasks taking turns: task i adds i to a shared total, yields, three
+; times over, then returns i * 2; the main program joins them in order
+; and logs the total (3 * 499500, mod 65536), what they returned (999000,
+; mod 65536) and its own handle (1)
+.data
+:total  1   0
+:tasks  1000 -
+
+.code
+    PI  0               ; for(i = 0; i != 1000; ++i) tasks[i] = task_spawn(work, i)
+    PR.16
+:spawn
+    RP.16
+    PI  1000
+    SU
+    PI  :spawned
+    JZ
+    PI  :tasks
+    RP.16
+    AD
+    RP.16
+    PI  :work
+    PI  70
+    IN
+    ST
+    RI.16
+    PI  :spawn
+    JP
+:spawned
+    PI  0               ; sum = 0
+    PR.17
+    PI  0               ; for(i = 0; i != 1000; ++i) sum += task_join(tasks[i])
+    PR.16
+:join
+    RP.16
+    PI  1000
+    SU
+    PI  :joined
+    JZ
+    PI  :tasks
+    RP.16
+    AD
+    LD
+    PI  72
+    IN
+    RP.17
+    AD
+    PR.17
+    RI.16
+    PI  :join
+    JP
+:joined
+    PI  :total          ; log_word(total), log_word(sum)
+    LD
+    PI  3
+    IN
+    RP.17
+    PI  3
+    IN
+    PI  73              ; log_word(task_self())
+    IN
+    PI  3
+    IN
+    HL
+
+;==========================================
+; work(wIndex): total += wIndex, then yield, 3 times; returns wIndex * 2
+:work
+    PR.0                ; i
+    PI  3               ; n = 3
+    PR.1
+:work_loop
+    RP.1
+    PI  :work_done
+    JZ
+    PI  :total
+    PI  :total
+    LD
+    RP.0
+    AD
+    ST
+    PI  71              ; task_yield()
+    IN
+    RD.1
+    PI  :work_loop
+    JP
+:work_done
+    RP.0
+    PI  2
+    MU
+    RT
@@ -1,21 +1,37 @@
 #include <stddef.h>
 #include "jakvmhs.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <time.h>
 
 static void test_printnum(vm_utilities_t vm, signed_t (*regs)[33])
 {
-    signed_t num = vm.pop();
+    signed_t num = vm.pop(vm.ctx);
 
-    printf("Your number was: %d\n", (int)num);
+    fprintf(vm.output(vm.ctx), "Your number was: %d\n", (int)num);
 }
 
 static void test_pow(vm_utilities_t vm, signed_t (*regs)[33])
 {
-    signed_t exp = vm.pop();
-    signed_t base = vm.pop();
+    signed_t exp = vm.pop(vm.ctx);
+    signed_t base = vm.pop(vm.ctx);
     signed_t res = pow(base, exp);
-    vm.push(res);
+    vm.push(vm.ctx, res);
+}
+
+// (w) milliseconds since the VM first called it, for timing guest code
+static void test_clock(vm_utilities_t vm, signed_t (*regs)[33])
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(!*vm.state) {
+        *vm.state = malloc(sizeof(struct timespec));
+        *(struct timespec*)*vm.state = now;
+    }
+    struct timespec* start = (struct timespec*)*vm.state;
+    long ms = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+    vm.push(vm.ctx, ms);
 }
 
 utility_lib_t initialize()
@@ -23,12 +39,18 @@ utility_lib_t initialize()
     static utility_fn utils[] = {
         &test_printnum,
         &test_pow,
+        &test_clock,
     };
 
     static utility_lib_t ret = {
-        2,
+        3,
         utils
     };
 
     return ret;
 }
+
+void release(void* state)
+{
+    free(state);
+}
@@ -0,0 +1,87 @@
+; commits per second under each durability level: none, on commit and
+; every 10ms; each transaction writes four words of the save data; logs
+; the number of commits in one second as two words, high word first
+.data
+:testlib 10 'testutils', 0
+
+.code
+    PI  0               ; bench(none)
+    PI  :bench
+    CA
+    PI  1               ; bench(on commit)
+    PI  :bench
+    CA
+    PI  2               ; bench(every 10ms)
+    PI  :bench
+    CA
+    PI  54              ; store_sync()
+    IN
+    HL
+
+;==========================================
+; bench(wLevel)
+:bench
+    PR.0                ; wLevel
+    PI  10              ; set_durability(wLevel, 10)
+    RP.0
+    PI  58
+    IN
+    PI  0               ; n = 0, as R.17:R.16
+    PR.16
+    PI  0
+    PR.17
+    PI  2               ; t0 = clock()
+    PI  :testlib
+    PI  20
+    IN
+    PR.18
+:bench_loop
+    PI  55              ; txn_begin()
+    IN
+    RP.16               ; write_save_word(0..3, n)
+    PI  0
+    PI  11
+    IN
+    RP.16
+    PI  1
+    PI  11
+    IN
+    RP.16
+    PI  2
+    PI  11
+    IN
+    RP.16
+    PI  3
+    PI  11
+    IN
+    PI  56              ; txn_commit()
+    IN
+    RI.16               ; ++n
+    RP.16
+    PI  :bench_carry
+    JZ
+    PI  :bench_time
+    JP
+:bench_carry
+    RI.17
+:bench_time
+    PI  2               ; if(clock() - t0 < 1000) loop
+    PI  :testlib
+    PI  20
+    IN
+    RP.18
+    SU
+    PI  1000
+    CS
+    PI  :bench_done
+    JZ
+    PI  :bench_loop
+    JP
+:bench_done
+    RP.17               ; log_word(n >> 16), log_word(n & 0xFFFF)
+    PI  3
+    IN
+    RP.16
+    PI  3
+    IN
+    RT
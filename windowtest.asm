@@ -0,0 +1,60 @@
+; writes through a file window, then reads it back through a read only one
+.data
+:file   15  'windowtest.dat', 0
+
+.code
+    PI  1               ; w = map_window(@file, 0x8000, 2048, writable)
+    PI  2048
+    PI  0x8000
+    PI  :file
+    PI  40
+    IN
+    PR.16
+    PI  0x8000          ; [0x8000] = 42
+    PI  42
+    ST
+    PI  0x87FF          ; [0x87FF] = 7
+    PI  7
+    ST
+    RP.16               ; sync_window(w)
+    PI  42
+    IN
+    RP.16               ; unmap_window(w)
+    PI  43
+    IN
+    PI  0x8000          ; log_word([0x8000]), back to 0
+    LD
+    PI  3
+    IN
+
+    PI  0               ; w = map_window(@file, 0x8000, 2048, read only)
+    PI  2048
+    PI  0x8000
+    PI  :file
+    PI  40
+    IN
+    PR.16
+    PI  0x8000          ; log_word([0x8000]): 42
+    LD
+    PI  3
+    IN
+    PI  0x87FF          ; log_word([0x87FF]): 7
+    LD
+    PI  3
+    IN
+    RP.16               ; log_word(window_file_size(w)): 2048
+    PI  44
+    IN
+    PI  3
+    IN
+    PI  3               ; log_word(high word): 0
+    IN
+    PI  1               ; move_window(w, 1), past the end of the file
+    RP.16
+    PI  41
+    IN
+    PI  0x8000          ; log_word([0x8000]): 0
+    LD
+    PI  3
+    IN
+    HL